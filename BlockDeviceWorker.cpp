@@ -0,0 +1,86 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BlockDeviceWorker.h"
+
+BlockDeviceWorker::BlockDeviceWorker(uint32_t stack_size)
+    : _thread(NULL), _stack_size(stack_size), _job_ready(0), _job_done(0),
+      _result(0), _busy(false), _stopping(false)
+{
+}
+
+BlockDeviceWorker::~BlockDeviceWorker()
+{
+    stop();
+}
+
+int BlockDeviceWorker::start()
+{
+    if (_thread) {
+        return BD_ERROR_OK;
+    }
+
+    _stopping = false;
+    _thread = new Thread(osPriorityNormal, _stack_size);
+    if (_thread->start(callback(this, &BlockDeviceWorker::_run)) != osOK) {
+        delete _thread;
+        _thread = NULL;
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return BD_ERROR_OK;
+}
+
+void BlockDeviceWorker::stop()
+{
+    if (!_thread) {
+        return;
+    }
+
+    if (_busy) {
+        wait();
+    }
+    _stopping = true;
+    _job_ready.release();
+    _thread->join();
+    delete _thread;
+    _thread = NULL;
+}
+
+void BlockDeviceWorker::post(Callback<int()> job)
+{
+    _job = job;
+    _busy = true;
+    _job_ready.release();
+}
+
+int BlockDeviceWorker::wait()
+{
+    _job_done.wait();
+    return _result;
+}
+
+void BlockDeviceWorker::_run()
+{
+    while (true) {
+        _job_ready.wait();
+        if (_stopping) {
+            return;
+        }
+        _result = _job();
+        _busy = false;
+        _job_done.release();
+    }
+}
@@ -0,0 +1,90 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_BLOCK_DEVICE_WORKER_H
+#define MBED_BLOCK_DEVICE_WORKER_H
+
+#include "mbed.h"
+#include "rtos.h"
+
+#ifndef MBED_CONF_SD_WORKER_STACK_SIZE
+#define MBED_CONF_SD_WORKER_STACK_SIZE  1024    /*!< Stack size of block device worker threads */
+#endif
+
+/** Thread that runs jobs on behalf of a layered block device
+ *
+ *  Layered block devices such as StripedBlockDevice own one worker per member
+ *  device, so that transfers to members on separate SPI buses run concurrently.
+ *  A worker runs one job at a time: post() hands it over and wait() joins it.
+ */
+class BlockDeviceWorker {
+public:
+    /** Lifetime of a worker
+     *
+     *  @param stack_size   Stack size of the worker thread in bytes
+     */
+    BlockDeviceWorker(uint32_t stack_size = MBED_CONF_SD_WORKER_STACK_SIZE);
+    ~BlockDeviceWorker();
+
+    /** Start the worker thread
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int start();
+
+    /** Stop the worker thread
+     *
+     *  Waits for the current job to complete before the thread exits.
+     */
+    void stop();
+
+    /** Hand a job to the worker
+     *
+     *  The worker must be idle, that is every post() must be paired with a wait().
+     *
+     *  @param job      Job to run, returns 0 on success or a negative error code
+     */
+    void post(Callback<int()> job);
+
+    /** Wait for the posted job to complete
+     *
+     *  @return         Result of the job
+     */
+    int wait();
+
+    /** Check whether a job is in progress
+     *
+     *  @return         true if a job has been posted and not yet completed
+     */
+    bool busy() const
+    {
+        return _busy;
+    }
+
+private:
+    void _run();
+
+    Thread *_thread;
+    uint32_t _stack_size;
+    Semaphore _job_ready;
+    Semaphore _job_done;
+    Callback<int()> _job;
+    volatile int _result;
+    volatile bool _busy;
+    volatile bool _stopping;
+};
+
+#endif  /* MBED_BLOCK_DEVICE_WORKER_H */
@@ -0,0 +1,410 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Segments
+ * --------
+ * Each buffered segment remembers which of its program blocks hold data with a
+ * bitmap. A complete segment is written with one program() of segment_size
+ * bytes. A partial segment is written run by run, one program() per contiguous
+ * range of buffered blocks, so blocks that were never programmed through this
+ * layer are left untouched on the card.
+ *
+ * When a program needs a segment that is not buffered and every buffer is in
+ * use, the least recently used segment is written out to make room.
+ */
+
+#include "CoalescingBlockDevice.h"
+#include "mbed_debug.h"
+#include <string.h>
+#include <algorithm>
+
+#define COALESCE_DBG 0
+
+CoalescingBlockDevice::CoalescingBlockDevice(BlockDevice *bd, bd_size_t segment_size, size_t segments)
+    : _bd(bd), _segment_size(segment_size), _segment_count(segments), _blocks_per_segment(0),
+      _program_size(0), _segments(NULL), _use_count(0), _init_ref_count(0), _is_initialized(false)
+{
+}
+
+CoalescingBlockDevice::~CoalescingBlockDevice()
+{
+    if (_is_initialized) {
+        _init_ref_count = 1;
+        deinit();
+    }
+}
+
+int CoalescingBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count != 1) {
+        goto end;
+    }
+
+    err = _bd->init();
+    if (err) {
+        goto fail;
+    }
+
+    _program_size = _bd->get_program_size();
+    if ((_segment_count == 0) || (_segment_size == 0) || (_segment_size % _program_size) ||
+            (_segment_size % _bd->get_erase_size())) {
+        debug_if(COALESCE_DBG, "Segment size %llu not a multiple of the erase size\n", _segment_size);
+        err = BD_ERROR_DEVICE_ERROR;
+        goto fail_bd;
+    }
+    _blocks_per_segment = _segment_size / _program_size;
+
+    _segments = new segment_t[_segment_count];
+    for (size_t i = 0; i < _segment_count; i++) {
+        _segments[i].buffer = new uint8_t[_segment_size];
+        _segments[i].valid = new uint32_t[(_blocks_per_segment + 31) / 32];
+        _segments[i].used = false;
+    }
+
+    _is_initialized = true;
+    goto end;
+
+fail_bd:
+    _bd->deinit();
+fail:
+    _init_ref_count = 0;
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int CoalescingBlockDevice::deinit()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+        goto end;
+    }
+
+    _init_ref_count--;
+
+    if (_init_ref_count) {
+        goto end;
+    }
+
+    err = _flush_all();
+    _free_buffers();
+    _is_initialized = false;
+
+    {
+        int bd_err = _bd->deinit();
+        if (!err) {
+            err = bd_err;
+        }
+    }
+
+end:
+    _mutex.unlock();
+    return err;
+}
+
+void CoalescingBlockDevice::_free_buffers()
+{
+    for (size_t i = 0; i < _segment_count; i++) {
+        delete[] _segments[i].buffer;
+        delete[] _segments[i].valid;
+    }
+    delete[] _segments;
+    _segments = NULL;
+}
+
+int CoalescingBlockDevice::sync()
+{
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    int err = _flush_all();
+    if (!err) {
+        err = _bd->sync();
+    }
+    _mutex.unlock();
+    return err;
+}
+
+int CoalescingBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_read(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(b);
+    int err = _bd->read(buffer, addr, size);
+
+    // Overlay data that is still buffered, it is newer than the card's
+    for (size_t i = 0; i < _segment_count && !err; i++) {
+        segment_t *segment = &_segments[i];
+        if (!segment->used || (segment->addr + _segment_size <= addr) || (addr + size <= segment->addr)) {
+            continue;
+        }
+
+        bd_addr_t lo = std::max(segment->addr, addr);
+        bd_addr_t hi = std::min(segment->addr + _segment_size, addr + size);
+        for (bd_addr_t a = lo - (lo % _program_size); a < hi; a += _program_size) {
+            if (!_is_valid(segment, (a - segment->addr) / _program_size)) {
+                continue;
+            }
+            bd_addr_t copy_lo = std::max(a, lo);
+            bd_addr_t copy_hi = std::min(a + _program_size, hi);
+            memcpy(buffer + (copy_lo - addr), segment->buffer + (copy_lo - segment->addr), copy_hi - copy_lo);
+        }
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int CoalescingBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_program(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    const uint8_t *buffer = static_cast<const uint8_t *>(b);
+    int err = BD_ERROR_OK;
+
+    while (size && !err) {
+        bd_addr_t segment_addr = addr - (addr % _segment_size);
+        bd_size_t chunk = std::min(size, segment_addr + _segment_size - addr);
+        segment_t *segment = _find(segment_addr);
+
+        if (!segment && (chunk == _segment_size)) {
+            // Whole aligned segment, nothing to coalesce with
+            err = _bd->program(buffer, addr, chunk);
+        } else {
+            if (!segment) {
+                err = _get(segment_addr, &segment);
+                if (err) {
+                    break;
+                }
+            }
+
+            memcpy(segment->buffer + (addr - segment_addr), buffer, chunk);
+            size_t first = (addr - segment_addr) / _program_size;
+            for (size_t block = first; block < first + chunk / _program_size; block++) {
+                _set_valid(segment, block, true);
+            }
+            segment->last_use = ++_use_count;
+
+            if (segment->valid_count == _blocks_per_segment) {
+                err = _flush(segment);
+            }
+        }
+
+        buffer += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int CoalescingBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_erase(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    // Buffered data in the range is no longer wanted
+    for (size_t i = 0; i < _segment_count; i++) {
+        segment_t *segment = &_segments[i];
+        if (!segment->used || (segment->addr + _segment_size <= addr) || (addr + size <= segment->addr)) {
+            continue;
+        }
+
+        bd_addr_t lo = std::max(segment->addr, addr);
+        bd_addr_t hi = std::min(segment->addr + _segment_size, addr + size);
+        for (bd_addr_t a = lo; a < hi; a += _program_size) {
+            _set_valid(segment, (a - segment->addr) / _program_size, false);
+        }
+        if (!segment->valid_count) {
+            segment->used = false;
+        }
+    }
+
+    int err = _bd->trim(addr, size);
+    _mutex.unlock();
+    return err;
+}
+
+bd_size_t CoalescingBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t CoalescingBlockDevice::get_program_size() const
+{
+    return _bd->get_program_size();
+}
+
+bd_size_t CoalescingBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size();
+}
+
+bd_size_t CoalescingBlockDevice::size() const
+{
+    return _bd->size();
+}
+
+bd_size_t CoalescingBlockDevice::get_segment_size() const
+{
+    return _segment_size;
+}
+
+CoalescingBlockDevice::segment_t *CoalescingBlockDevice::_find(bd_addr_t addr)
+{
+    for (size_t i = 0; i < _segment_count; i++) {
+        if (_segments[i].used && (_segments[i].addr == addr)) {
+            return &_segments[i];
+        }
+    }
+    return NULL;
+}
+
+int CoalescingBlockDevice::_get(bd_addr_t addr, segment_t **segment)
+{
+    segment_t *victim = NULL;
+
+    for (size_t i = 0; i < _segment_count; i++) {
+        if (!_segments[i].used) {
+            victim = &_segments[i];
+            break;
+        }
+        if (!victim || (_segments[i].last_use - victim->last_use) > (uint32_t)INT32_MAX) {
+            victim = &_segments[i];
+        }
+    }
+
+    if (victim->used) {
+        int err = _flush(victim);
+        if (err) {
+            return err;
+        }
+    }
+
+    victim->addr = addr;
+    victim->valid_count = 0;
+    memset(victim->valid, 0, ((_blocks_per_segment + 31) / 32) * sizeof(uint32_t));
+    victim->used = true;
+    *segment = victim;
+    return BD_ERROR_OK;
+}
+
+int CoalescingBlockDevice::_flush(segment_t *segment)
+{
+    int err = BD_ERROR_OK;
+
+    if (segment->valid_count == _blocks_per_segment) {
+        err = _bd->program(segment->buffer, segment->addr, _segment_size);
+    } else {
+        // Partial segment, write each run of buffered blocks
+        size_t block = 0;
+        while (block < _blocks_per_segment && !err) {
+            if (!_is_valid(segment, block)) {
+                block++;
+                continue;
+            }
+            size_t run = block;
+            while (run < _blocks_per_segment && _is_valid(segment, run)) {
+                run++;
+            }
+            err = _bd->program(segment->buffer + block * _program_size,
+                               segment->addr + block * _program_size, (run - block) * _program_size);
+            block = run;
+        }
+    }
+
+    if (err) {
+        debug_if(COALESCE_DBG, "Segment flush at 0x%llx failed: %d\n", segment->addr, err);
+        return err;
+    }
+    segment->used = false;
+    return BD_ERROR_OK;
+}
+
+int CoalescingBlockDevice::_flush_all()
+{
+    int err = BD_ERROR_OK;
+
+    for (size_t i = 0; i < _segment_count; i++) {
+        if (_segments[i].used) {
+            int segment_err = _flush(&_segments[i]);
+            if (!err) {
+                err = segment_err;
+            }
+        }
+    }
+    return err;
+}
+
+bool CoalescingBlockDevice::_is_valid(segment_t *segment, size_t block) const
+{
+    return (segment->valid[block / 32] >> (block % 32)) & 1;
+}
+
+void CoalescingBlockDevice::_set_valid(segment_t *segment, size_t block, bool valid)
+{
+    uint32_t mask = 1UL << (block % 32);
+    bool was_valid = segment->valid[block / 32] & mask;
+
+    if (valid && !was_valid) {
+        segment->valid[block / 32] |= mask;
+        segment->valid_count++;
+    } else if (!valid && was_valid) {
+        segment->valid[block / 32] &= ~mask;
+        segment->valid_count--;
+    }
+}
@@ -0,0 +1,178 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_COALESCING_BLOCK_DEVICE_H
+#define MBED_COALESCING_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "mbed.h"
+#include "platform/PlatformMutex.h"
+
+#ifndef MBED_CONF_SD_COALESCE_SEGMENT_SIZE
+#define MBED_CONF_SD_COALESCE_SEGMENT_SIZE  16384   /*!< Size of a write segment in bytes */
+#endif
+
+#ifndef MBED_CONF_SD_COALESCE_SEGMENTS
+#define MBED_CONF_SD_COALESCE_SEGMENTS      2       /*!< Number of segments buffered at a time */
+#endif
+
+/** Block device coalescing small programs into large aligned writes
+ *
+ *  Programs are collected in RAM segments of segment_size bytes, aligned to
+ *  segment_size on the underlying device. A segment is written as soon as it is
+ *  complete, with a single program() of the whole segment, which SDBlockDevice
+ *  issues as one CMD25 preceded by an ACMD23 pre-erase hint. Partially filled
+ *  segments are written when their buffer is needed for another segment and on
+ *  sync() and deinit().
+ *
+ *  SD cards only reach their speed class when written in whole allocation
+ *  units, so segment_size is best set to SDBlockDevice::get_allocation_unit_size()
+ *  when there is enough RAM, or to a large power of two dividing it otherwise.
+ *
+ *  Reads return buffered data that has not been written yet. Data still in a
+ *  buffer is lost on power failure, call sync() to make it persistent.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "CoalescingBlockDevice.h"
+ *
+ * SDBlockDevice sd(p5, p6, p7, p8);
+ * CoalescingBlockDevice coalesced(&sd, 32 * 1024);
+ * @endcode
+ */
+class CoalescingBlockDevice : public BlockDevice {
+public:
+    /** Lifetime of the coalescing block device
+     *
+     *  @param bd               Underlying block device
+     *  @param segment_size     Size of a segment in bytes, must be a multiple of the
+     *                          program size of the underlying device
+     *  @param segments         Number of segments buffered at a time
+     */
+    CoalescingBlockDevice(BlockDevice *bd,
+                          bd_size_t segment_size = MBED_CONF_SD_COALESCE_SEGMENT_SIZE,
+                          size_t segments = MBED_CONF_SD_COALESCE_SEGMENTS);
+    virtual ~CoalescingBlockDevice();
+
+    /** Initialize the underlying block device and allocate the segment buffers
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Write buffered segments and deinitialize the underlying block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Write every buffered segment to the underlying block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the block device
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Mark blocks as no longer in use
+     *
+     *  Buffered data for the blocks is dropped.
+     *
+     *  @param addr     Address of block to mark as unused
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Get the size of a segment
+     *
+     *  @return         Size of a segment in bytes
+     */
+    bd_size_t get_segment_size() const;
+
+private:
+    struct segment_t {
+        bd_addr_t addr;             /**< Address of the segment on the underlying device */
+        uint8_t *buffer;
+        uint32_t *valid;            /**< One bit per program block holding buffered data */
+        size_t valid_count;
+        uint32_t last_use;
+        bool used;
+    };
+
+    segment_t *_find(bd_addr_t addr);
+    int _get(bd_addr_t addr, segment_t **segment);
+    int _flush(segment_t *segment);
+    int _flush_all();
+    bool _is_valid(segment_t *segment, size_t block) const;
+    void _set_valid(segment_t *segment, size_t block, bool valid);
+    void _free_buffers();
+
+    BlockDevice *_bd;
+    bd_size_t _segment_size;
+    size_t _segment_count;
+    size_t _blocks_per_segment;
+    bd_size_t _program_size;
+    segment_t *_segments;
+    uint32_t _use_count;
+
+    PlatformMutex _mutex;
+    uint32_t _init_ref_count;
+    bool _is_initialized;
+};
+
+#endif  /* MBED_COALESCING_BLOCK_DEVICE_H */
@@ -0,0 +1,699 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Layout
+ * ------
+ * The underlying device is split in segments of segment_size bytes:
+ *
+ *   | checkpoint 0 | checkpoint 1 | segment 0 | segment 1 | ... |
+ *
+ * Each checkpoint area is a whole number of segments and holds a header block
+ * followed by the mapping table. Checkpoints alternate between the two areas,
+ * the one with the highest sequence number and a matching table CRC wins. The
+ * table is written before the header, so a checkpoint interrupted by a power
+ * failure leaves the previous one in place.
+ *
+ * A physical slot number is segment * blocks_per_segment + block in segment.
+ *
+ * Segment reuse
+ * -------------
+ * A segment whose live blocks have all been rewritten or trimmed may still be
+ * referenced by the last checkpoint on the card. It is therefore only marked
+ * pending, and becomes free, and is trimmed, once the next checkpoint has been
+ * written. Garbage collection picks the used segment with the fewest live
+ * blocks, finds them by scanning the mapping table and appends them to the
+ * head. GC_RESERVE segments are kept for its own appends, so it can always
+ * make progress.
+ */
+
+#include "LogBlockDevice.h"
+#include "mbed_debug.h"
+#include <string.h>
+#include <algorithm>
+
+#define LOG_DBG 0
+
+#define LOG_MAGIC           0x474c4453      // "SDLG"
+#define LOG_VERSION         1
+#define LOG_UNMAPPED        0xffffffffUL
+#define LOG_NO_SEGMENT      0xffffffffUL
+#define LOG_GC_RESERVE      2
+
+LogBlockDevice::LogBlockDevice(BlockDevice *bd, bd_size_t block_size, bd_size_t segment_size)
+    : _bd(bd), _block_size(block_size), _segment_size(segment_size), _checkpoint_size(0),
+      _blocks_per_segment(0), _segment_count(0), _block_count(0),
+      _map(NULL), _valid(NULL), _state(NULL), _buffer(NULL),
+      _free_count(0), _pending_count(0), _head(LOG_NO_SEGMENT), _head_slot(0),
+      _sequence(0), _checkpoint_slot(0), _gc_thread(NULL), _gc_stop(false),
+      _init_ref_count(0), _is_initialized(false)
+{
+}
+
+LogBlockDevice::~LogBlockDevice()
+{
+    if (_is_initialized) {
+        _init_ref_count = 1;
+        deinit();
+    }
+}
+
+int LogBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+    uint32_t total;
+    uint32_t checkpoint_segments;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count != 1) {
+        goto end;
+    }
+
+    err = _bd->init();
+    if (err) {
+        goto fail;
+    }
+
+    if ((_block_size == 0) || (_block_size % _bd->get_program_size()) ||
+            (_segment_size % _block_size) || (_segment_size % _bd->get_erase_size()) ||
+            (_segment_size / _block_size > 0xffff)) {
+        debug_if(LOG_DBG, "Block size %llu or segment size %llu invalid\n", _block_size, _segment_size);
+        err = BD_ERROR_DEVICE_ERROR;
+        goto fail_bd;
+    }
+
+    // Size the checkpoint areas for the largest table the device could need
+    _blocks_per_segment = _segment_size / _block_size;
+    total = _bd->size() / _segment_size;
+    checkpoint_segments = (_block_size + 4 * (bd_size_t)total * _blocks_per_segment + _segment_size - 1) / _segment_size;
+    if (total < 2 * checkpoint_segments + LOG_GC_RESERVE + 2) {
+        debug_if(LOG_DBG, "Device too small for a log of %llu byte segments\n", _segment_size);
+        err = BD_ERROR_DEVICE_ERROR;
+        goto fail_bd;
+    }
+    _checkpoint_size = checkpoint_segments * _segment_size;
+    _segment_count = total - 2 * checkpoint_segments;
+    _block_count = (uint64_t)(_segment_count - LOG_GC_RESERVE - 1) * _blocks_per_segment *
+                   (100 - MBED_CONF_SD_LOG_OVERPROVISION) / 100;
+
+    {
+        size_t map_words = (4 * (bd_size_t)_block_count + _block_size - 1) / _block_size * _block_size / 4;
+        _map = new uint32_t[map_words];
+        memset(_map, 0xff, map_words * sizeof(uint32_t));
+        _valid = new uint16_t[_segment_count];
+        _state = new uint8_t[_segment_count];
+        _buffer = new uint8_t[_block_size];
+    }
+
+    err = _load_checkpoint();
+    if (err) {
+        goto fail_tables;
+    }
+
+    _is_initialized = true;
+
+    _gc_stop = false;
+    _gc_thread = new Thread(osPriorityBelowNormal, MBED_CONF_SD_LOG_GC_STACK_SIZE);
+    if (_gc_thread->start(callback(this, &LogBlockDevice::_gc_run)) != osOK) {
+        // Segments are still reclaimed when a program runs out of them
+        debug_if(LOG_DBG, "No background garbage collection\n");
+        delete _gc_thread;
+        _gc_thread = NULL;
+    }
+    goto end;
+
+fail_tables:
+    _free_tables();
+fail_bd:
+    _bd->deinit();
+fail:
+    _init_ref_count = 0;
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int LogBlockDevice::deinit()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+        _mutex.unlock();
+        return BD_ERROR_OK;
+    }
+
+    _init_ref_count--;
+
+    if (_init_ref_count) {
+        _mutex.unlock();
+        return BD_ERROR_OK;
+    }
+
+    err = _checkpoint();
+    _is_initialized = false;
+    _mutex.unlock();
+
+    // The collector takes the mutex, join it without holding it
+    if (_gc_thread) {
+        _gc_stop = true;
+        _gc_flags.set(GC_STOP);
+        _gc_thread->join();
+        delete _gc_thread;
+        _gc_thread = NULL;
+    }
+
+    _mutex.lock();
+    _free_tables();
+    int bd_err = _bd->deinit();
+    if (!err) {
+        err = bd_err;
+    }
+    _mutex.unlock();
+    return err;
+}
+
+void LogBlockDevice::_free_tables()
+{
+    delete[] _map;
+    delete[] _valid;
+    delete[] _state;
+    delete[] _buffer;
+    _map = NULL;
+    _valid = NULL;
+    _state = NULL;
+    _buffer = NULL;
+}
+
+int LogBlockDevice::sync()
+{
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    int err = _checkpoint();
+    _mutex.unlock();
+    return err;
+}
+
+int LogBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_read(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(b);
+    int err = BD_ERROR_OK;
+
+    while (size && !err) {
+        uint32_t block = addr / _block_size;
+        bd_size_t offset = addr % _block_size;
+        bd_size_t chunk = std::min(size, _block_size - offset);
+        uint32_t slot = _map[block];
+
+        if (slot == LOG_UNMAPPED) {
+            memset(buffer, 0xff, chunk);
+        } else {
+            bd_addr_t phys = _segment_addr(slot / _blocks_per_segment) +
+                             (slot % _blocks_per_segment) * _block_size + offset;
+
+            // Extend over following blocks that were appended right after this one
+            while ((chunk < size) && ((slot + 1) % _blocks_per_segment) &&
+                    (_map[block + 1] == slot + 1)) {
+                block++;
+                slot++;
+                chunk = std::min(size, chunk + _block_size);
+            }
+            err = _bd->read(buffer, phys, chunk);
+        }
+
+        buffer += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int LogBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_program(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    const uint8_t *buffer = static_cast<const uint8_t *>(b);
+    uint32_t block = addr / _block_size;
+    uint32_t count = size / _block_size;
+    int err = BD_ERROR_OK;
+
+    while (count && !err) {
+        uint32_t written = 0;
+        err = _append(buffer, block, count, false, &written);
+        buffer += written * _block_size;
+        block += written;
+        count -= written;
+    }
+
+    if (_free_count < MBED_CONF_SD_LOG_GC_THRESHOLD) {
+        _gc_flags.set(GC_WAKE);
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int LogBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_erase(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    // The space is reclaimed with the segments it belongs to
+    for (uint32_t block = addr / _block_size; block < (addr + size) / _block_size; block++) {
+        _unmap(block);
+    }
+
+    _mutex.unlock();
+    return BD_ERROR_OK;
+}
+
+bd_size_t LogBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t LogBlockDevice::get_program_size() const
+{
+    return _block_size;
+}
+
+bd_size_t LogBlockDevice::get_erase_size() const
+{
+    return _block_size;
+}
+
+bd_size_t LogBlockDevice::size() const
+{
+    return _block_size * _block_count;
+}
+
+int LogBlockDevice::collect()
+{
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    // Nothing to reclaim is not an error here
+    int err = BD_ERROR_OK;
+    if (_victim() != LOG_NO_SEGMENT) {
+        err = _collect();
+    }
+    if (!err) {
+        err = _checkpoint();
+    }
+    _mutex.unlock();
+    return err;
+}
+
+size_t LogBlockDevice::get_free_segments() const
+{
+    return _free_count;
+}
+
+bd_addr_t LogBlockDevice::_segment_addr(uint32_t segment) const
+{
+    return 2 * _checkpoint_size + (bd_addr_t)segment * _segment_size;
+}
+
+int LogBlockDevice::_read_checkpoint(size_t slot, checkpoint_t *header)
+{
+    int err = _bd->read(_buffer, slot * _checkpoint_size, _block_size);
+    if (err) {
+        return err;
+    }
+    memcpy(header, _buffer, sizeof(checkpoint_t));
+
+    if ((header->magic != LOG_MAGIC) || (header->version != LOG_VERSION)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return BD_ERROR_OK;
+}
+
+int LogBlockDevice::_load_checkpoint()
+{
+    checkpoint_t headers[2];
+    bool found[2];
+    bd_size_t map_size = (4 * (bd_size_t)_block_count + _block_size - 1) / _block_size * _block_size;
+
+    for (size_t slot = 0; slot < 2; slot++) {
+        found[slot] = (_read_checkpoint(slot, &headers[slot]) == BD_ERROR_OK);
+        if (found[slot] && ((headers[slot].block_size != _block_size) ||
+                            (headers[slot].segment_size != _segment_size) ||
+                            (headers[slot].segment_count != _segment_count) ||
+                            (headers[slot].block_count != _block_count))) {
+            debug_if(LOG_DBG, "Checkpoint %d was written with a different geometry\n", slot);
+            return BD_ERROR_DEVICE_ERROR;
+        }
+    }
+
+    // Newest first, fall back to the other one if its table is damaged
+    size_t order[2] = {0, 1};
+    if (found[1] && (!found[0] || (int32_t)(headers[1].sequence - headers[0].sequence) > 0)) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+
+    bool loaded = false;
+    for (size_t i = 0; i < 2 && !loaded; i++) {
+        size_t slot = order[i];
+        if (!found[slot]) {
+            continue;
+        }
+
+        int err = _bd->read(_map, slot * _checkpoint_size + _block_size, map_size);
+        if (err) {
+            return err;
+        }
+
+        MbedCRC<POLY_32BIT_ANSI, 32> crc32;
+        uint32_t crc;
+        crc32.compute(_map, map_size, &crc);
+        if (crc != headers[slot].map_crc) {
+            debug_if(LOG_DBG, "Checkpoint %d table CRC mismatch\n", slot);
+            continue;
+        }
+
+        _sequence = headers[slot].sequence;
+        _checkpoint_slot = slot;
+        loaded = true;
+    }
+
+    if (!loaded) {
+        // Fresh device, or no usable checkpoint: every block reads as erased
+        memset(_map, 0xff, map_size);
+        _sequence = 0;
+        _checkpoint_slot = 1;
+    }
+
+    memset(_valid, 0, _segment_count * sizeof(uint16_t));
+    for (uint32_t block = 0; block < _block_count; block++) {
+        if (_map[block] != LOG_UNMAPPED) {
+            _valid[_map[block] / _blocks_per_segment]++;
+        }
+    }
+
+    _free_count = 0;
+    _pending_count = 0;
+    for (uint32_t segment = 0; segment < _segment_count; segment++) {
+        _state[segment] = _valid[segment] ? SEGMENT_USED : SEGMENT_FREE;
+        _free_count += _valid[segment] ? 0 : 1;
+    }
+    _head = LOG_NO_SEGMENT;
+    _head_slot = 0;
+
+    debug_if(LOG_DBG, "Log of %d blocks, %d of %d segments free, checkpoint %d\n",
+             _block_count, _free_count, _segment_count, _sequence);
+    return BD_ERROR_OK;
+}
+
+int LogBlockDevice::_checkpoint()
+{
+    bd_size_t map_size = (4 * (bd_size_t)_block_count + _block_size - 1) / _block_size * _block_size;
+    size_t slot = _checkpoint_slot ^ 1;
+    bd_addr_t addr = slot * _checkpoint_size;
+    int err;
+
+    err = _bd->erase(addr, _checkpoint_size);
+    if (err) {
+        return err;
+    }
+
+    // Table first, the header makes the checkpoint valid
+    err = _bd->program(_map, addr + _block_size, map_size);
+    if (err) {
+        return err;
+    }
+
+    checkpoint_t header;
+    MbedCRC<POLY_32BIT_ANSI, 32> crc32;
+    header.magic = LOG_MAGIC;
+    header.version = LOG_VERSION;
+    header.sequence = _sequence + 1;
+    header.block_size = _block_size;
+    header.segment_size = _segment_size;
+    header.segment_count = _segment_count;
+    header.block_count = _block_count;
+    crc32.compute(_map, map_size, &header.map_crc);
+
+    memset(_buffer, 0xff, _block_size);
+    memcpy(_buffer, &header, sizeof(header));
+    err = _bd->program(_buffer, addr, _block_size);
+    if (!err) {
+        err = _bd->sync();
+    }
+    if (err) {
+        return err;
+    }
+
+    _sequence++;
+    _checkpoint_slot = slot;
+
+    // Nothing on the card refers to pending segments any more
+    for (uint32_t segment = 0; segment < _segment_count && _pending_count; segment++) {
+        if (_state[segment] == SEGMENT_PENDING) {
+            _release(segment);
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+void LogBlockDevice::_release(uint32_t segment)
+{
+    int err = _bd->trim(_segment_addr(segment), _segment_size);
+    if (err) {
+        // Trim is a hint, the segment is reusable either way
+        debug_if(LOG_DBG, "Trim of segment %d failed: %d\n", segment, err);
+    }
+    _state[segment] = SEGMENT_FREE;
+    _pending_count--;
+    _free_count++;
+}
+
+void LogBlockDevice::_unmap(uint32_t block)
+{
+    uint32_t slot = _map[block];
+    if (slot == LOG_UNMAPPED) {
+        return;
+    }
+
+    uint32_t segment = slot / _blocks_per_segment;
+    _map[block] = LOG_UNMAPPED;
+    _valid[segment]--;
+    if (!_valid[segment] && (_state[segment] == SEGMENT_USED)) {
+        _state[segment] = SEGMENT_PENDING;
+        _pending_count++;
+    }
+}
+
+int LogBlockDevice::_append(const uint8_t *buffer, uint32_t block, uint32_t count, bool gc, uint32_t *written)
+{
+    *written = 0;
+
+    if ((_head == LOG_NO_SEGMENT) || (_head_slot == _blocks_per_segment)) {
+        int err = _open_head(gc);
+        if (err) {
+            return err;
+        }
+    }
+
+    uint32_t n = std::min(count, _blocks_per_segment - _head_slot);
+    int err = _bd->program(buffer, _segment_addr(_head) + _head_slot * _block_size, n * _block_size);
+    if (err) {
+        // The slots may hold part of the data, skip them
+        _head_slot = _blocks_per_segment;
+        return err;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        _unmap(block + i);
+        _map[block + i] = _head * _blocks_per_segment + _head_slot + i;
+    }
+    _valid[_head] += n;
+    _head_slot += n;
+    *written = n;
+    return BD_ERROR_OK;
+}
+
+int LogBlockDevice::_open_head(bool gc)
+{
+    uint32_t reserve = gc ? 0 : LOG_GC_RESERVE;
+
+    while (true) {
+        if ((_head != LOG_NO_SEGMENT) && (_head_slot < _blocks_per_segment)) {
+            // Garbage collection opened a head with room left
+            return BD_ERROR_OK;
+        }
+
+        if (_head != LOG_NO_SEGMENT) {
+            if (_valid[_head]) {
+                _state[_head] = SEGMENT_USED;
+            } else {
+                _state[_head] = SEGMENT_PENDING;
+                _pending_count++;
+            }
+            _head = LOG_NO_SEGMENT;
+        }
+
+        if (_free_count > reserve) {
+            break;
+        }
+
+        int err;
+        if (_pending_count) {
+            err = _checkpoint();
+        } else if (!gc) {
+            err = _collect();
+        } else {
+            err = BD_ERROR_DEVICE_ERROR;
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    for (uint32_t segment = 0; segment < _segment_count; segment++) {
+        if (_state[segment] == SEGMENT_FREE) {
+            int err = _bd->erase(_segment_addr(segment), _segment_size);
+            if (err) {
+                return err;
+            }
+            _state[segment] = SEGMENT_OPEN;
+            _free_count--;
+            _head = segment;
+            _head_slot = 0;
+            return BD_ERROR_OK;
+        }
+    }
+    return BD_ERROR_DEVICE_ERROR;
+}
+
+uint32_t LogBlockDevice::_victim() const
+{
+    uint32_t victim = LOG_NO_SEGMENT;
+
+    for (uint32_t segment = 0; segment < _segment_count; segment++) {
+        if ((_state[segment] == SEGMENT_USED) && (_valid[segment] < _blocks_per_segment) &&
+                ((victim == LOG_NO_SEGMENT) || (_valid[segment] < _valid[victim]))) {
+            victim = segment;
+        }
+    }
+    return victim;
+}
+
+int LogBlockDevice::_collect()
+{
+    uint32_t victim = _victim();
+    if (victim == LOG_NO_SEGMENT) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    debug_if(LOG_DBG, "Collecting segment %d, %d live blocks\n", victim, _valid[victim]);
+
+    // Move the live blocks out, the victim turns pending when the last one leaves
+    for (uint32_t block = 0; block < _block_count && _valid[victim]; block++) {
+        if ((_map[block] == LOG_UNMAPPED) || (_map[block] / _blocks_per_segment != victim)) {
+            continue;
+        }
+
+        bd_addr_t phys = _segment_addr(victim) + (_map[block] % _blocks_per_segment) * _block_size;
+        int err = _bd->read(_buffer, phys, _block_size);
+        if (err) {
+            return err;
+        }
+
+        uint32_t written = 0;
+        while (!written) {
+            err = _append(_buffer, block, 1, true, &written);
+            if (err) {
+                return err;
+            }
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+void LogBlockDevice::_gc_run()
+{
+    while (!_gc_stop) {
+        _gc_flags.wait_any(GC_WAKE | GC_STOP);
+
+        // One segment per lock, so programs get through in between
+        while (!_gc_stop) {
+            int err;
+
+            _mutex.lock();
+            if (!_is_initialized) {
+                _mutex.unlock();
+                break;
+            }
+            if (_free_count + _pending_count < MBED_CONF_SD_LOG_GC_THRESHOLD) {
+                err = _collect();
+            } else if (_pending_count) {
+                err = _checkpoint();
+            } else {
+                _mutex.unlock();
+                break;
+            }
+            _mutex.unlock();
+
+            if (err) {
+                debug_if(LOG_DBG, "Background collection stopped: %d\n", err);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,241 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_LOG_BLOCK_DEVICE_H
+#define MBED_LOG_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "mbed.h"
+#include "rtos.h"
+#include "platform/PlatformMutex.h"
+
+#ifndef MBED_CONF_SD_LOG_BLOCK_SIZE
+#define MBED_CONF_SD_LOG_BLOCK_SIZE         4096    /*!< Size of a mapped logical block in bytes */
+#endif
+
+#ifndef MBED_CONF_SD_LOG_SEGMENT_SIZE
+#define MBED_CONF_SD_LOG_SEGMENT_SIZE       65536   /*!< Size of a log segment in bytes */
+#endif
+
+#ifndef MBED_CONF_SD_LOG_OVERPROVISION
+#define MBED_CONF_SD_LOG_OVERPROVISION      10      /*!< Percentage of the data segments kept free for garbage collection */
+#endif
+
+#ifndef MBED_CONF_SD_LOG_GC_THRESHOLD
+#define MBED_CONF_SD_LOG_GC_THRESHOLD       4       /*!< Free segments below which garbage is collected in the background */
+#endif
+
+#ifndef MBED_CONF_SD_LOG_GC_STACK_SIZE
+#define MBED_CONF_SD_LOG_GC_STACK_SIZE      1024    /*!< Stack size of the garbage collection thread */
+#endif
+
+/** Log-structured block device
+ *
+ *  Logical blocks are not written in place. Every program appends the data at
+ *  the head of the log, so the underlying device only ever sees sequential
+ *  writes, segment after segment, whatever the logical write pattern. A mapping
+ *  table in RAM records where each logical block lives. Segments whose blocks
+ *  have all been rewritten elsewhere are trimmed and reused; a background thread
+ *  reclaims partly stale segments by moving their live blocks to the head.
+ *
+ *  The mapping table is written to one of two checkpoint areas at the start of
+ *  the device on sync() and deinit(), and when reclaimed segments are released.
+ *  Programs are persistent once sync() returns. On init the latest checkpoint
+ *  is loaded; a device without a checkpoint starts out empty.
+ *
+ *  The table takes 4 bytes of RAM per logical block. To keep it small on large
+ *  cards, run the layer on a slice of the card (SlicingBlockDevice). Stacking it
+ *  on a CoalescingBlockDevice with the same segment size turns the appends into
+ *  whole-segment writes.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "SlicingBlockDevice.h"
+ * #include "LogBlockDevice.h"
+ *
+ * SDBlockDevice sd(p5, p6, p7, p8);
+ * SlicingBlockDevice slice(&sd, 0, 16 * 1024 * 1024);
+ * LogBlockDevice log(&slice);
+ * @endcode
+ */
+class LogBlockDevice : public BlockDevice {
+public:
+    /** Lifetime of the log-structured block device
+     *
+     *  @param bd               Underlying block device
+     *  @param block_size       Size of a logical block in bytes, a multiple of the
+     *                          program size of the underlying device
+     *  @param segment_size     Size of a segment in bytes, a multiple of block_size
+     *                          and of the erase size of the underlying device
+     */
+    LogBlockDevice(BlockDevice *bd,
+                   bd_size_t block_size = MBED_CONF_SD_LOG_BLOCK_SIZE,
+                   bd_size_t segment_size = MBED_CONF_SD_LOG_SEGMENT_SIZE);
+    virtual ~LogBlockDevice();
+
+    /** Initialize the block device and load the latest checkpoint
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Write a checkpoint and deinitialize the block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Write a checkpoint, making every completed program persistent
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the block device
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Mark blocks as no longer in use
+     *
+     *  The blocks read as 0xff until they are programmed again.
+     *
+     *  @param addr     Address of block to mark as unused
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a logical block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of a logical block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the logical size of the block device
+     *
+     *  @return         Size of the logical address space in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Reclaim one segment now
+     *
+     *  Moves the live blocks of the segment with the fewest live blocks to
+     *  the head of the log. Normally done in the background.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int collect();
+
+    /** Get the number of segments ready to be written
+     *
+     *  @return         Number of free segments
+     */
+    size_t get_free_segments() const;
+
+private:
+    enum segment_state_t {
+        SEGMENT_FREE,
+        SEGMENT_OPEN,           /**< Head of the log, being appended to */
+        SEGMENT_USED,
+        SEGMENT_PENDING,        /**< No live blocks, reusable after the next checkpoint */
+    };
+
+    enum {
+        GC_WAKE = (1 << 0),
+        GC_STOP = (1 << 1),
+    };
+
+    struct checkpoint_t {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sequence;
+        uint32_t block_size;
+        uint32_t segment_size;
+        uint32_t segment_count;
+        uint32_t block_count;
+        uint32_t map_crc;
+    };
+
+    int _load_checkpoint();
+    int _read_checkpoint(size_t slot, checkpoint_t *header);
+    int _checkpoint();
+    int _append(const uint8_t *buffer, uint32_t block, uint32_t count, bool gc, uint32_t *written);
+    int _open_head(bool gc);
+    uint32_t _victim() const;
+    int _collect();
+    void _unmap(uint32_t block);
+    void _release(uint32_t segment);
+    void _gc_run();
+    void _free_tables();
+
+    bd_addr_t _segment_addr(uint32_t segment) const;
+
+    BlockDevice *_bd;
+    bd_size_t _block_size;
+    bd_size_t _segment_size;
+    bd_size_t _checkpoint_size;     /**< Size of one checkpoint area, a whole number of segments */
+    uint32_t _blocks_per_segment;
+    uint32_t _segment_count;
+    uint32_t _block_count;
+
+    uint32_t *_map;                 /**< Physical slot of each logical block */
+    uint16_t *_valid;               /**< Live blocks in each segment */
+    uint8_t *_state;
+    uint8_t *_buffer;               /**< One logical block, for relocation and checkpoints */
+    uint32_t _free_count;
+    uint32_t _pending_count;
+    uint32_t _head;
+    uint32_t _head_slot;
+    uint32_t _sequence;
+    size_t _checkpoint_slot;
+
+    Thread *_gc_thread;
+    EventFlags _gc_flags;
+    volatile bool _gc_stop;
+
+    PlatformMutex _mutex;
+    uint32_t _init_ref_count;
+    bool _is_initialized;
+};
+
+#endif  /* MBED_LOG_BLOCK_DEVICE_H */
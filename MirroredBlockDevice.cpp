@@ -0,0 +1,364 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Read steering
+ * -------------
+ * Each member has its own mutex, held for the duration of a transfer on that
+ * member. Programs and trims take both mutexes, always in member order, and
+ * run on both members at once: the second member from its worker thread, the
+ * first from the calling thread. Reads take a single mutex, so two readers
+ * can be served by the two members at the same time.
+ *
+ * Every read records its duration per read block in a moving average
+ * (7/8 old + 1/8 new). A small read tries the member with the lower average
+ * first and falls back to the other one if the first is busy; if both are busy
+ * it queues on the faster one. A large read is split so that both members
+ * should finish at the same time, the faster member getting the larger share.
+ */
+
+#include "MirroredBlockDevice.h"
+#include "mbed_debug.h"
+#include <algorithm>
+
+#define MIRRORED_DBG 0
+
+MirroredBlockDevice::MirroredBlockDevice(BlockDevice *bd0, BlockDevice *bd1, bd_size_t split_size)
+    : _split_size(split_size), _size(0), _read_size(0), _program_size(0), _erase_size(0),
+      _reads(0), _init_ref_count(0), _is_initialized(false)
+{
+    BlockDevice *bds[MEMBERS] = {bd0, bd1};
+    for (size_t i = 0; i < MEMBERS; i++) {
+        _members[i].owner = this;
+        _members[i].bd = bds[i];
+        _members[i].worker = NULL;
+        _members[i].latency = 0;
+    }
+}
+
+MirroredBlockDevice::~MirroredBlockDevice()
+{
+    if (_is_initialized) {
+        _init_ref_count = 1;
+        deinit();
+    }
+}
+
+int MirroredBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+    size_t i;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count != 1) {
+        goto end;
+    }
+
+    for (i = 0; i < MEMBERS; i++) {
+        err = _members[i].bd->init();
+        if (err) {
+            goto fail_members;
+        }
+        _members[i].latency = 0;
+    }
+
+    _size = std::min(_members[0].bd->size(), _members[1].bd->size());
+    _read_size = std::max(_members[0].bd->get_read_size(), _members[1].bd->get_read_size());
+    _program_size = std::max(_members[0].bd->get_program_size(), _members[1].bd->get_program_size());
+    _erase_size = std::max(_members[0].bd->get_erase_size(), _members[1].bd->get_erase_size());
+
+    // The first member always runs from the calling thread
+    _members[1].worker = new BlockDeviceWorker();
+    err = _members[1].worker->start();
+    if (err) {
+        delete _members[1].worker;
+        _members[1].worker = NULL;
+        goto fail_members;
+    }
+
+    _is_initialized = true;
+    goto end;
+
+fail_members:
+    while (i--) {
+        _members[i].bd->deinit();
+    }
+    _init_ref_count = 0;
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int MirroredBlockDevice::deinit()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+        goto end;
+    }
+
+    _init_ref_count--;
+
+    if (_init_ref_count) {
+        goto end;
+    }
+
+    delete _members[1].worker;
+    _members[1].worker = NULL;
+    for (size_t i = 0; i < MEMBERS; i++) {
+        int member_err = _members[i].bd->deinit();
+        if (!err) {
+            err = member_err;
+        }
+    }
+    _is_initialized = false;
+
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int MirroredBlockDevice::sync()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+    for (size_t i = 0; i < MEMBERS && _is_initialized; i++) {
+        int member_err = _members[i].bd->sync();
+        if (!err) {
+            err = member_err;
+        }
+    }
+    _mutex.unlock();
+    return err;
+}
+
+int MirroredBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!_is_initialized || !is_valid_read(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(b);
+    if ((size >= _split_size) && (size >= 2 * _read_size)) {
+        return _read_split(buffer, addr, size);
+    }
+    return _read_one(buffer, addr, size);
+}
+
+int MirroredBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!_is_initialized || !is_valid_program(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return _both(OP_PROGRAM, static_cast<uint8_t *>(const_cast<void *>(b)), addr, size);
+}
+
+int MirroredBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    if (!_is_initialized || !is_valid_erase(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return _both(OP_TRIM, NULL, addr, size);
+}
+
+bd_size_t MirroredBlockDevice::get_read_size() const
+{
+    return _read_size;
+}
+
+bd_size_t MirroredBlockDevice::get_program_size() const
+{
+    return _program_size;
+}
+
+bd_size_t MirroredBlockDevice::get_erase_size() const
+{
+    return _erase_size;
+}
+
+bd_size_t MirroredBlockDevice::size() const
+{
+    return _size;
+}
+
+uint32_t MirroredBlockDevice::get_read_latency(size_t member) const
+{
+    return (member < MEMBERS) ? _members[member].latency : 0;
+}
+
+int MirroredBlockDevice::_member_job(member_t *member)
+{
+    return member->owner->_member_transfer(member);
+}
+
+int MirroredBlockDevice::_member_transfer(member_t *member)
+{
+    int err;
+
+    switch (member->op) {
+        case OP_READ: {
+            Timer timer;
+            timer.start();
+            err = member->bd->read(member->buffer, member->addr, member->size);
+            timer.stop();
+
+            if (!err) {
+                uint32_t sample = timer.read_us() / (member->size / _read_size);
+                member->latency = member->latency ? (7 * member->latency + sample) / 8 : sample;
+            }
+            break;
+        }
+        case OP_PROGRAM:
+            err = member->bd->program(member->buffer, member->addr, member->size);
+            break;
+        default:
+            err = member->bd->trim(member->addr, member->size);
+            break;
+    }
+
+    if (err) {
+        debug_if(MIRRORED_DBG, "Member %d failed at 0x%llx: %d\n", member - _members, member->addr, err);
+    }
+    return err;
+}
+
+int MirroredBlockDevice::_both(op_t op, uint8_t *buffer, bd_addr_t addr, bd_size_t size)
+{
+    for (size_t i = 0; i < MEMBERS; i++) {
+        _members[i].mutex.lock();
+        _members[i].op = op;
+        _members[i].buffer = buffer;
+        _members[i].addr = addr;
+        _members[i].size = size;
+    }
+
+    _members[1].worker->post(callback(_member_job, &_members[1]));
+    int err = _member_transfer(&_members[0]);
+    int err1 = _members[1].worker->wait();
+    if (!err) {
+        err = err1;
+    }
+
+    for (size_t i = MEMBERS; i--;) {
+        _members[i].mutex.unlock();
+    }
+    return err;
+}
+
+int MirroredBlockDevice::_read_one(uint8_t *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Prefer the member with the lower latency, take the other one if it is busy.
+    // The slower member still gets the odd read, or its average would never
+    // recover from a stall
+    size_t first = (_members[1].latency < _members[0].latency) ? 1 : 0;
+#if MBED_CONF_SD_MIRROR_PROBE_INTERVAL
+    if (!(++_reads % MBED_CONF_SD_MIRROR_PROBE_INTERVAL)) {
+        first ^= 1;
+    }
+#endif
+    member_t *member = &_members[first];
+    member_t *other = &_members[first ^ 1];
+
+    if (!member->mutex.trylock()) {
+        if (other->mutex.trylock()) {
+            std::swap(member, other);
+        } else {
+            member->mutex.lock();
+        }
+    }
+
+    member->op = OP_READ;
+    member->buffer = buffer;
+    member->addr = addr;
+    member->size = size;
+    int err = _member_transfer(member);
+    member->mutex.unlock();
+
+    if (err) {
+        // The data is mirrored, give the other member a chance
+        other->mutex.lock();
+        other->op = OP_READ;
+        other->buffer = buffer;
+        other->addr = addr;
+        other->size = size;
+        err = _member_transfer(other);
+        other->mutex.unlock();
+    }
+    return err;
+}
+
+int MirroredBlockDevice::_read_split(uint8_t *buffer, bd_addr_t addr, bd_size_t size)
+{
+    uint32_t latency0 = _members[0].latency;
+    uint32_t latency1 = _members[1].latency;
+
+    // Share the read so that both members should finish at the same time
+    bd_size_t size0 = size / 2;
+    if (latency0 + latency1) {
+        size0 = (size * latency1) / (latency0 + latency1);
+    }
+    size0 -= size0 % _read_size;
+
+    // A member with no share at all would never get its latency measured again
+    size0 = std::max(size0, _read_size);
+    size0 = std::min(size0, size - _read_size);
+
+    for (size_t i = 0; i < MEMBERS; i++) {
+        _members[i].mutex.lock();
+        _members[i].op = OP_READ;
+    }
+    _members[0].buffer = buffer;
+    _members[0].addr = addr;
+    _members[0].size = size0;
+    _members[1].buffer = buffer + size0;
+    _members[1].addr = addr + size0;
+    _members[1].size = size - size0;
+
+    _members[1].worker->post(callback(_member_job, &_members[1]));
+    int err0 = _member_transfer(&_members[0]);
+    int err1 = _members[1].worker->wait();
+
+    // Retry a failed share on the other member
+    int err = BD_ERROR_OK;
+    if (err0 && !err1) {
+        _members[1].buffer = buffer;
+        _members[1].addr = addr;
+        _members[1].size = size0;
+        err = _member_transfer(&_members[1]);
+    } else if (err1 && !err0) {
+        _members[0].buffer = buffer + size0;
+        _members[0].addr = addr + size0;
+        _members[0].size = size - size0;
+        err = _member_transfer(&_members[0]);
+    } else {
+        err = err0;
+    }
+
+    for (size_t i = MEMBERS; i--;) {
+        _members[i].mutex.unlock();
+    }
+    return err;
+}
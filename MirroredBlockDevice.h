@@ -0,0 +1,186 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_MIRRORED_BLOCK_DEVICE_H
+#define MBED_MIRRORED_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "BlockDeviceWorker.h"
+#include "mbed.h"
+#include "rtos.h"
+#include "platform/PlatformMutex.h"
+
+#ifndef MBED_CONF_SD_MIRROR_SPLIT_SIZE
+#define MBED_CONF_SD_MIRROR_SPLIT_SIZE      8192    /*!< Reads of at least this size are split across both members */
+#endif
+
+#ifndef MBED_CONF_SD_MIRROR_PROBE_INTERVAL
+#define MBED_CONF_SD_MIRROR_PROBE_INTERVAL  32      /*!< Every Nth single read goes to the slower member, 0 never */
+#endif
+
+/** Block device mirrored (RAID-1) across two block devices
+ *
+ *  Programs and trims go to both members in parallel. Reads go to a single
+ *  member, preferring one that is idle and has the lowest recent read latency,
+ *  so a card stalled in internal garbage collection gets fewer reads. Reads of
+ *  at least MBED_CONF_SD_MIRROR_SPLIT_SIZE bytes are split across both members
+ *  in proportion to their latency. Every MBED_CONF_SD_MIRROR_PROBE_INTERVAL
+ *  single reads, one goes to the slower member anyway, so that its latency
+ *  average recovers once it is done stalling. A read that fails on one member
+ *  is retried on the other.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "MirroredBlockDevice.h"
+ *
+ * SDBlockDevice sd0(p5, p6, p7, p8);
+ * SDBlockDevice sd1(p11, p12, p13, p14);
+ * MirroredBlockDevice mirrored(&sd0, &sd1);
+ * @endcode
+ */
+class MirroredBlockDevice : public BlockDevice {
+public:
+    /** Number of members in the mirror
+     */
+    static const size_t MEMBERS = 2;
+
+    /** Lifetime of the mirrored block device
+     *
+     *  @param bd0          First member block device
+     *  @param bd1          Second member block device
+     *  @param split_size   Reads of at least this many bytes are split across both members
+     */
+    MirroredBlockDevice(BlockDevice *bd0, BlockDevice *bd1,
+                        bd_size_t split_size = MBED_CONF_SD_MIRROR_SPLIT_SIZE);
+    virtual ~MirroredBlockDevice();
+
+    /** Initialize both member block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize both member block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the mirrored block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to both members
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Mark blocks as no longer in use on both members
+     *
+     *  @param addr     Address of block to mark as unused
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the total size of the mirrored block device
+     *
+     *  @return         Size of the smaller member in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Get the recent read latency of a member
+     *
+     *  @param member   Index of the member, 0 or 1
+     *  @return         Moving average of the read latency in microseconds per read block
+     */
+    uint32_t get_read_latency(size_t member) const;
+
+private:
+    enum op_t {
+        OP_READ,
+        OP_PROGRAM,
+        OP_TRIM,
+    };
+
+    struct member_t {
+        MirroredBlockDevice *owner;
+        BlockDevice *bd;
+        BlockDeviceWorker *worker;
+        Mutex mutex;                /**< Held while a transfer is in progress on the member */
+        volatile uint32_t latency;  /**< Moving average read latency, us per read block */
+
+        /* Transfer handed to the member */
+        op_t op;
+        uint8_t *buffer;
+        bd_addr_t addr;
+        bd_size_t size;
+    };
+
+    int _member_transfer(member_t *member);
+    static int _member_job(member_t *member);
+    int _both(op_t op, uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+    int _read_one(uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+    int _read_split(uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+
+    member_t _members[MEMBERS];
+    bd_size_t _split_size;
+    bd_size_t _size;
+    bd_size_t _read_size;
+    bd_size_t _program_size;
+    bd_size_t _erase_size;
+    volatile uint32_t _reads;       /**< Single reads, counted to probe the slower member */
+
+    PlatformMutex _mutex;
+    uint32_t _init_ref_count;
+    bool _is_initialized;
+};
+
+#endif  /* MBED_MIRRORED_BLOCK_DEVICE_H */
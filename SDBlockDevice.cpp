@@ -139,8 +139,11 @@
 #ifdef DEVICE_SPI
 
 #include "SDBlockDevice.h"
+#include "SDSPITransport.h"
 #include "mbed_debug.h"
 #include <errno.h>
+#include <algorithm>
+#include <new>
 
 /* Required version: 5.9.0 and above */
 #if defined(MBED_MAJOR_VERSION) && MBED_MAJOR_VERSION >= 5
@@ -165,32 +168,86 @@
 #define MBED_CONF_SD_CMD0_IDLE_STATE_RETRIES     5      /*!< Number of retries for sending CMDO */
 #endif
 
+#ifndef MBED_CONF_SD_BUSY_RELEASE
+#define MBED_CONF_SD_BUSY_RELEASE                0      /*!< Release the SPI bus while the card is busy */
+#endif
+
+#ifndef MBED_CONF_SD_BUSY_RELEASE_SPIN_US
+#define MBED_CONF_SD_BUSY_RELEASE_SPIN_US        500    /*!< Time in us to poll busy before releasing the bus */
+#endif
+
+#ifndef MBED_CONF_SD_BUSY_RELEASE_INTERVAL_MS
+#define MBED_CONF_SD_BUSY_RELEASE_INTERVAL_MS    1      /*!< Time in ms the bus is released between busy polls */
+#endif
+
+#ifndef MBED_CONF_SD_INIT_THREAD_STACK_SIZE
+#define MBED_CONF_SD_INIT_THREAD_STACK_SIZE      1024   /*!< Stack size of the threads bringing up cards concurrently */
+#endif
+
+#ifndef MBED_CONF_SD_INIT_ASYNC_STACK_SIZE
+#define MBED_CONF_SD_INIT_ASYNC_STACK_SIZE       1024   /*!< Stack size of the thread running init_async() */
+#endif
+
+#ifndef MBED_CONF_SD_TRIM_DEFER_MS
+#define MBED_CONF_SD_TRIM_DEFER_MS               0      /*!< Idle time in ms before queued trims are issued, 0 to trim immediately */
+#endif
+
+#ifndef MBED_CONF_SD_TRIM_THREAD_STACK_SIZE
+#define MBED_CONF_SD_TRIM_THREAD_STACK_SIZE      768    /*!< Stack size of the thread issuing deferred trims */
+#endif
+
+#ifndef MBED_CONF_SD_WRITE_RETRIES
+#define MBED_CONF_SD_WRITE_RETRIES               2      /*!< Times the uncommitted part of a failed write is resent */
+#endif
+
+#ifndef MBED_CONF_SD_READ_RETRIES
+#define MBED_CONF_SD_READ_RETRIES                2      /*!< Times a block failing its CRC or timing out is read again */
+#endif
+
+#ifndef MBED_CONF_SD_HC_ONLY
+#define MBED_CONF_SD_HC_ONLY                     0      /*!< 1 - Only accept SDHC/SDXC cards, dropping the byte addressing of SDSC */
+#endif
+
+/* CRC policy: when MBED_CONF_SD_FIXED_CRC is set (0 or 1) it replaces the crc_on
+ * constructor argument, and the CRC checks on the data path compile away */
+#ifdef MBED_CONF_SD_FIXED_CRC
+#define SD_CRC_ON                                (MBED_CONF_SD_FIXED_CRC)
+#else
+#define SD_CRC_ON                                (_crc_on)
+#endif
+
+#ifndef MBED_CONF_SD_ERASED_MAP_GRANULE
+#define MBED_CONF_SD_ERASED_MAP_GRANULE          0      /*!< Bytes per bit of the erased range map, 0 to disable the map */
+#endif
+
+#ifndef MBED_CONF_SD_ERASED_MAP_MAX_SIZE
+#define MBED_CONF_SD_ERASED_MAP_MAX_SIZE         4096   /*!< Largest erased range map in bytes, bigger cards go without it */
+#endif
+
 #ifndef MBED_CONF_SD_INIT_FREQUENCY
 #define MBED_CONF_SD_INIT_FREQUENCY              100000 /*!< Initialization frequency Range (100KHz-400KHz) */
 #endif
 
 
 #define SD_COMMAND_TIMEOUT                       MBED_CONF_SD_CMD_TIMEOUT
+
+#ifndef MBED_CONF_SD_ERASE_TIMEOUT_MAX
+#define MBED_CONF_SD_ERASE_TIMEOUT_MAX           300000 /*!< Upper bound in ms on the busy wait of a single erase */
+#endif
 #define SD_CMD0_GO_IDLE_STATE_RETRIES            MBED_CONF_SD_CMD0_IDLE_STATE_RETRIES
 #define SD_DBG                                   0      /*!< 1 - Enable debugging */
 #define SD_CMD_TRACE                             0      /*!< 1 - Enable SD command tracing */
 
-#define SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK        -5001  /*!< operation would block */
-#define SD_BLOCK_DEVICE_ERROR_UNSUPPORTED        -5002  /*!< unsupported operation */
-#define SD_BLOCK_DEVICE_ERROR_PARAMETER          -5003  /*!< invalid parameter */
-#define SD_BLOCK_DEVICE_ERROR_NO_INIT            -5004  /*!< uninitialized */
-#define SD_BLOCK_DEVICE_ERROR_NO_DEVICE          -5005  /*!< device is missing or not connected */
-#define SD_BLOCK_DEVICE_ERROR_WRITE_PROTECTED    -5006  /*!< write protected */
-#define SD_BLOCK_DEVICE_ERROR_UNUSABLE           -5007  /*!< unusable card */
-#define SD_BLOCK_DEVICE_ERROR_NO_RESPONSE        -5008  /*!< No response from device */
-#define SD_BLOCK_DEVICE_ERROR_CRC                -5009  /*!< CRC error */
-#define SD_BLOCK_DEVICE_ERROR_ERASE              -5010  /*!< Erase error: reset/sequence */
-#define SD_BLOCK_DEVICE_ERROR_WRITE              -5011  /*!< SPI Write error: !SPI_DATA_ACCEPTED */
-
 #define BLOCK_SIZE_HC                            512    /*!< Block size supported for SD card is 512 bytes  */
+#define BLOCK_SHIFT_HC                           9      /*!< log2(BLOCK_SIZE_HC), for block counts and LBAs */
+#define ERASED_MAP_GRANULE                       (MBED_CONF_SD_ERASED_MAP_GRANULE ? MBED_CONF_SD_ERASED_MAP_GRANULE : BLOCK_SIZE_HC)
 #define WRITE_BL_PARTIAL                         0      /*!< Partial block write - Not supported */
 #define SPI_CMD(x) (0x40 | (x & 0x3f))
 
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+static sd_buffer_pool_t sd_buffer_pool;
+#endif
+
 /* R1 Response Format */
 #define R1_NO_RESPONSE          (0xFF)
 #define R1_RESPONSE_RECV        (0x80)
@@ -211,6 +268,8 @@
 
 /* SIZE in Bytes */
 #define PACKET_SIZE              6           /*!< SD Packet size CMD+ARG+CRC */
+#define SPI_NCR_WINDOW           8           /*!< Bytes the R1 response may take to arrive (NCR) */
+#define SPI_R3_TAIL_SIZE         4           /*!< Bytes following the R1 in an R3/R7 response */
 #define R1_RESPONSE_SIZE         1           /*!< Size of R1 response */
 #define R2_RESPONSE_SIZE         2           /*!< Size of R2 response */
 #define R3_R7_RESPONSE_SIZE      5           /*!< Size of R3/R7 response */
@@ -255,39 +314,93 @@
 #define SPI_READ_ERROR_OFR       (0x1 << 3)  /*!< Out of Range */
 
 SDBlockDevice::SDBlockDevice(PinName mosi, PinName miso, PinName sclk, PinName cs, uint64_t hz, bool crc_on)
-    : _sectors(0), _spi(mosi, miso, sclk), _cs(cs), _is_initialized(0),
-      _crc_on(crc_on), _init_ref_count(0), _crc16(0, 0, false, false)
+    : _sectors(0), _transport(NULL), _spi_transport(NULL),
+      _is_initialized(0), _crc_on(crc_on), _busy_release(MBED_CONF_SD_BUSY_RELEASE), _init_ref_count(0),
+      _crc16(0, 0, false, false)
+{
+    // The default transport lives inside the block device, no heap and no virtual calls
+    _spi_transport = new (_spi_storage.bytes) SDSPITransport(mosi, miso, sclk, cs);
+    _transport = _spi_transport;
+    _setup(hz);
+}
+
+SDBlockDevice::SDBlockDevice(SDTransport *transport, uint64_t hz, bool crc_on)
+    : _sectors(0), _transport(transport), _spi_transport(NULL),
+      _is_initialized(0), _crc_on(crc_on), _busy_release(MBED_CONF_SD_BUSY_RELEASE), _init_ref_count(0),
+      _crc16(0, 0, false, false)
+{
+    _setup(hz);
+}
+
+void SDBlockDevice::_setup(uint64_t hz)
 {
-    _cs = 1;
     _card_type = SDCARD_NONE;
+    _init_thread = NULL;
+    _init_pending = false;
+    _init_fail_fast = false;
+    _init_result = BD_ERROR_OK;
+    _trim_thread = NULL;
+    _trim_defer_ms = MBED_CONF_SD_TRIM_DEFER_MS;
+    _trim_count = 0;
+    _trim_stop = false;
+    _idle_timer.start();
+    _erased_map = NULL;
+    _erased_granules = 0;
+    memset(&_stats, 0, sizeof(_stats));
+    _bounce = NULL;
+    _unstaged = false;
+    _stream_open = false;
+    _stream_left = 0;
+    _stream_owner = NULL;
+    _session_depth = 0;
+    _selected = false;
+    _ready = false;
 
     // Set default to 100kHz for initialisation and 1MHz for data transfer
     MBED_STATIC_ASSERT(((MBED_CONF_SD_INIT_FREQUENCY >= 100000) && (MBED_CONF_SD_INIT_FREQUENCY <= 400000)),
                        "Initialization frequency should be between 100KHz to 400KHz");
+    MBED_STATIC_ASSERT((MBED_CONF_SD_ERASED_MAP_GRANULE % BLOCK_SIZE_HC) == 0,
+                       "Erased map granule should be a multiple of the block size");
+    MBED_STATIC_ASSERT(!MBED_CONF_SD_NULL_MUTEX || (MBED_CONF_SD_TRIM_DEFER_MS == 0),
+                       "Deferred trims need the mutex");
+    MBED_STATIC_ASSERT(MBED_CONF_SD_BUFFER_POOL_SIZE >= BLOCK_SIZE_HC,
+                       "Pool buffers should hold at least one block");
+    MBED_STATIC_ASSERT(!MBED_CONF_SD_SPI_DMA_THRESHOLD || MBED_CONF_SD_BUFFER_POOL_COUNT,
+                       "SPI DMA needs the buffer pool to bounce unaligned buffers");
     _init_sck = MBED_CONF_SD_INIT_FREQUENCY;
     _transfer_sck = hz;
 
     // Only HC block size is supported.
     _block_size = BLOCK_SIZE_HC;
     _erase_size = BLOCK_SIZE_HC;
+    memset(&_sd_status, 0, sizeof(_sd_status));
+    _sd_status_valid = false;
+    _erase_timeout_ms = SD_COMMAND_TIMEOUT;
+    _erase_value = -1;
 }
 
 SDBlockDevice::~SDBlockDevice()
 {
+    _join_init_async();
     if (_is_initialized) {
+        _init_ref_count = 1;
         deinit();
     }
+    _stop_trim_thread();
+    if (_spi_transport) {
+        _spi_transport->~SDSPITransport();
+    }
 }
 
-int SDBlockDevice::_initialise_card()
+int SDBlockDevice::_init_card_begin()
 {
     // Detail debugging is for commands
     _dbg = SD_DBG ? SD_CMD_TRACE : 0;
     int32_t status = BD_ERROR_OK;
-    uint32_t response, arg;
+    uint32_t response;
 
     // Initialize the SPI interface: Card by default is in SD mode
-    _spi_init();
+    _transport->init(_init_sck);
 
     // The card is transitioned from SDCard mode to SPI mode by sending the CMD0 + CS Asserted("0")
     if (_go_idle_state() != R1_IDLE_STATE) {
@@ -295,6 +408,8 @@ int SDBlockDevice::_initialise_card()
         return SD_BLOCK_DEVICE_ERROR_NO_DEVICE;
     }
 
+    BusSession session(this);
+
     // Send CMD8, if the card rejects the command then it's probably using the
     // legacy protocol, or is a MMC, or just flat-out broken
     status = _cmd8();
@@ -302,9 +417,9 @@ int SDBlockDevice::_initialise_card()
         return status;
     }
 
-    if (_crc_on) {
+    if (SD_CRC_ON) {
         // Enable CRC
-        status = _cmd(CMD59_CRC_ON_OFF, _crc_on);
+        status = _cmd(CMD59_CRC_ON_OFF, SD_CRC_ON);
     }
 
     // Read OCR - CMD58 Response contains OCR register
@@ -318,23 +433,22 @@ int SDBlockDevice::_initialise_card()
         status = SD_BLOCK_DEVICE_ERROR_UNUSABLE;
         return status;
     }
+    return BD_ERROR_OK;
+}
 
+int SDBlockDevice::_init_card_poll(uint32_t *response)
+{
     // HCS is set 1 for HC/XC capacity cards for ACMD41, if supported
-    arg = 0x0;
+    uint32_t arg = 0x0;
     if (SDCARD_V2 == _card_type) {
         arg |= OCR_HCS_CCS;
     }
+    return _cmd(ACMD41_SD_SEND_OP_COND, arg, 1, response);
+}
 
-    /* Idle state bit in the R1 response of ACMD41 is used by the card to inform the host
-     * if initialization of ACMD41 is completed. "1" indicates that the card is still initializing.
-     * "0" indicates completion of initialization. The host repeatedly issues ACMD41 until
-     * this bit is set to "0".
-     */
-    _spi_timer.start();
-    do {
-        status = _cmd(ACMD41_SD_SEND_OP_COND, arg, 1, &response);
-    } while ((response & R1_IDLE_STATE) && (_spi_timer.read_ms() < SD_COMMAND_TIMEOUT));
-    _spi_timer.stop();
+int SDBlockDevice::_init_card_end(int status, uint32_t response)
+{
+    BusSession session(this);
 
     // Initialization complete: ACMD41 successful
     if ((BD_ERROR_OK != status) || (0x00 != response)) {
@@ -359,66 +473,318 @@ int SDBlockDevice::_initialise_card()
         debug_if(SD_DBG, "Card Initialized: Version 1.x Card\n");
     }
 
-    if (!_crc_on) {
+#if MBED_CONF_SD_HC_ONLY
+    if ((BD_ERROR_OK == status) && (SDCARD_V2HC != _card_type)) {
+        debug_if(SD_DBG, "Standard Capacity card not supported\n");
+        return SD_BLOCK_DEVICE_ERROR_UNUSABLE;
+    }
+#endif
+
+    if (!SD_CRC_ON) {
         // Disable CRC
-        status = _cmd(CMD59_CRC_ON_OFF, _crc_on);
+        status = _cmd(CMD59_CRC_ON_OFF, SD_CRC_ON);
     }
     return status;
 }
 
-
-int SDBlockDevice::init()
+int SDBlockDevice::_initialise_card()
 {
-    int err;
-
-    lock();
+    int32_t status;
+    uint32_t response;
+    Timer timer;
 
-    if (!_is_initialized) {
-        _init_ref_count = 0;
+    status = _init_card_begin();
+    if (BD_ERROR_OK != status) {
+        return status;
     }
 
-    _init_ref_count++;
+    /* Idle state bit in the R1 response of ACMD41 is used by the card to inform the host
+     * if initialization of ACMD41 is completed. "1" indicates that the card is still initializing.
+     * "0" indicates completion of initialization. The host repeatedly issues ACMD41 until
+     * this bit is set to "0".
+     */
+    timer.start();
+    do {
+        status = _init_card_poll(&response);
+    } while ((response & R1_IDLE_STATE) && (timer.read_ms() < SD_COMMAND_TIMEOUT));
+    timer.stop();
 
-    if (_init_ref_count != 1) {
-        goto end;
-    }
+    return _init_card_end(status, response);
+}
 
-    err = _initialise_card();
+int SDBlockDevice::_init_data_mode(int err)
+{
     _is_initialized = (err == BD_ERROR_OK);
     if (!_is_initialized) {
         debug_if(SD_DBG, "Fail to initialize card\n");
-        unlock();
         return err;
     }
     debug_if(SD_DBG, "init card = %d\n", _is_initialized);
+    BusSession session(this);
     _sectors = _sd_sectors();
     // CMD9 failed
     if (0 == _sectors) {
-        unlock();
         return BD_ERROR_DEVICE_ERROR;
     }
 
     // Set block length to 512 (CMD16)
     if (_cmd(CMD16_SET_BLOCKLEN, _block_size) != 0) {
         debug_if(SD_DBG, "Set %d-byte block timed out\n", _block_size);
-        unlock();
         return BD_ERROR_DEVICE_ERROR;
     }
 
+    // SD Status and SCR are informational, the card is usable without them
+    if (_read_sd_status() != 0) {
+        debug_if(SD_DBG, "Couldn't read SD Status\n");
+    }
+    if (_read_scr() != 0) {
+        debug_if(SD_DBG, "Couldn't read SCR\n");
+    }
+    _alloc_erased_map();
+
     // Set SCK for data transfer
-    err = _freq();
-    if (err) {
-        unlock();
-        return err;
+    return _freq();
+}
+
+int SDBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+
+    lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count == 1) {
+        err = _init_data_mode(_initialise_card());
     }
 
-end:
     unlock();
+    return err;
+}
+
+int SDBlockDevice::init_async(Callback<void(int)> ready, bool fail_fast)
+{
+#if MBED_CONF_SD_NULL_MUTEX
+    // The background init relies on the lock to hold back other calls
+    (void)ready;
+    (void)fail_fast;
+    return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
+#else
+    // Only one background init at a time
+    _join_init_async();
+
+    _init_ready = ready;
+    _init_fail_fast = fail_fast;
+    _init_flags.clear(INIT_ASYNC_DONE);
+    _init_pending = true;
+
+    _init_thread = new Thread(osPriorityNormal, MBED_CONF_SD_INIT_ASYNC_STACK_SIZE);
+    if (_init_thread->start(callback(this, &SDBlockDevice::_init_async_run)) != osOK) {
+        delete _init_thread;
+        _init_thread = NULL;
+        _init_pending = false;
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    return BD_ERROR_OK;
+#endif
+}
+
+int SDBlockDevice::wait_init(uint32_t ms)
+{
+    // The thread is kept until the next init_async() or destruction
+    if (!_init_thread) {
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    if (!_init_pending) {
+        return _init_result;
+    }
+
+    uint32_t flags = _init_flags.wait_any(INIT_ASYNC_DONE, ms, false);
+    if ((flags & osFlagsError) || !(flags & INIT_ASYNC_DONE)) {
+        return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+    }
+    return _init_result;
+}
+
+void SDBlockDevice::_init_async_run()
+{
+    _init_result = init();
+    _init_pending = false;
+    _init_flags.set(INIT_ASYNC_DONE);
+    if (_init_ready) {
+        _init_ready(_init_result);
+    }
+}
+
+// Hold or fail operations issued while a background init is in progress
+int SDBlockDevice::_wait_init_async()
+{
+    if (!_init_pending) {
+        return BD_ERROR_OK;
+    }
+    if (_init_fail_fast) {
+        return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+    }
+    _init_flags.wait_any(INIT_ASYNC_DONE, osWaitForever, false);
     return BD_ERROR_OK;
 }
 
+void SDBlockDevice::_join_init_async()
+{
+    if (_init_thread) {
+        _init_thread->join();
+        delete _init_thread;
+        _init_thread = NULL;
+    }
+}
+
+int SDBlockDevice::init_concurrent(SDBlockDevice **sds, size_t count, int *errs)
+{
+    int *results = errs ? errs : new int[count];
+    bool *started = new bool[count];
+    Thread **threads = new Thread *[count];
+    init_group_t *groups = new init_group_t[count];
+    size_t group_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        started[i] = false;
+        threads[i] = NULL;
+    }
+
+    // One group per SPI bus, identified by its clock pin
+    for (size_t i = 0; i < count; i++) {
+        bool found = false;
+        for (size_t g = 0; g < group_count && !found; g++) {
+            found = (groups[g].bus == sds[i]->_transport->get_bus_id());
+        }
+        if (!found) {
+            groups[group_count].sds = sds;
+            groups[group_count].count = count;
+            groups[group_count].bus = sds[i]->_transport->get_bus_id();
+            groups[group_count].errs = results;
+            group_count++;
+        }
+    }
+
+    // Every bus but the last gets its own thread, the last one runs here
+    for (size_t g = 0; g + 1 < group_count; g++) {
+        threads[g] = new Thread(osPriorityNormal, MBED_CONF_SD_INIT_THREAD_STACK_SIZE);
+        started[g] = (threads[g]->start(callback(_init_group, &groups[g])) == osOK);
+        if (!started[g]) {
+            _init_group(&groups[g]);
+        }
+    }
+    if (group_count) {
+        _init_group(&groups[group_count - 1]);
+    }
+
+    // Join every bus
+    for (size_t g = 0; g < group_count; g++) {
+        if (started[g]) {
+            threads[g]->join();
+        }
+        delete threads[g];
+    }
+
+    int err = BD_ERROR_OK;
+    for (size_t i = 0; i < count && !err; i++) {
+        err = results[i];
+    }
+
+    if (results != errs) {
+        delete[] results;
+    }
+    delete[] started;
+    delete[] threads;
+    delete[] groups;
+    return err;
+}
+
+void SDBlockDevice::_init_group(init_group_t *group)
+{
+    SDBlockDevice **sds = group->sds;
+    int *errs = group->errs;
+    uint32_t *responses = new uint32_t[group->count];
+    bool *polling = new bool[group->count];
+    bool *owned = new bool[group->count];
+    bool *begun = new bool[group->count];
+    bool pending = false;
+    Timer timer;
+
+    // Hold every card of the bus and bring it into the SPI idle state
+    for (size_t i = 0; i < group->count; i++) {
+        polling[i] = false;
+        owned[i] = false;
+        begun[i] = false;
+        if (sds[i]->_transport->get_bus_id() != group->bus) {
+            continue;
+        }
+
+        SDBlockDevice *sd = sds[i];
+        sd->lock();
+        if (!sd->_is_initialized) {
+            sd->_init_ref_count = 0;
+        }
+        sd->_init_ref_count++;
+
+        errs[i] = BD_ERROR_OK;
+        if (sd->_init_ref_count != 1) {
+            sd->unlock();
+            continue;
+        }
+
+        owned[i] = true;
+        errs[i] = sd->_init_card_begin();
+        responses[i] = R1_NO_RESPONSE;
+        begun[i] = (BD_ERROR_OK == errs[i]);
+        polling[i] = begun[i];
+        pending |= polling[i];
+    }
+
+    // Interleave the ACMD41 polls, the cards initialise internally in parallel
+    timer.start();
+    while (pending && (timer.read_ms() < SD_COMMAND_TIMEOUT)) {
+        pending = false;
+        for (size_t i = 0; i < group->count; i++) {
+            if (polling[i]) {
+                errs[i] = sds[i]->_init_card_poll(&responses[i]);
+                polling[i] = (responses[i] & R1_IDLE_STATE);
+                pending |= polling[i];
+            }
+        }
+    }
+    timer.stop();
+
+    for (size_t i = 0; i < group->count; i++) {
+        if (owned[i]) {
+            SDBlockDevice *sd = sds[i];
+            if (begun[i]) {
+                errs[i] = sd->_init_card_end(errs[i], responses[i]);
+            }
+            errs[i] = sd->_init_data_mode(errs[i]);
+            sd->unlock();
+        }
+    }
+
+    delete[] responses;
+    delete[] polling;
+    delete[] owned;
+    delete[] begun;
+}
+
 int SDBlockDevice::deinit()
 {
+    int err = BD_ERROR_OK;
+
+    // Let a background init complete, deinit pairs with it
+    if (_init_pending) {
+        _init_flags.wait_any(INIT_ASYNC_DONE, osWaitForever, false);
+    }
+
     lock();
 
     if (!_is_initialized) {
@@ -432,193 +798,1011 @@ int SDBlockDevice::deinit()
         goto end;
     }
 
+    // Queued trims have to reach the card while it can still be talked to
+    err = _flush_trims(0, size());
+    _free_erased_map();
     _is_initialized = false;
     _sectors = 0;
 
 end:
     unlock();
+    return err;
+}
+
+
+int SDBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+{
+    int err = _wait_init_async();
+    if (BD_ERROR_OK != err) {
+        return err;
+    }
+
+    if (!is_valid_program(addr, size)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    lock();
+    if (!_is_initialized) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+
+    const uint8_t *buffer = static_cast<const uint8_t *>(b);
+    int status = BD_ERROR_OK;
+
+    // Queued trims must not erase the data about to be programmed
+    _idle_timer.reset();
+    if (BD_ERROR_OK != (status = _unqueue_trim(addr, size))) {
+        unlock();
+        return status;
+    }
+
+    _take_bounce(buffer, size);
+    status = _program(buffer, addr, size, false);
+    _release_bounce();
+    unlock();
+    return status;
+}
+
+int SDBlockDevice::stream_begin(bd_addr_t addr, bd_size_t size)
+{
+    int err = _wait_init_async();
+    if (BD_ERROR_OK != err) {
+        return err;
+    }
+
+    if (!is_valid_program(addr, size) || !size) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    lock();
+    if (!_is_initialized) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    if (_stream_open) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    // Queued trims must not erase the stream behind it
+    _idle_timer.reset();
+    if (BD_ERROR_OK != (err = _unqueue_trim(addr, size))) {
+        unlock();
+        return err;
+    }
+    _mark_erased(addr, size, false);
+
+    // The session, and the lock, are held until the stream ends
+    _begin_session();
+    _cmd(ACMD23_SET_WR_BLK_ERASE_COUNT, size >> BLOCK_SHIFT_HC, 1);
+    if (BD_ERROR_OK != (err = _cmd(CMD25_WRITE_MULTIPLE_BLOCK, _card_addr(addr)))) {
+        _stats.write_errors++;
+        _end_session();
+        unlock();
+        return err;
+    }
+
+    _stream_open = true;
+    _stream_left = size;
+    _stream_owner = Thread::gettid();
     return BD_ERROR_OK;
 }
 
+int SDBlockDevice::stream_program(const void *b, bd_size_t size)
+{
+    if (!_stream_open) {
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    if (Thread::gettid() != _stream_owner) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+    if ((size % _block_size) || (size > _stream_left)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    const uint8_t *buffer = static_cast<const uint8_t *>(b);
+    int status = BD_ERROR_OK;
+    _take_bounce(buffer, size);
+
+    const uint8_t *src = buffer;
+    if (_bounce) {
+        memcpy(_bounce, buffer, _block_size);
+        src = _bounce;
+    }
+    for (bd_size_t done = 0; done < size; done += _block_size) {
+        const uint8_t *next = (_bounce && (done + _block_size < size)) ? (buffer + _block_size) : NULL;
+        uint8_t response = _write(src, SPI_START_BLK_MUL_WRITE, _block_size, next);
+        if (response != SPI_DATA_ACCEPTED) {
+            debug_if(SD_DBG, "Stream Write failed: 0x%x \n", response);
+            status = SD_BLOCK_DEVICE_ERROR_WRITE;
+            break;
+        }
+        buffer += _block_size;
+        if (!_bounce) {
+            src = buffer;
+        }
+        _stream_left -= _block_size;
+    }
+    _release_bounce();
+
+    if (BD_ERROR_OK != status) {
+        _stats.write_errors++;
+        _stream_close();
+    }
+    return status;
+}
+
+int SDBlockDevice::stream_end()
+{
+    if (!_stream_open) {
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    if (Thread::gettid() != _stream_owner) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    _stream_close();
+    return BD_ERROR_OK;
+}
+
+void SDBlockDevice::_stream_close()
+{
+    // Stop Tran token, the card is busy with the last blocks until the next command
+    _bus_transfer(SPI_STOP_TRAN);
+    _ready = false;
+    _stream_open = false;
+    _stream_left = 0;
+    _end_session();
+    unlock();
+}
+
+int SDBlockDevice::write_zeroes(bd_addr_t addr, bd_size_t size)
+{
+    int err = _wait_init_async();
+    if (BD_ERROR_OK != err) {
+        return err;
+    }
+
+    if (!is_valid_program(addr, size)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    lock();
+    if (!_is_initialized) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+
+    int status = BD_ERROR_OK;
+    bd_addr_t end = addr + size;
+    bd_addr_t lo = end;
+    bd_addr_t hi = end;
+
+    _idle_timer.reset();
+    if (BD_ERROR_OK != (status = _unqueue_trim(addr, size))) {
+        unlock();
+        return status;
+    }
+
+    // Erase the whole erase blocks in the range if erased blocks read as zero
+    if (0 == _erase_value) {
+        lo = addr + ((addr % _erase_size) ? (_erase_size - addr % _erase_size) : 0);
+        hi = end - (end % _erase_size);
+        if (lo >= hi) {
+            lo = end;
+            hi = end;
+        }
+    }
+
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    uint8_t *zeroes = (uint8_t *)sd_buffer_pool.alloc();
+    if (!zeroes) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_NO_BUFFER;
+    }
+#else
+    uint8_t zeroes[BLOCK_SIZE_HC];
+#endif
+    memset(zeroes, 0, BLOCK_SIZE_HC);
+
+    if (lo > addr) {
+        status = _program(zeroes, addr, lo - addr, true);
+    }
+    if ((BD_ERROR_OK == status) && (hi > lo)) {
+        status = _erase(lo, hi - lo);
+    }
+    if ((BD_ERROR_OK == status) && (end > hi)) {
+        status = _program(zeroes, hi, end - hi, true);
+    }
+
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    sd_buffer_pool.free(zeroes);
+#endif
+    unlock();
+    return status;
+}
+
+int SDBlockDevice::get_erase_value() const
+{
+    return _erase_value;
+}
+
+// SDSC Card (CCS=0) uses byte unit address
+// SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
+inline bd_addr_t SDBlockDevice::_card_addr(bd_addr_t addr) const
+{
+#if MBED_CONF_SD_HC_ONLY
+    return addr >> BLOCK_SHIFT_HC;
+#else
+    return (SDCARD_V2HC == _card_type) ? (addr >> BLOCK_SHIFT_HC) : addr;
+#endif
+}
+
+int SDBlockDevice::_program(const uint8_t *buffer, bd_addr_t addr, bd_size_t size, bool fill)
+{
+    int status;
+    int retries = MBED_CONF_SD_WRITE_RETRIES;
+
+    // The range no longer reads as erased, even if the write fails half way
+    _mark_erased(addr, size, false);
+
+    while (true) {
+        uint32_t written = 0;
+        status = _write_blocks(buffer, addr, size, fill, &written);
+        if (BD_ERROR_OK == status) {
+            break;
+        }
+        if ((SD_BLOCK_DEVICE_ERROR_WRITE == status) && (written * _block_size == size)) {
+            // The card committed every block despite the rejected token, nothing is left to send
+            debug_if(SD_DBG, "Write rejected, but all %d blocks were written\n", written);
+            status = BD_ERROR_OK;
+            break;
+        }
+        if ((SD_BLOCK_DEVICE_ERROR_WRITE != status) || (retries-- <= 0)) {
+            _stats.write_errors++;
+            break;
+        }
+
+        // Blocks the card committed before the failure are not sent again
+        debug_if(SD_DBG, "Write failed after %d of %d blocks, retrying\n", written, (int)(size / _block_size));
+        _stats.write_retries++;
+        _stats.write_blocks_kept += written;
+        addr += written * _block_size;
+        size -= written * _block_size;
+        if (!fill) {
+            buffer += written * _block_size;
+        }
+    }
+    return status;
+}
+
+int SDBlockDevice::_write_blocks(const uint8_t *buffer, bd_addr_t addr, bd_size_t size, bool fill, uint32_t *written)
+{
+    // Get block count, the block loop below needs at least one
+    bd_addr_t blockCnt = size >> BLOCK_SHIFT_HC;
+    *written = 0;
+    if (!blockCnt) {
+        return BD_ERROR_OK;
+    }
+
+    BusSession session(this);
+    int status = BD_ERROR_OK;
+    uint8_t response;
+
+    addr = _card_addr(addr);
+
+    // Send command to perform write operation
+    if (blockCnt == 1) {
+        // Single block write command
+        if (BD_ERROR_OK != (status = _cmd(CMD24_WRITE_BLOCK, addr))) {
+            return status;
+        }
+
+        // Write data
+        if (_bounce) {
+            memcpy(_bounce, buffer, _block_size);
+            buffer = _bounce;
+        }
+        response = _write(buffer, SPI_START_BLOCK, _block_size);
+
+        // Only CRC and general write error are communicated via response token
+        if (response != SPI_DATA_ACCEPTED) {
+            debug_if(SD_DBG, "Single Block Write failed: 0x%x \n", response);
+            status = SD_BLOCK_DEVICE_ERROR_WRITE;
+        } else {
+            *written = 1;
+        }
+        _deselect();
+        return status;
+    }
+
+    // Pre-erase setting prior to multiple block write operation
+    _cmd(ACMD23_SET_WR_BLK_ERASE_COUNT, blockCnt, 1);
+
+    // Multiple block write command
+    if (BD_ERROR_OK != (status = _cmd(CMD25_WRITE_MULTIPLE_BLOCK, addr))) {
+        return status;
+    }
+
+    // Through a bounce buffer, the next block is copied in while the card programs the current one
+    const uint8_t *src = buffer;
+    if (_bounce) {
+        memcpy(_bounce, buffer, _block_size);
+        src = _bounce;
+    }
+
+    // Write the data: one block at a time, or the same block over and over when filling
+    do {
+        const uint8_t *next = (_bounce && !fill && (blockCnt > 1)) ? (buffer + _block_size) : NULL;
+        response = _write(src, SPI_START_BLK_MUL_WRITE, _block_size, next);
+        if (response != SPI_DATA_ACCEPTED) {
+            debug_if(SD_DBG, "Multiple Block Write failed: 0x%x \n", response);
+            status = SD_BLOCK_DEVICE_ERROR_WRITE;
+            break;
+        }
+        if (!fill) {
+            buffer += _block_size;
+            if (!_bounce) {
+                src = buffer;
+            }
+        }
+    } while (--blockCnt);     // Receive all blocks of data
+
+    /* In a Multiple Block write operation, the stop transmission will be done by
+     * sending 'Stop Tran' token instead of 'Start Block' token at the beginning
+     * of the next block
+     */
+    _bus_transfer(SPI_STOP_TRAN);
+    _ready = false;
+    _deselect();
+
+    if (BD_ERROR_OK == status) {
+        *written = size >> BLOCK_SHIFT_HC;
+    } else if ((BD_ERROR_OK != _num_written_blocks(written)) || (*written > (size >> BLOCK_SHIFT_HC))) {
+        // Without a sensible count nothing is known to be on the card
+        *written = 0;
+    }
+    return status;
+}
+
+int SDBlockDevice::_num_written_blocks(uint32_t *count)
+{
+    uint8_t blocks[4];
+    int err;
+
+    // Number of well written blocks of the last write, R1 followed by a 4-byte data block
+    if ((err = _cmd(ACMD22_SEND_NUM_WR_BLOCKS, 0x0, 1)) != 0) {
+        return err;
+    }
+    if ((err = _read_bytes(blocks, sizeof(blocks))) != 0) {
+        return err;
+    }
+
+    *count = ((uint32_t)blocks[0] << 24) | ((uint32_t)blocks[1] << 16) |
+             ((uint32_t)blocks[2] << 8) | blocks[3];
+    return BD_ERROR_OK;
+}
+
+int SDBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+{
+    int err = _wait_init_async();
+    if (BD_ERROR_OK != err) {
+        return err;
+    }
+
+    if (!is_valid_read(addr, size)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    lock();
+    if (!_is_initialized) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    uint8_t *buffer = static_cast<uint8_t *>(b);
+    int status = BD_ERROR_OK;
+    bd_addr_t end = addr + size;
+
+    // Ranges known to be erased need no transfer, nor the queued trims behind them
+    _idle_timer.reset();
+    if (_is_erased(addr, size)) {
+        memset(buffer, _erase_value, size);
+        unlock();
+        return status;
+    }
+
+    // Read what the card will hold once queued trims have been issued
+    if (BD_ERROR_OK != (status = _flush_trims(addr, size))) {
+        unlock();
+        return status;
+    }
+    _take_bounce(buffer, size);
+
+    // Split the range into runs of erased and unknown granules
+    while ((BD_ERROR_OK == status) && (addr < end)) {
+        bool erased = _is_erased(addr);
+        bd_addr_t next = addr;
+        do {
+            next = (_erased_map ? (next / ERASED_MAP_GRANULE + 1) * ERASED_MAP_GRANULE : end);
+            next = std::min(next, end);
+        } while ((next < end) && (_is_erased(next) == erased));
+
+        if (erased) {
+            memset(buffer, _erase_value, next - addr);
+        } else {
+            status = _read_blocks(buffer, addr, next - addr);
+        }
+        buffer += next - addr;
+        addr = next;
+    }
+    _release_bounce();
+    unlock();
+    return status;
+}
+
+void SDBlockDevice::_take_bounce(const void *buffer, bd_size_t size)
+{
+    if (_transport->is_dma_safe(buffer, size)) {
+        return;
+    }
+
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    _bounce = (uint8_t *)sd_buffer_pool.alloc();
+#endif
+    if (!_bounce) {
+        // Slower, but the buffer is never handed to a transfer chain
+        _unstaged = true;
+        _stats.unstaged++;
+        return;
+    }
+    _stats.bounced++;
+}
+
+void SDBlockDevice::_release_bounce()
+{
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    sd_buffer_pool.free(_bounce);
+#endif
+    _bounce = NULL;
+    _unstaged = false;
+}
+
+void SDBlockDevice::_transfer_data(const sd_transfer_t *chain, size_t count)
+{
+    if (!_unstaged) {
+        _bus_transfer_chain(chain, count);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        _bus_transfer(chain[i].tx, chain[i].rx, chain[i].length);
+    }
+}
+
+int SDBlockDevice::_read_blocks(uint8_t *buffer, bd_addr_t addr, bd_size_t size)
+{
+    int status;
+    int retries = MBED_CONF_SD_READ_RETRIES;
+
+    while (true) {
+        uint32_t received = 0;
+        status = _read_transfer(buffer, addr, size, &received);
+        if (BD_ERROR_OK == status) {
+            break;
+        }
+
+        // Each block gets its own retries, blocks received so far are kept
+        if (received) {
+            retries = MBED_CONF_SD_READ_RETRIES;
+        }
+        if (((SD_BLOCK_DEVICE_ERROR_CRC != status) && (SD_BLOCK_DEVICE_ERROR_NO_RESPONSE != status)) ||
+                (retries-- <= 0)) {
+            _stats.read_errors++;
+            break;
+        }
+        debug_if(SD_DBG, "Read failed after %d of %d blocks, retrying\n", received, (int)(size / _block_size));
+        _stats.read_retries++;
+        buffer += received * _block_size;
+        addr += received * _block_size;
+        size -= received * _block_size;
+    }
+    return status;
+}
+
+int SDBlockDevice::_read_transfer(uint8_t *buffer, bd_addr_t addr, bd_size_t size, uint32_t *received)
+{
+    BusSession session(this);
+    int status = BD_ERROR_OK;
+    bd_addr_t blockCnt = size >> BLOCK_SHIFT_HC;
+    addr = _card_addr(addr);
+
+    // Write command ro receive data
+    if (blockCnt > 1) {
+        status = _cmd(CMD18_READ_MULTIPLE_BLOCK, addr);
+    } else {
+        status = _cmd(CMD17_READ_SINGLE_BLOCK, addr);
+    }
+    if (BD_ERROR_OK != status) {
+        return status;
+    }
+
+    // receive the data : one block at a time. A bounce buffer is copied out
+    // while the card fetches the next block
+    while (blockCnt) {
+        if (0 != (status = _read(_bounce ? _bounce : buffer, _block_size))) {
+            break;
+        }
+        if (_bounce) {
+            memcpy(buffer, _bounce, _block_size);
+        }
+        buffer += _block_size;
+        ++*received;
+        --blockCnt;
+    }
+    _deselect();
+
+    // Send CMD12(0x00000000) to stop the transmission for multi-block transfer
+    if (size > _block_size) {
+        int err = _cmd(CMD12_STOP_TRANSMISSION, 0x0);
+        if (BD_ERROR_OK == status) {
+            status = err;
+        }
+    }
+    return status;
+}
+
+bool SDBlockDevice::_is_valid_trim(bd_addr_t addr, bd_size_t size)
+{
+    return (
+               addr % _block_size == 0 &&
+               size % _block_size == 0 &&
+               addr + size <= this->size());
+}
+
+int SDBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    int err = _wait_init_async();
+    if (BD_ERROR_OK != err) {
+        return err;
+    }
+
+    if (!_is_valid_trim(addr, size)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    lock();
+    if (!_is_initialized) {
+        unlock();
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+
+    // Only erase the card's erase sectors that lie entirely in the range
+    bd_addr_t end = addr + size;
+    addr += (addr % _erase_size) ? (_erase_size - addr % _erase_size) : 0;
+    end -= end % _erase_size;
+    if (addr >= end) {
+        unlock();
+        return BD_ERROR_OK;
+    }
+    size = end - addr;
+
+    int status;
+    _idle_timer.reset();
+    if (_trim_defer_ms) {
+        status = _queue_trim(addr, size);
+        if (BD_ERROR_OK == status) {
+            _mark_erased(addr, size, true);
+        }
+    } else {
+        status = _erase(addr, size);
+    }
+    unlock();
+    return status;
+}
+
+int SDBlockDevice::sync()
+{
+    lock();
+    int status = BD_ERROR_OK;
+    if (_is_initialized) {
+        status = _flush_trims(0, size());
+    }
+    unlock();
+    return status;
+}
+
+void SDBlockDevice::set_trim_deferral(uint32_t idle_ms)
+{
+#if MBED_CONF_SD_NULL_MUTEX
+    // Without a lock the background erase would race the caller, trim right away
+    idle_ms = 0;
+#endif
+    lock();
+    _trim_defer_ms = idle_ms;
+    int status = BD_ERROR_OK;
+    if (!idle_ms && _is_initialized) {
+        status = _flush_trims(0, size());
+    }
+    unlock();
+
+    if (!idle_ms) {
+        _stop_trim_thread();
+    }
+    if (status) {
+        debug_if(SD_DBG, "Deferred trim failed: %d\n", status);
+    }
+}
+
+int SDBlockDevice::_erase(bd_addr_t addr, bd_size_t size)
+{
+    BusSession session(this);
+    int status = BD_ERROR_OK;
+    bd_addr_t start = addr;
+    bd_size_t length = size;
+
+    _erase_timeout_ms = _erase_timeout(size);
+    size = _card_addr(size - _block_size);
+    addr = _card_addr(addr);
+
+    // Start lba sent in start command
+    if (BD_ERROR_OK != (status = _cmd(CMD32_ERASE_WR_BLK_START_ADDR, addr))) {
+        return status;
+    }
+
+    // End lba = addr+size sent in end addr command
+    if (BD_ERROR_OK != (status = _cmd(CMD33_ERASE_WR_BLK_END_ADDR, addr + size))) {
+        return status;
+    }
+    if (BD_ERROR_OK != (status = _cmd(CMD38_ERASE, 0x0))) {
+        return status;
+    }
+    _mark_erased(start, length, true);
+    return status;
+}
+
+/* Erased range map
+ * ----------------
+ * With MBED_CONF_SD_ERASED_MAP_GRANULE set, one bit per granule of the card
+ * records that the granule is known to read as the erase value. Bits are set
+ * for the granules completely covered by a trim (queued or issued) or an
+ * erase, and cleared by any program touching the granule. Reads of marked
+ * granules are filled in RAM. The map starts out clear on every init, and is
+ * only kept when the SCR told the erase value. A card needing a map larger
+ * than MBED_CONF_SD_ERASED_MAP_MAX_SIZE, or one that cannot be allocated,
+ * goes without it: every read then goes to the card.
+ */
+void SDBlockDevice::_alloc_erased_map()
+{
+    _free_erased_map();
+    if (!MBED_CONF_SD_ERASED_MAP_GRANULE || (_erase_value < 0)) {
+        return;
+    }
+
+    bd_size_t granules = (size() + ERASED_MAP_GRANULE - 1) / ERASED_MAP_GRANULE;
+    bd_size_t words = (granules + 31) / 32;
+    if (words * sizeof(uint32_t) > MBED_CONF_SD_ERASED_MAP_MAX_SIZE) {
+        debug_if(SD_DBG, "Erased map of %llu bytes exceeds MBED_CONF_SD_ERASED_MAP_MAX_SIZE, "
+                 "raise MBED_CONF_SD_ERASED_MAP_GRANULE\n", words * sizeof(uint32_t));
+        return;
+    }
+
+    _erased_map = new (std::nothrow) uint32_t[words];
+    if (!_erased_map) {
+        debug_if(SD_DBG, "Erased map allocation failed\n");
+        return;
+    }
+    _erased_granules = granules;
+    memset(_erased_map, 0, words * sizeof(uint32_t));
+    debug_if(SD_DBG, "Erased map: %d granules, %d bytes\n", (int)_erased_granules, (int)(words * sizeof(uint32_t)));
+}
+
+void SDBlockDevice::_free_erased_map()
+{
+    delete[] _erased_map;
+    _erased_map = NULL;
+    _erased_granules = 0;
+}
+
+void SDBlockDevice::_mark_erased(bd_addr_t addr, bd_size_t size, bool erased)
+{
+    if (!_erased_map) {
+        return;
+    }
+
+    const bd_size_t granule = ERASED_MAP_GRANULE;
+    size_t first, last;
+    if (erased) {
+        // Only granules erased as a whole, the last one may be cut short by the end of the card
+        first = (addr + granule - 1) / granule;
+        last = (addr + size >= this->size()) ? _erased_granules : (addr + size) / granule;
+    } else {
+        first = addr / granule;
+        last = (addr + size + granule - 1) / granule;
+    }
+
+    for (size_t i = first; i < last; i++) {
+        if (erased) {
+            _erased_map[i / 32] |= (1UL << (i % 32));
+        } else {
+            _erased_map[i / 32] &= ~(1UL << (i % 32));
+        }
+    }
+}
+
+bool SDBlockDevice::_is_erased(bd_addr_t addr) const
+{
+    if (!_erased_map) {
+        return false;
+    }
+
+    size_t i = addr / ERASED_MAP_GRANULE;
+    return _erased_map[i / 32] & (1UL << (i % 32));
+}
 
-int SDBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+bool SDBlockDevice::_is_erased(bd_addr_t addr, bd_size_t size) const
 {
-    if (!is_valid_program(addr, size)) {
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (!_erased_map) {
+        return false;
     }
 
-    lock();
-    if (!_is_initialized) {
-        unlock();
-        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    const bd_size_t granule = ERASED_MAP_GRANULE;
+    for (bd_addr_t a = addr - addr % granule; a < addr + size; a += granule) {
+        if (!_is_erased(a)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    const uint8_t *buffer = static_cast<const uint8_t *>(b);
-    int status = BD_ERROR_OK;
-    uint8_t response;
+bd_size_t SDBlockDevice::get_erased_size()
+{
+    bd_size_t count = 0;
 
-    // Get block count
-    bd_addr_t blockCnt = size / _block_size;
+    lock();
+    for (size_t i = 0; _erased_map && (i < _erased_granules); i++) {
+        if (_erased_map[i / 32] & (1UL << (i % 32))) {
+            count++;
+        }
+    }
+    unlock();
+    return count * ERASED_MAP_GRANULE;
+}
 
-    // SDSC Card (CCS=0) uses byte unit address
-    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
-    if (SDCARD_V2HC == _card_type) {
-        addr = addr / _block_size;
+/* Deferred trim
+ * -------------
+ * With trim deferral enabled, trim() only records the range in a small queue.
+ * Ranges that overlap or touch are merged, so the many small fragments freed by
+ * a filesystem end up as a few large erases. Queued ranges are erased by a
+ * background thread once the card has seen no read, program or trim for the
+ * deferral time, and by sync() and deinit().
+ *
+ * The queue has to stay consistent with the data on the card:
+ *  - program() removes the programmed range from the queue, so a late erase
+ *    never destroys newer data. A range that would have to be split when the
+ *    queue is full is erased right away, before the program.
+ *  - read() erases the queued ranges it overlaps first, so a read returns the
+ *    same data before and after the erase takes place.
+ */
+int SDBlockDevice::_queue_trim(bd_addr_t addr, bd_size_t size)
+{
+    // Merge with every queued range that overlaps or touches the new one
+    for (size_t i = 0; i < _trim_count;) {
+        bd_addr_t end = _trims[i].addr + _trims[i].size;
+        if ((_trims[i].addr <= addr + size) && (addr <= end)) {
+            if (end < addr + size) {
+                end = addr + size;
+            }
+            if (_trims[i].addr < addr) {
+                addr = _trims[i].addr;
+            }
+            size = end - addr;
+            _trims[i] = _trims[--_trim_count];
+        } else {
+            i++;
+        }
     }
 
-    // Send command to perform write operation
-    if (blockCnt == 1) {
-        // Single block write command
-        if (BD_ERROR_OK != (status = _cmd(CMD24_WRITE_BLOCK, addr))) {
-            unlock();
+    // Queue full: make room by erasing what is queued
+    if (_trim_count == MBED_CONF_SD_TRIM_QUEUE_SIZE) {
+        int status = _flush_trims(0, this->size());
+        if (BD_ERROR_OK != status) {
             return status;
         }
+    }
 
-        // Write data
-        response = _write(buffer, SPI_START_BLOCK, _block_size);
+    _trims[_trim_count].addr = addr;
+    _trims[_trim_count].size = size;
+    _trim_count++;
 
-        // Only CRC and general write error are communicated via response token
-        if (response != SPI_DATA_ACCEPTED) {
-            debug_if(SD_DBG, "Single Block Write failed: 0x%x \n", response);
-            status = SD_BLOCK_DEVICE_ERROR_WRITE;
-        }
-    } else {
-        // Pre-erase setting prior to multiple block write operation
-        _cmd(ACMD23_SET_WR_BLK_ERASE_COUNT, blockCnt, 1);
+    if (BD_ERROR_OK != _start_trim_thread()) {
+        // No background thread, fall back to erasing right away
+        return _flush_trims(0, this->size());
+    }
+    _trim_flags.set(TRIM_QUEUED);
+    return BD_ERROR_OK;
+}
 
-        // Multiple block write command
-        if (BD_ERROR_OK != (status = _cmd(CMD25_WRITE_MULTIPLE_BLOCK, addr))) {
-            unlock();
-            return status;
+int SDBlockDevice::_unqueue_trim(bd_addr_t addr, bd_size_t size)
+{
+    int status = BD_ERROR_OK;
+    bd_addr_t end = addr + size;
+
+    for (size_t i = 0; i < _trim_count;) {
+        bd_addr_t trim_end = _trims[i].addr + _trims[i].size;
+        if ((trim_end <= addr) || (end <= _trims[i].addr)) {
+            i++;
+            continue;
         }
 
-        // Write the data: one block at a time
-        do {
-            response = _write(buffer, SPI_START_BLK_MUL_WRITE, _block_size);
-            if (response != SPI_DATA_ACCEPTED) {
-                debug_if(SD_DBG, "Multiple Block Write failed: 0x%x \n", response);
-                break;
+        // What is left of the queued range on either side, trimmed to erase boundaries
+        bd_addr_t head_end = addr - (addr % _erase_size);
+        bd_addr_t tail_addr = end + ((end % _erase_size) ? (_erase_size - end % _erase_size) : 0);
+        bool head = (_trims[i].addr < head_end);
+        bool tail = (tail_addr < trim_end);
+
+        if (head && tail && (_trim_count == MBED_CONF_SD_TRIM_QUEUE_SIZE)) {
+            // No room to split the range, erase it before it gets programmed
+            int err = _erase(_trims[i].addr, _trims[i].size);
+            if (BD_ERROR_OK == status) {
+                status = err;
             }
-            buffer += _block_size;
-        } while (--blockCnt);     // Receive all blocks of data
+            _trims[i] = _trims[--_trim_count];
+            continue;
+        }
 
-        /* In a Multiple Block write operation, the stop transmission will be done by
-         * sending 'Stop Tran' token instead of 'Start Block' token at the beginning
-         * of the next block
-         */
-        _spi.write(SPI_STOP_TRAN);
+        if (head && tail) {
+            _trims[_trim_count].addr = tail_addr;
+            _trims[_trim_count].size = trim_end - tail_addr;
+            _trim_count++;
+            _trims[i].size = head_end - _trims[i].addr;
+        } else if (head) {
+            _trims[i].size = head_end - _trims[i].addr;
+        } else if (tail) {
+            _trims[i].addr = tail_addr;
+            _trims[i].size = trim_end - tail_addr;
+        } else {
+            _trims[i] = _trims[--_trim_count];
+            continue;
+        }
+        i++;
     }
-
-    _deselect();
-    unlock();
     return status;
 }
 
-int SDBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+int SDBlockDevice::_flush_trims(bd_addr_t addr, bd_size_t size)
 {
-    if (!is_valid_read(addr, size)) {
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
-    }
-
-    lock();
-    if (!_is_initialized) {
-        unlock();
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (!_trim_count) {
+        return BD_ERROR_OK;
     }
 
-    uint8_t *buffer = static_cast<uint8_t *>(b);
+    BusSession session(this);
     int status = BD_ERROR_OK;
-    bd_addr_t blockCnt =  size / _block_size;
 
-    // SDSC Card (CCS=0) uses byte unit address
-    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
-    if (SDCARD_V2HC == _card_type) {
-        addr = addr / _block_size;
+    for (size_t i = 0; i < _trim_count;) {
+        if ((_trims[i].addr + _trims[i].size <= addr) || (addr + size <= _trims[i].addr)) {
+            i++;
+            continue;
+        }
+
+        int err = _erase(_trims[i].addr, _trims[i].size);
+        if (BD_ERROR_OK == status) {
+            status = err;
+        }
+        _trims[i] = _trims[--_trim_count];
     }
+    return status;
+}
 
-    // Write command ro receive data
-    if (blockCnt > 1) {
-        status = _cmd(CMD18_READ_MULTIPLE_BLOCK, addr);
-    } else {
-        status = _cmd(CMD17_READ_SINGLE_BLOCK, addr);
+int SDBlockDevice::_start_trim_thread()
+{
+    if (_trim_thread) {
+        return BD_ERROR_OK;
     }
-    if (BD_ERROR_OK != status) {
-        unlock();
-        return status;
+
+    _trim_stop = false;
+    _trim_thread = new Thread(osPriorityBelowNormal, MBED_CONF_SD_TRIM_THREAD_STACK_SIZE);
+    if (_trim_thread->start(callback(this, &SDBlockDevice::_trim_run)) != osOK) {
+        delete _trim_thread;
+        _trim_thread = NULL;
+        return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
     }
+    return BD_ERROR_OK;
+}
 
-    // receive the data : one block at a time
-    while (blockCnt) {
-        if (0 != _read(buffer, _block_size)) {
-            status = SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
-            break;
-        }
-        buffer += _block_size;
-        --blockCnt;
+void SDBlockDevice::_stop_trim_thread()
+{
+    if (_trim_thread) {
+        _trim_stop = true;
+        _trim_flags.set(TRIM_STOP);
+        _trim_thread->join();
+        delete _trim_thread;
+        _trim_thread = NULL;
     }
-    _deselect();
+}
 
-    // Send CMD12(0x00000000) to stop the transmission for multi-block transfer
-    if (size > _block_size) {
-        status = _cmd(CMD12_STOP_TRANSMISSION, 0x0);
+void SDBlockDevice::_trim_run()
+{
+    while (!_trim_stop) {
+        _trim_flags.wait_any(TRIM_QUEUED | TRIM_STOP);
+
+        // Wait for the card to go idle, then erase everything that is queued
+        while (!_trim_stop) {
+            lock();
+            uint32_t idle_ms = _idle_timer.read_ms();
+            uint32_t defer_ms = _trim_defer_ms;
+            if (!_trim_count || !_is_initialized) {
+                unlock();
+                break;
+            }
+            if (idle_ms >= defer_ms) {
+                int status = _flush_trims(0, size());
+                unlock();
+                if (status) {
+                    debug_if(SD_DBG, "Deferred trim failed: %d\n", status);
+                }
+                break;
+            }
+            unlock();
+            _trim_flags.wait_any(TRIM_STOP, defer_ms - idle_ms, false);
+        }
     }
-    unlock();
-    return status;
 }
 
-bool SDBlockDevice::_is_valid_trim(bd_addr_t addr, bd_size_t size)
+bd_size_t SDBlockDevice::get_read_size() const
 {
-    return (
-               addr % _erase_size == 0 &&
-               size % _erase_size == 0 &&
-               addr + size <= this->size());
+    return _block_size;
 }
 
-int SDBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+bd_size_t SDBlockDevice::get_program_size() const
 {
-    if (!_is_valid_trim(addr, size)) {
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
-    }
+    return _block_size;
+}
 
-    lock();
+bd_size_t SDBlockDevice::get_erase_size() const
+{
+    return _block_size;
+}
+
+int SDBlockDevice::get_sd_status(sd_status_t *status) const
+{
     if (!_is_initialized) {
-        unlock();
         return SD_BLOCK_DEVICE_ERROR_NO_INIT;
     }
-    int status = BD_ERROR_OK;
-
-    size -= _block_size;
-    // SDSC Card (CCS=0) uses byte unit address
-    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
-    if (SDCARD_V2HC == _card_type) {
-        size = size / _block_size;
-        addr = addr / _block_size;
+    if (!_sd_status_valid) {
+        return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
     }
+    *status = _sd_status;
+    status->erase_block_size = _erase_size;
+    return BD_ERROR_OK;
+}
 
-    // Start lba sent in start command
-    if (BD_ERROR_OK != (status = _cmd(CMD32_ERASE_WR_BLK_START_ADDR, addr))) {
-        unlock();
-        return status;
-    }
+void SDBlockDevice::get_stats(sd_stats_t *stats)
+{
+    lock();
+    *stats = _stats;
+    unlock();
+}
 
-    // End lba = addr+size sent in end addr command
-    if (BD_ERROR_OK != (status = _cmd(CMD33_ERASE_WR_BLK_END_ADDR, addr + size))) {
-        unlock();
-        return status;
-    }
-    status = _cmd(CMD38_ERASE, 0x0);
+void SDBlockDevice::reset_stats()
+{
+    lock();
+    memset(&_stats, 0, sizeof(_stats));
     unlock();
-    return status;
 }
 
-bd_size_t SDBlockDevice::get_read_size() const
+sd_buffer_pool_t *SDBlockDevice::get_buffer_pool()
 {
-    return _block_size;
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    return &sd_buffer_pool;
+#else
+    return NULL;
+#endif
 }
 
-bd_size_t SDBlockDevice::get_program_size() const
+bd_size_t SDBlockDevice::get_allocation_unit_size() const
 {
-    return _block_size;
+    return _sd_status.au_size;
 }
 
 bd_size_t SDBlockDevice::size() const
@@ -645,25 +1829,36 @@ int SDBlockDevice::frequency(uint64_t freq)
     return err;
 }
 
+void SDBlockDevice::set_busy_release(bool enable)
+{
+    lock();
+    _busy_release = enable;
+    unlock();
+}
+
 // PRIVATE FUNCTIONS
 int SDBlockDevice::_freq(void)
 {
     // Max frequency supported is 25MHZ
     if (_transfer_sck <= 25000000) {
-        _spi.frequency(_transfer_sck);
+        _transport->frequency(_transfer_sck);
         return 0;
     } else {  // TODO: Switch function to be implemented for higher frequency
         _transfer_sck = 25000000;
-        _spi.frequency(_transfer_sck);
+        _transport->frequency(_transfer_sck);
         return -EINVAL;
     }
 }
 
-uint8_t SDBlockDevice::_cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg)
+uint8_t SDBlockDevice::_cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg, uint8_t *tail)
 {
-    uint8_t response;
-    char cmdPacket[PACKET_SIZE];
+    uint8_t response = R1_NO_RESPONSE;
+    uint8_t cmdPacket[PACKET_SIZE + SPI_NCR_WINDOW + SPI_R3_TAIL_SIZE];
+    uint8_t rx[PACKET_SIZE + SPI_NCR_WINDOW + SPI_R3_TAIL_SIZE];
+    size_t tail_size = ((CMD8_SEND_IF_COND == cmd) || (CMD58_READ_OCR == cmd)) ? SPI_R3_TAIL_SIZE : 0;
+    size_t tail_received = 0;
     uint32_t crc;
+    int i = 0;
 
     // Prepare the command packet
     cmdPacket[0] = SPI_CMD(cmd);
@@ -672,7 +1867,7 @@ uint8_t SDBlockDevice::_cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg)
     cmdPacket[3] = (arg >> 8);
     cmdPacket[4] = (arg >> 0);
 
-    if (_crc_on) {
+    if (SD_CRC_ON) {
         _crc7.compute((void *)cmdPacket, 5, &crc);
         cmdPacket[5] = (char)(crc | 0x01);
     } else {
@@ -691,23 +1886,61 @@ uint8_t SDBlockDevice::_cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg)
         }
     }
 
-    // send a command
-    for (int i = 0; i < PACKET_SIZE; i++) {
-        _spi.write(cmdPacket[i]);
-    }
+    switch (cmd) {
+        // The card may send a data block right after the response, and the
+        // received byte immediataly following CMD12 is a stuff byte: these are
+        // polled one byte at a time so nothing past the response is clocked out.
+        // 6 and 13 double as ACMD6 and ACMD13, which return data.
+        case CMD6_SWITCH_FUNC:
+        case CMD9_SEND_CSD:
+        case CMD10_SEND_CID:
+        case CMD12_STOP_TRANSMISSION:
+        case CMD13_SEND_STATUS:
+        case CMD17_READ_SINGLE_BLOCK:
+        case CMD18_READ_MULTIPLE_BLOCK:
+        case ACMD22_SEND_NUM_WR_BLOCKS:
+        case ACMD51_SEND_SCR:
+        case CMD56_GEN_CMD:
+            _bus_transfer(cmdPacket, NULL, PACKET_SIZE);
+            if (CMD12_STOP_TRANSMISSION == cmd) {
+                _bus_transfer(SPI_FILL_CHAR);
+            }
+            break;
 
-    // The received byte immediataly following CMD12 is a stuff byte,
-    // it should be discarded before receive the response of the CMD12.
-    if (CMD12_STOP_TRANSMISSION == cmd) {
-        _spi.write(SPI_FILL_CHAR);
+        // Other commands go out in one transfer with the response window and
+        // the trailing R3/R7 bytes, the response is picked from what came back
+        default: {
+            size_t length = PACKET_SIZE + SPI_NCR_WINDOW + tail_size;
+            memset(cmdPacket + PACKET_SIZE, SPI_FILL_CHAR, length - PACKET_SIZE);
+            _bus_transfer(cmdPacket, rx, length);
+
+            for (size_t j = PACKET_SIZE; j < length; j++, i++) {
+                if (!(rx[j] & R1_RESPONSE_RECV)) {
+                    response = rx[j];
+                    tail_received = std::min(tail_size, length - j - 1);
+                    memcpy(tail, &rx[j + 1], tail_received);
+                    break;
+                }
+            }
+            break;
+        }
     }
 
     // Loop for response: Response is sent back within command response time (NCR), 0 to 8 bytes for SDC
-    for (int i = 0; i < 0x10; i++) {
-        response = _spi.write(SPI_FILL_CHAR);
-        // Got the response
-        if (!(response & R1_RESPONSE_RECV)) {
-            break;
+    if (response & R1_RESPONSE_RECV) {
+        for (; i < 0x10; i++) {
+            response = _bus_transfer(SPI_FILL_CHAR);
+            // Got the response
+            if (!(response & R1_RESPONSE_RECV)) {
+                break;
+            }
+        }
+    }
+
+    // Rest of an R3/R7 response that did not fit in the transfer
+    if (!(response & R1_RESPONSE_RECV)) {
+        for (; tail_received < tail_size; tail_received++) {
+            tail[tail_received] = _bus_transfer(SPI_FILL_CHAR);
         }
     }
     return response;
@@ -717,6 +1950,7 @@ int SDBlockDevice::_cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAc
 {
     int32_t status = BD_ERROR_OK;
     uint32_t response;
+    uint8_t tail[SPI_R3_TAIL_SIZE];
 
     // Select card and wait for card to be ready before sending next command
     // Note: next command will fail if card is not ready
@@ -724,7 +1958,7 @@ int SDBlockDevice::_cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAc
 
     // No need to wait for card to be ready when sending the stop command
     if (CMD12_STOP_TRANSMISSION != cmd) {
-        if (false == _wait_ready(SD_COMMAND_TIMEOUT)) {
+        if (false == _wait_cmd_ready()) {
             debug_if(SD_DBG, "Card not ready yet \n");
         }
     }
@@ -733,15 +1967,17 @@ int SDBlockDevice::_cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAc
     for (int i = 0; i < 3; i++) {
         // Send CMD55 for APP command first
         if (isAcmd) {
-            response = _cmd_spi(CMD55_APP_CMD, 0x0);
+            response = _cmd_spi(CMD55_APP_CMD, 0x0, tail);
+            _ready = (R1_NO_RESPONSE != response);
             // Wait for card to be ready after CMD55
-            if (false == _wait_ready(SD_COMMAND_TIMEOUT)) {
+            if (false == _wait_cmd_ready()) {
                 debug_if(SD_DBG, "Card not ready yet \n");
             }
         }
 
         // Send command over SPI interface
-        response = _cmd_spi(cmd, arg);
+        _ready = false;
+        response = _cmd_spi(cmd, arg, tail);
         if (R1_NO_RESPONSE == response) {
             debug_if(SD_DBG, "No response CMD:%d \n", cmd);
             continue;
@@ -789,22 +2025,31 @@ int SDBlockDevice::_cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAc
             debug_if(_dbg, "V2-Version Card\n");
             _card_type = SDCARD_V2;
         // Note: No break here, need to read rest of the response
-        case CMD58_READ_OCR:                // Response R3
-            response  = (_spi.write(SPI_FILL_CHAR) << 24);
-            response |= (_spi.write(SPI_FILL_CHAR) << 16);
-            response |= (_spi.write(SPI_FILL_CHAR) << 8);
-            response |= _spi.write(SPI_FILL_CHAR);
+        case CMD58_READ_OCR:                // Response R3, received with the R1
+            response  = (tail[0] << 24);
+            response |= (tail[1] << 16);
+            response |= (tail[2] << 8);
+            response |= tail[3];
             debug_if(_dbg, "R3/R7: 0x%x \n", response);
             break;
 
         case CMD12_STOP_TRANSMISSION:       // Response R1b
-        case CMD38_ERASE:
             _wait_ready(SD_COMMAND_TIMEOUT);
             break;
 
+        case CMD38_ERASE:                   // Response R1b, busy for the whole erase
+            if (false == _wait_ready(_erase_timeout_ms)) {
+                debug_if(SD_DBG, "Erase timeout after %d ms\n", _erase_timeout_ms);
+                status = SD_BLOCK_DEVICE_ERROR_ERASE;
+            }
+            break;
+
         case ACMD13_SD_STATUS:             // Response R2
-            response = _spi.write(SPI_FILL_CHAR);
+            response = _bus_transfer(SPI_FILL_CHAR);
             debug_if(_dbg, "R2: 0x%x \n", response);
+            if (response) {
+                status = SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+            }
             break;
 
         default:                            // Response R1
@@ -817,12 +2062,18 @@ int SDBlockDevice::_cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAc
     }
 
     // Do not deselect card if read is in progress.
-    if (((CMD9_SEND_CSD == cmd) || (ACMD22_SEND_NUM_WR_BLOCKS == cmd) ||
-            (CMD24_WRITE_BLOCK == cmd) || (CMD25_WRITE_MULTIPLE_BLOCK == cmd) ||
-            (CMD17_READ_SINGLE_BLOCK == cmd) || (CMD18_READ_MULTIPLE_BLOCK == cmd))
-            && (BD_ERROR_OK == status)) {
+    bool data = ((CMD9_SEND_CSD == cmd) || (ACMD22_SEND_NUM_WR_BLOCKS == cmd) ||
+                 (ACMD13_SD_STATUS == cmd) || (ACMD51_SEND_SCR == cmd) ||
+                 (CMD24_WRITE_BLOCK == cmd) || (CMD25_WRITE_MULTIPLE_BLOCK == cmd) ||
+                 (CMD17_READ_SINGLE_BLOCK == cmd) || (CMD18_READ_MULTIPLE_BLOCK == cmd));
+    if (data && (BD_ERROR_OK == status)) {
         return BD_ERROR_OK;
     }
+
+    // A plain R1 leaves the card ready, R1b commands were waited for above
+    if (!data && (CMD12_STOP_TRANSMISSION != cmd) && (CMD38_ERASE != cmd)) {
+        _ready = true;
+    }
     // Deselect card
     _deselect();
     return status;
@@ -881,14 +2132,14 @@ int SDBlockDevice::_read_bytes(uint8_t *buffer, uint32_t length)
 
     // read data
     for (uint32_t i = 0; i < length; i++) {
-        buffer[i] = _spi.write(SPI_FILL_CHAR);
+        buffer[i] = _bus_transfer(SPI_FILL_CHAR);
     }
 
     // Read the CRC16 checksum for the data block
-    crc = (_spi.write(SPI_FILL_CHAR) << 8);
-    crc |= _spi.write(SPI_FILL_CHAR);
+    crc = (_bus_transfer(SPI_FILL_CHAR) << 8);
+    crc |= _bus_transfer(SPI_FILL_CHAR);
 
-    if (_crc_on) {
+    if (SD_CRC_ON) {
         uint32_t crc_result;
         // Compute and verify checksum
         _crc16.compute((void *)buffer, length, &crc_result);
@@ -915,14 +2166,16 @@ int SDBlockDevice::_read(uint8_t *buffer, uint32_t length)
         return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
     }
 
-    // read data
-    _spi.write(NULL, 0, (char *)buffer, length);
-
-    // Read the CRC16 checksum for the data block
-    crc = (_spi.write(SPI_FILL_CHAR) << 8);
-    crc |= _spi.write(SPI_FILL_CHAR);
+    // read data straight into the buffer, followed by the CRC16 checksum for the data block
+    uint8_t crc_bytes[2];
+    sd_transfer_t chain[2] = {
+        { NULL, buffer, length },
+        { NULL, crc_bytes, sizeof(crc_bytes) },
+    };
+    _transfer_data(chain, 2);
+    crc = (crc_bytes[0] << 8) | crc_bytes[1];
 
-    if (_crc_on) {
+    if (SD_CRC_ON) {
         uint32_t crc_result;
         // Compute and verify checksum
         _crc16.compute((void *)buffer, length, &crc_result);
@@ -936,30 +2189,34 @@ int SDBlockDevice::_read(uint8_t *buffer, uint32_t length)
     return 0;
 }
 
-uint8_t SDBlockDevice::_write(const uint8_t *buffer, uint8_t token, uint32_t length)
+uint8_t SDBlockDevice::_write(const uint8_t *buffer, uint8_t token, uint32_t length, const uint8_t *stage)
 {
 
     uint32_t crc = (~0);
     uint8_t response = 0xFF;
 
-    // indicate start of block
-    _spi.write(token);
-
-    // write the data
-    _spi.write((char *)buffer, length, NULL, 0);
-
-    if (_crc_on) {
+    if (SD_CRC_ON) {
         // Compute CRC
         _crc16.compute((void *)buffer, length, &crc);
     }
 
-    // write the checksum CRC16
-    _spi.write(crc >> 8);
-    _spi.write(crc);
-
+    // Start token, the data, the checksum CRC16 and the response token in one chain
+    uint8_t trailer_tx[3] = { (uint8_t)(crc >> 8), (uint8_t)crc, SPI_FILL_CHAR };
+    uint8_t trailer_rx[3];
+    sd_transfer_t chain[3] = {
+        { &token, NULL, 1 },
+        { buffer, NULL, length },
+        { trailer_tx, trailer_rx, sizeof(trailer_tx) },
+    };
+    _transfer_data(chain, 3);
 
     // check the response token
-    response = _spi.write(SPI_FILL_CHAR);
+    response = trailer_rx[2];
+
+    // The bounce buffer is free again, stage the next block while the card is busy
+    if (stage) {
+        memcpy(_bounce, stage, length);
+    }
 
     // Wait for last block to be written
     if (false == _wait_ready(SD_COMMAND_TIMEOUT)) {
@@ -1043,74 +2300,195 @@ bd_size_t SDBlockDevice::_sd_sectors()
     return blocks;
 }
 
-// SPI function to wait till chip is ready and sends start token
-bool SDBlockDevice::_wait_token(uint8_t token)
+/* SD Status
+ * ---------
+ * ACMD13 returns R2 followed by a 64-byte data block, most significant bit first:
+ *
+ *   [447:440] SPEED_CLASS        [407:402] ERASE_TIMEOUT      [391:384] VIDEO_SPEED_CLASS
+ *   [431:428] AU_SIZE            [401:400] ERASE_OFFSET
+ *   [423:408] ERASE_SIZE         [399:396] UHS_SPEED_GRADE
+ *
+ * Erasing N allocation units takes at most
+ *   ERASE_TIMEOUT / ERASE_SIZE * N + ERASE_OFFSET seconds
+ */
+static const uint8_t sd_speed_class[] = { 0, 2, 4, 6, 10 };
+
+// AU_SIZE 0x1 to 0x9 are 16 KiB to 4 MiB in powers of two, above that in MiB
+static const uint8_t sd_au_size_mb[] = { 8, 12, 16, 24, 32, 64 };
+
+int SDBlockDevice::_read_sd_status()
 {
-    _spi_timer.reset();
-    _spi_timer.start();
+    uint8_t status[64];
+    int err;
 
-    do {
-        if (token == _spi.write(SPI_FILL_CHAR)) {
-            _spi_timer.stop();
-            return true;
+    _sd_status_valid = false;
+    memset(&_sd_status, 0, sizeof(_sd_status));
+
+    if ((err = _cmd(ACMD13_SD_STATUS, 0x0, 1)) != 0) {
+        return err;
+    }
+    if ((err = _read_bytes(status, sizeof(status))) != 0) {
+        return err;
+    }
+
+    uint8_t au = status[10] >> 4;
+    if ((au > 0) && (au < 0xA)) {
+        _sd_status.au_size = (16 * 1024ULL) << (au - 1);
+    } else if (au >= 0xA) {
+        _sd_status.au_size = (bd_size_t)sd_au_size_mb[au - 0xA] * 1024 * 1024;
+    }
+    _sd_status.erase_size = (status[11] << 8) | status[12];
+    _sd_status.erase_timeout = status[13] >> 2;
+    _sd_status.erase_offset = status[13] & 0x3;
+    if (status[8] < sizeof(sd_speed_class)) {
+        _sd_status.speed_class = sd_speed_class[status[8]];
+    }
+    _sd_status.uhs_speed_grade = status[14] >> 4;
+    _sd_status.video_speed_class = status[15];
+    _sd_status_valid = true;
+
+    debug_if(SD_DBG, "AU: %llu bytes, speed class: %d, erase: %d AU in %d+%d s\n",
+             _sd_status.au_size, _sd_status.speed_class, _sd_status.erase_size,
+             _sd_status.erase_timeout, _sd_status.erase_offset);
+    return BD_ERROR_OK;
+}
+
+/* SCR
+ * ---
+ * ACMD51 returns R1 followed by an 8-byte data block. DATA_STAT_AFTER_ERASE,
+ * bit 55, is the value erased blocks read as.
+ */
+int SDBlockDevice::_read_scr()
+{
+    uint8_t scr[8];
+    int err;
+
+    _erase_value = -1;
+    if ((err = _cmd(ACMD51_SEND_SCR, 0x0, 1)) != 0) {
+        return err;
+    }
+    if ((err = _read_bytes(scr, sizeof(scr))) != 0) {
+        return err;
+    }
+
+    _erase_value = (scr[1] & 0x80) ? 0xFF : 0x00;
+    debug_if(SD_DBG, "SCR: SD_SPEC %d, erased blocks read 0x%02x\n", scr[0] & 0xF, _erase_value);
+    return BD_ERROR_OK;
+}
+
+uint32_t SDBlockDevice::_erase_timeout(bd_size_t size)
+{
+    uint32_t timeout = SD_COMMAND_TIMEOUT;
+
+    if (_sd_status.au_size && _sd_status.erase_size && _sd_status.erase_timeout) {
+        uint64_t aus = (size + _sd_status.au_size - 1) / _sd_status.au_size;
+        uint64_t ms = (aus * _sd_status.erase_timeout * 1000) / _sd_status.erase_size +
+                      _sd_status.erase_offset * 1000;
+        if (ms > timeout) {
+            timeout = (ms < MBED_CONF_SD_ERASE_TIMEOUT_MAX) ? (uint32_t)ms : MBED_CONF_SD_ERASE_TIMEOUT_MAX;
         }
-    } while (_spi_timer.read_ms() < 300);       // Wait for 300 msec for start token
-    _spi_timer.stop();
+    } else if (_sd_status.au_size) {
+        // No erase timing: allow 250 ms per AU, as for a card without the fields
+        uint64_t ms = ((size + _sd_status.au_size - 1) / _sd_status.au_size) * 250;
+        if (ms > timeout) {
+            timeout = (ms < MBED_CONF_SD_ERASE_TIMEOUT_MAX) ? (uint32_t)ms : MBED_CONF_SD_ERASE_TIMEOUT_MAX;
+        }
+    }
+    return timeout;
+}
+
+// SPI function to wait till chip is ready and sends start token
+bool SDBlockDevice::_wait_token(uint8_t token)
+{
+    // Wait for 300 msec for start token
+    if (_bus_poll(token, 300 * 1000)) {
+        return true;
+    }
     debug_if(SD_DBG, "_wait_token: timeout\n");
     return false;
 }
 
 // SPI function to wait till chip is ready
 // The host controller should wait for end of the process until DO goes high (a 0xFF is received).
-bool SDBlockDevice::_wait_ready(uint16_t ms)
+// The card only signals busy on DO while it is selected, and the host is allowed to deselect it
+// during the busy phase. With busy release enabled, long waits give up CS and the bus lock
+// between polls so that other devices on the bus can transfer in the meantime.
+bool SDBlockDevice::_wait_ready(uint32_t ms)
 {
-    uint8_t response;
+    uint32_t spin_us = _busy_release ? MBED_CONF_SD_BUSY_RELEASE_SPIN_US : ms * 1000;
     _spi_timer.reset();
     _spi_timer.start();
     do {
-        response = _spi.write(SPI_FILL_CHAR);
-        if (response == 0xFF) {
+        if (_bus_poll(0xFF, spin_us)) {
             _spi_timer.stop();
+            _ready = true;
             return true;
         }
-    } while (_spi_timer.read_ms() < ms);
+        if (_busy_release) {
+            // Release the bus even inside a session
+            _bus_deselect();
+            wait_ms(MBED_CONF_SD_BUSY_RELEASE_INTERVAL_MS);
+            _bus_select();
+            spin_us = 0;
+        }
+    } while ((uint32_t)_spi_timer.read_ms() < ms);
     _spi_timer.stop();
     return false;
 }
 
-// SPI function to wait for count
-void SDBlockDevice::_spi_wait(uint8_t count)
+// Wait for the card before a command. A card known to be ready only needs the
+// gap of at least 8 clocks between the previous response and the next command.
+bool SDBlockDevice::_wait_cmd_ready()
 {
-    for (uint8_t i = 0; i < count; ++i) {
-        _spi.write(SPI_FILL_CHAR);
+    if (_ready) {
+        _bus_transfer(SPI_FILL_CHAR);
+        return true;
     }
+    return _wait_ready(SD_COMMAND_TIMEOUT);
 }
 
-void SDBlockDevice::_spi_init()
+void SDBlockDevice::_select()
 {
-    _spi.lock();
-    // Set to SCK for initialization, and clock card with cs = 1
-    _spi.frequency(_init_sck);
-    _spi.format(8, 0);
-    _spi.set_default_write_value(SPI_FILL_CHAR);
-    // Initial 74 cycles required for few cards, before selecting SPI mode
-    _cs = 1;
-    _spi_wait(10);
-    _spi.unlock();
+    // Already selected by the session
+    if (_session_depth && _selected) {
+        return;
+    }
+    _bus_select();
+    _selected = true;
+    _ready = false;
 }
 
-void SDBlockDevice::_select()
+void SDBlockDevice::_deselect()
 {
-    _spi.lock();
-    _spi.write(SPI_FILL_CHAR);
-    _cs = 0;
+    // The session deselects when it ends
+    if (_session_depth) {
+        return;
+    }
+    _bus_deselect();
+    _selected = false;
 }
 
-void SDBlockDevice::_deselect()
+/* Bus sessions
+ * ------------
+ * Every command normally selects the card, waits for it to be ready and
+ * deselects it again, each of which locks the bus and clocks a dummy byte.
+ * A session keeps the card selected and the bus locked across a sequence of
+ * commands (erase, init, multi-block transfers with their setup and stop
+ * commands). Within the sequence, a command following one that left the card
+ * ready skips the ready poll. Sessions nest, the outermost one deselects.
+ */
+void SDBlockDevice::_begin_session()
+{
+    if (!_session_depth++) {
+        _select();
+    }
+}
+
+void SDBlockDevice::_end_session()
 {
-    _cs = 1;
-    _spi.write(SPI_FILL_CHAR);
-    _spi.unlock();
+    if (!--_session_depth && _selected) {
+        _deselect();
+    }
 }
 
 #endif  /* DEVICE_SPI */
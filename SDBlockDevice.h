@@ -21,10 +21,63 @@
 #ifdef DEVICE_SPI
 
 #include "BlockDevice.h"
+#include "SDSPITransport.h"
+#include "SDBufferPool.h"
 #include "mbed.h"
 #include "platform/PlatformMutex.h"
 
+#ifndef MBED_CONF_SD_NULL_MUTEX
+#define MBED_CONF_SD_NULL_MUTEX                  0      /*!< 1 - No locking, for firmware using the card from one thread only */
+#endif
+
+#ifndef MBED_CONF_SD_TRIM_QUEUE_SIZE
+#define MBED_CONF_SD_TRIM_QUEUE_SIZE             8      /*!< Number of deferred trim ranges */
+#endif
+
+#define SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK        -5001  /*!< operation would block */
+#define SD_BLOCK_DEVICE_ERROR_UNSUPPORTED        -5002  /*!< unsupported operation */
+#define SD_BLOCK_DEVICE_ERROR_PARAMETER          -5003  /*!< invalid parameter */
+#define SD_BLOCK_DEVICE_ERROR_NO_INIT            -5004  /*!< uninitialized */
+#define SD_BLOCK_DEVICE_ERROR_NO_DEVICE          -5005  /*!< device is missing or not connected */
+#define SD_BLOCK_DEVICE_ERROR_WRITE_PROTECTED    -5006  /*!< write protected */
+#define SD_BLOCK_DEVICE_ERROR_UNUSABLE           -5007  /*!< unusable card */
+#define SD_BLOCK_DEVICE_ERROR_NO_RESPONSE        -5008  /*!< No response from device */
+#define SD_BLOCK_DEVICE_ERROR_CRC                -5009  /*!< CRC error */
+#define SD_BLOCK_DEVICE_ERROR_ERASE              -5010  /*!< Erase error: reset/sequence */
+#define SD_BLOCK_DEVICE_ERROR_WRITE              -5011  /*!< SPI Write error: !SPI_DATA_ACCEPTED */
+#define SD_BLOCK_DEVICE_ERROR_NO_BUFFER          -5012  /*!< no staging buffer free in the buffer pool */
+
+/** SD Status fields, decoded from the 64-byte SD Status register (ACMD13),
+ *  and the erase granularity from the CSD
+ */
+struct sd_status_t {
+    bd_size_t au_size;          /*!< Allocation unit size in bytes, 0 if not defined */
+    uint16_t erase_size;        /*!< Number of AUs erased at a time by the timing below, 0 if not supported */
+    uint8_t erase_timeout;      /*!< Timeout in seconds for erasing erase_size AUs, 0 if not supported */
+    uint8_t erase_offset;       /*!< Fixed offset in seconds added to the erase timeout */
+    uint8_t speed_class;        /*!< Speed class in MB/s: 0, 2, 4, 6 or 10 */
+    uint8_t uhs_speed_grade;    /*!< UHS speed grade in units of 10 MB/s: 0, 1 or 3 */
+    uint8_t video_speed_class;  /*!< Video speed class in MB/s, 0 if not supported */
+    bd_size_t erase_block_size; /*!< Smallest range the card erases in bytes, trim() skips partial ones */
+};
+
+/** Error recovery counters, since the SDBlockDevice was created or its last reset_stats()
+ */
+struct sd_stats_t {
+    uint32_t read_retries;      /*!< Blocks read again after a CRC error or a timeout */
+    uint32_t read_errors;       /*!< Reads failed, retries exhausted or not retryable */
+    uint32_t write_retries;     /*!< Writes resumed after the card rejected a block */
+    uint32_t write_blocks_kept; /*!< Blocks committed before a rejected block, not sent again */
+    uint32_t write_errors;      /*!< Writes failed, retries exhausted or not retryable */
+    uint32_t bounced;           /*!< Reads and programs staged through a bounce buffer */
+    uint32_t unstaged;          /*!< Reads and programs that needed a bounce buffer when none was free */
+};
+
 /** Access an SD Card using SPI
+ *
+ *  The FIXED_CRC, HC_ONLY and NULL_MUTEX config options fix the CRC setting,
+ *  the accepted card types and the locking at build time. They apply to every
+ *  SDBlockDevice in the application, not to single instances.
  *
  * @code
  * #include "mbed.h"
@@ -46,6 +99,14 @@ public:
     /** Lifetime of an SD card
      */
     SDBlockDevice(PinName mosi, PinName miso, PinName sclk, PinName cs, uint64_t hz = 1000000, bool crc_on = 0);
+
+    /** Lifetime of an SD card on another transport
+     *
+     *  @param transport    Bus to the card, must outlive the block device
+     *  @param hz           Transfer frequency
+     *  @param crc_on       true to check the CRC of commands and data
+     */
+    SDBlockDevice(SDTransport *transport, uint64_t hz = 1000000, bool crc_on = 0);
     virtual ~SDBlockDevice();
 
     /** Initialize a block device
@@ -54,13 +115,70 @@ public:
      */
     virtual int init();
 
+    /** Initialize a block device in the background
+     *
+     *  Card bring-up, CSD read, block length and clock switch run on a background thread
+     *  and this call returns immediately. Completion is signalled through the callback and
+     *  wait_init(). Until then, read(), program() and trim() either wait for the card to be
+     *  ready or fail with SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK, as selected by fail_fast.
+     *
+     *  The callback runs on the background thread, whose stack is only
+     *  MBED_CONF_SD_INIT_ASYNC_STACK_SIZE bytes (1 KB by default). Keep it short, for
+     *  example set a flag or post the real work to an EventQueue, or raise the stack size.
+     *
+     *  @param ready        Called from the background thread with the result of the init
+     *  @param fail_fast    true to fail operations issued before the card is ready,
+     *                      false to hold them until it is
+     *  @return             0 if the background init was started or a negative error code
+     */
+    virtual int init_async(Callback<void(int)> ready = NULL, bool fail_fast = false);
+
+    /** Wait for a background init to complete
+     *
+     *  @param ms       Timeout in milliseconds
+     *  @return         Result of the init, SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK if it is
+     *                  still in progress after the timeout, or SD_BLOCK_DEVICE_ERROR_NO_INIT
+     *                  if no background init was started
+     */
+    int wait_init(uint32_t ms = osWaitForever);
+
+    /** Initialize several block devices concurrently
+     *
+     *  Boot time no longer grows with the number of cards. Cards on separate SPI buses
+     *  are brought up from their own thread. Cards sharing a bus are brought up together
+     *  by interleaving their ACMD41 polls, as each card completes its power up sequence
+     *  internally. The call returns once every card is done.
+     *
+     *  @param sds      Array of block devices to initialize
+     *  @param count    Number of block devices in the array
+     *  @param errs     Optional array of count entries receiving the result of each init
+     *  @return         0 if every block device was initialized, otherwise the first error
+     */
+    static int init_concurrent(SDBlockDevice **sds, size_t count, int *errs = NULL);
+
     /** Deinitialize a block device
      *
      *  @return         0 on success or a negative error code on failure
      */
     virtual int deinit();
 
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  Issues any trims that are still queued.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
     /** Read blocks from a block device
+     *
+     *  A block failing its CRC or timing out is read again, up to
+     *  MBED_CONF_SD_READ_RETRIES times, keeping the blocks received before it.
+     *
+     *  With the erased range map enabled (MBED_CONF_SD_ERASED_MAP_GRANULE), parts of
+     *  the range known to be erased are filled with the erase value without going to
+     *  the card. Cards needing a map larger than MBED_CONF_SD_ERASED_MAP_MAX_SIZE
+     *  bytes go without it.
      *
      *  @param buffer   Buffer to write blocks to
      *  @param addr     Address of block to begin reading from
@@ -73,6 +191,9 @@ public:
      *
      *  The blocks must have been erased prior to being programmed
      *
+     *  When the card rejects a block, the card is asked how many blocks it committed
+     *  (ACMD22) and only the rest is sent again, up to MBED_CONF_SD_WRITE_RETRIES times.
+     *
      *  @param buffer   Buffer of data to write to blocks
      *  @param addr     Address of block to begin writing to
      *  @param size     Size to write in bytes, must be a multiple of program block size
@@ -80,6 +201,53 @@ public:
      */
     virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
 
+    /** Set blocks to zero
+     *
+     *  When the card reads erased blocks as zero, the whole erase blocks in the range
+     *  are erased with a single CMD38 and only the unaligned ends are written. Otherwise
+     *  the zeroes are streamed to the card, without the caller providing a buffer.
+     *
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int write_zeroes(bd_addr_t addr, bd_size_t size);
+
+    /** Open a multiple block write stream
+     *
+     *  Starts one CMD25 covering the whole region, after telling the card its
+     *  length (ACMD23) so it can pre-erase. The stream is then fed with
+     *  stream_program() and closed with stream_end(), all from the calling
+     *  thread; calls from any other thread are refused. The card stays
+     *  selected and the block device locked until the stream ends, so every
+     *  other operation on the card, and on other devices of its SPI bus,
+     *  blocks until stream_end().
+     *
+     *  @param addr     Address of the first block of the region
+     *  @param size     Size of the region in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    int stream_begin(bd_addr_t addr, bd_size_t size);
+
+    /** Append blocks to the open write stream
+     *
+     *  On failure the stream is closed, as if by stream_end().
+     *
+     *  @param buffer   Buffer of data to write
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *                  and fit in what is left of the region
+     *  @return         0 on success, SD_BLOCK_DEVICE_ERROR_PARAMETER if called from
+     *                  another thread than stream_begin(), or another negative error code
+     */
+    int stream_program(const void *buffer, bd_size_t size);
+
+    /** Close the write stream
+     *
+     *  @return         0 on success, SD_BLOCK_DEVICE_ERROR_PARAMETER if called from
+     *                  another thread than stream_begin(), or another negative error code
+     */
+    int stream_end();
+
     /** Mark blocks as no longer in use
      *
      *  This function provides a hint to the underlying block device that a region of blocks
@@ -93,6 +261,18 @@ public:
      */
     virtual int trim(bd_addr_t addr, bd_size_t size);
 
+    /** Defer trims until the card is idle
+     *
+     *  With deferral enabled, trim() queues the range instead of erasing it. Overlapping
+     *  and adjacent ranges are merged, and the queue is issued as a few large erases once
+     *  the card has been idle for idle_ms, or on sync() and deinit(). Reads of a queued
+     *  range see the erased data and programs take precedence over queued trims.
+     *
+     *  @param idle_ms  Idle time in milliseconds before queued trims are issued,
+     *                  0 to issue every trim immediately
+     */
+    virtual void set_trim_deferral(uint32_t idle_ms);
+
     /** Get the size of a readable block
      *
      *  @return         Size of a readable block in bytes
@@ -106,6 +286,84 @@ public:
      */
     virtual bd_size_t get_program_size() const;
 
+    /** Get the size of an erasable block
+     *
+     *  Always 512 bytes. Standard capacity cards without ERASE_BLK_EN erase in
+     *  sectors of up to 64 KiB, but FATFileSystem takes the erase size as its
+     *  sector size and supports 4 KiB at most, so the sector is only reported
+     *  by get_sd_status(). trim() passes the whole sectors of a range to the
+     *  card and skips the rest. The card performs best when erases and
+     *  sequential writes are aligned to the allocation unit, see
+     *  get_allocation_unit_size().
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of erased blocks
+     *
+     *  Read from the SCR register (DATA_STAT_AFTER_ERASE) when the card is initialized.
+     *
+     *  @return         0x00 or 0xFF, or -1 if unknown
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the amount of the card known to be erased
+     *
+     *  Counts the granules of the erased range map that were trimmed or erased since
+     *  init and not programmed since.
+     *
+     *  @return         Size in bytes, 0 if the map is disabled
+     */
+    virtual bd_size_t get_erased_size();
+
+    /** Get the SD Status of the card
+     *
+     *  The SD Status is read when the card is initialized. Fields are zero if the
+     *  card did not provide them.
+     *
+     *  @param status   Structure receiving the decoded SD Status
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int get_sd_status(sd_status_t *status) const;
+
+    /** Get the error recovery counters
+     *
+     *  @param stats    Structure receiving the counters
+     */
+    virtual void get_stats(sd_stats_t *stats);
+
+    /** Clear the error recovery counters
+     */
+    virtual void reset_stats();
+
+    /** Get the sector buffer pool
+     *
+     *  The driver stages the zero block of write_zeroes() and bounce buffers
+     *  for user buffers the transport cannot use directly in buffers from this
+     *  pool, one at a time per card. Layers on top of the driver can take
+     *  DMA-safe sector buffers from it as well; its size, count and alignment
+     *  are set by MBED_CONF_SD_BUFFER_POOL_SIZE, _COUNT and _ALIGN.
+     *
+     *  With MBED_CONF_SD_BUFFER_POOL_COUNT set to 0 there is no pool and no
+     *  static RAM for it: write_zeroes() uses a block on the stack. Without a
+     *  free bounce buffer, a user buffer the transport cannot use directly is
+     *  moved with plain SDTransport::transfer() calls instead of transfer
+     *  chains, so without DMA.
+     *
+     *  @return         Pool shared by all SD block devices, NULL without a pool
+     */
+    static sd_buffer_pool_t *get_buffer_pool();
+
+    /** Get the size of an allocation unit
+     *
+     *  Speed class performance is only guaranteed for writes of whole,
+     *  aligned allocation units.
+     *
+     *  @return         Size of an allocation unit in bytes, 0 if unknown
+     */
+    virtual bd_size_t get_allocation_unit_size() const;
+
     /** Get the total size of the underlying device
      *
      *  @return         Size of the underlying device in bytes
@@ -125,6 +383,17 @@ public:
      */
     virtual int frequency(uint64_t freq);
 
+    /** Release the SPI bus while the card is busy
+     *
+     *  When enabled, a busy wait that lasts longer than MBED_CONF_SD_BUSY_RELEASE_SPIN_US
+     *  deselects the card and unlocks the SPI bus between polls, so other devices on the
+     *  same bus (including other SD cards on their own chip select) can transfer while
+     *  this card is programming or erasing.
+     *
+     *  @param enable  true to release the bus during busy waits, false to hold it
+     */
+    virtual void set_busy_release(bool enable);
+
     /** Get the BlockDevice class type.
      *
      *  @return         A string represent the BlockDevice class type.
@@ -172,6 +441,8 @@ private:
         ACMD51_SEND_SCR = 51,
     };
 
+    void _setup(uint64_t hz);
+
     uint8_t _card_type;
     int _cmd(SDBlockDevice::cmdSupported cmd, uint32_t arg, bool isAcmd = 0, uint32_t *resp = NULL);
     int _cmd8();
@@ -189,50 +460,234 @@ private:
     uint32_t _go_idle_state();
     int _initialise_card();
 
+    /* Card initialisation is split in phases so that cards sharing a bus
+     * can be brought up together by interleaving their ACMD41 polls.
+     */
+    struct init_group_t {
+        SDBlockDevice **sds;
+        size_t count;
+        intptr_t bus;
+        int *errs;
+    };
+
+    int _init_card_begin();
+    int _init_card_poll(uint32_t *response);
+    int _init_card_end(int status, uint32_t response);
+    int _init_data_mode(int err);
+    static void _init_group(init_group_t *group);
+
+    /* Background init */
+    enum {
+        INIT_ASYNC_DONE = (1 << 0),
+    };
+
+    void _init_async_run();
+    int _wait_init_async();
+    void _join_init_async();
+
+    Thread *_init_thread;
+    EventFlags _init_flags;
+    Callback<void(int)> _init_ready;
+    volatile bool _init_pending;
+    bool _init_fail_fast;
+    int _init_result;
+
     bd_size_t _sectors;
     bd_size_t _sd_sectors();
 
+    int _read_sd_status();
+    int _read_scr();
+    int _program(const uint8_t *buffer, bd_addr_t addr, bd_size_t size, bool fill);
+    int _write_blocks(const uint8_t *buffer, bd_addr_t addr, bd_size_t size, bool fill, uint32_t *written);
+    int _num_written_blocks(uint32_t *count);
+    uint32_t _erase_timeout(bd_size_t size);
+    sd_status_t _sd_status;
+    bool _sd_status_valid;
+    uint32_t _erase_timeout_ms;     /**< Busy timeout of the CMD38 in progress */
+    int _erase_value;               /**< Value erased blocks read as, -1 if unknown */
+
     bool _is_valid_trim(bd_addr_t addr, bd_size_t size);
+    int _erase(bd_addr_t addr, bd_size_t size);
+    bd_addr_t _card_addr(bd_addr_t addr) const;
+    int _read_blocks(uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+    int _read_transfer(uint8_t *buffer, bd_addr_t addr, bd_size_t size, uint32_t *received);
+    sd_stats_t _stats;
+
+    /* Bounce buffer for user buffers the transport cannot use directly */
+    void _take_bounce(const void *buffer, bd_size_t size);
+    void _release_bounce();
+    void _transfer_data(const sd_transfer_t *chain, size_t count);
+
+    uint8_t *_bounce;               /**< Pool buffer staging the transfer in progress, NULL for zero-copy */
+    bool _unstaged;                 /**< No bounce buffer was free, data steps go out one transfer() at a time */
+
+    /* Write stream */
+    void _stream_close();
+
+    bool _stream_open;
+    bd_size_t _stream_left;         /**< Bytes left in the region of the open stream */
+    osThreadId _stream_owner;       /**< Thread that opened the stream */
+
+    /* Erased range map, one bit per granule */
+    void _alloc_erased_map();
+    void _free_erased_map();
+    void _mark_erased(bd_addr_t addr, bd_size_t size, bool erased);
+    bool _is_erased(bd_addr_t addr) const;
+    bool _is_erased(bd_addr_t addr, bd_size_t size) const;
+
+    uint32_t *_erased_map;
+    size_t _erased_granules;
+
+    /* Deferred trim */
+    enum {
+        TRIM_QUEUED = (1 << 0),
+        TRIM_STOP = (1 << 1),
+    };
+
+    struct trim_range_t {
+        bd_addr_t addr;
+        bd_size_t size;
+    };
+
+    int _queue_trim(bd_addr_t addr, bd_size_t size);
+    int _unqueue_trim(bd_addr_t addr, bd_size_t size);
+    int _flush_trims(bd_addr_t addr, bd_size_t size);
+    int _start_trim_thread();
+    void _stop_trim_thread();
+    void _trim_run();
+
+    trim_range_t _trims[MBED_CONF_SD_TRIM_QUEUE_SIZE];
+    size_t _trim_count;
+    uint32_t _trim_defer_ms;
+    Timer _idle_timer;              /**< Time since the last read, program or trim */
+    Thread *_trim_thread;
+    EventFlags _trim_flags;
+    volatile bool _trim_stop;
 
     /* SPI functions */
     Timer _spi_timer;               /**< Timer Class object used for busy wait */
     uint32_t _init_sck;             /**< Intial SPI frequency */
     uint32_t _transfer_sck;         /**< SPI frequency during data transfer/after initialization */
-    SPI _spi;                       /**< SPI Class object */
+    SDTransport *_transport;        /**< Bus to the card */
+    SDSPITransport *_spi_transport; /**< Transport created from pins in _spi_storage, NULL for others */
+    union {
+        uint64_t align;
+        char bytes[sizeof(SDSPITransport)];
+    } _spi_storage;
+
+    /* Bus access on the data path. The transport created from pins is called
+     * directly, so its per-byte functions inline here, others go through the
+     * SDTransport interface */
+    void _bus_select()
+    {
+        if (_spi_transport) {
+            _spi_transport->SDSPITransport::select();
+        } else {
+            _transport->select();
+        }
+    }
 
-    /* SPI initialization function */
-    void _spi_init();
-    uint8_t _cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg);
-    void _spi_wait(uint8_t count);
+    void _bus_deselect()
+    {
+        if (_spi_transport) {
+            _spi_transport->SDSPITransport::deselect();
+        } else {
+            _transport->deselect();
+        }
+    }
+
+    uint8_t _bus_transfer(uint8_t data)
+    {
+        if (_spi_transport) {
+            return _spi_transport->SDSPITransport::transfer(data);
+        }
+        return _transport->transfer(data);
+    }
+
+    void _bus_transfer(const uint8_t *tx, uint8_t *rx, size_t length)
+    {
+        if (_spi_transport) {
+            _spi_transport->SDSPITransport::transfer(tx, rx, length);
+        } else {
+            _transport->transfer(tx, rx, length);
+        }
+    }
+
+    void _bus_transfer_chain(const sd_transfer_t *chain, size_t count)
+    {
+        if (_spi_transport) {
+            _spi_transport->SDSPITransport::transfer_chain(chain, count);
+        } else {
+            _transport->transfer_chain(chain, count);
+        }
+    }
+
+    bool _bus_poll(uint8_t value, uint32_t us)
+    {
+        if (_spi_transport) {
+            return _spi_transport->SDSPITransport::poll(value, us);
+        }
+        return _transport->poll(value, us);
+    }
+
+    uint8_t _cmd_spi(SDBlockDevice::cmdSupported cmd, uint32_t arg, uint8_t *tail);
 
     bool _wait_token(uint8_t token);        /**< Wait for token */
-    bool _wait_ready(uint16_t ms = 300);    /**< 300ms default wait for card to be ready */
+    bool _wait_ready(uint32_t ms = 300);    /**< 300ms default wait for card to be ready */
     int _read(uint8_t *buffer, uint32_t length);
     int _read_bytes(uint8_t *buffer, uint32_t length);
-    uint8_t _write(const uint8_t *buffer, uint8_t token, uint32_t length);
+    uint8_t _write(const uint8_t *buffer, uint8_t token, uint32_t length, const uint8_t *stage = NULL);
     int _freq(void);
 
     /* Chip Select and SPI mode select */
-    DigitalOut _cs;
     void _select();
     void _deselect();
+    bool _wait_cmd_ready();
+
+    /* Bus session, holds the card selected from construction to destruction */
+    class BusSession {
+    public:
+        BusSession(SDBlockDevice *sd) : _sd(sd)
+        {
+            _sd->_begin_session();
+        }
+        ~BusSession()
+        {
+            _sd->_end_session();
+        }
+    private:
+        SDBlockDevice *_sd;
+    };
+
+    void _begin_session();
+    void _end_session();
+    uint32_t _session_depth;
+    bool _selected;
+    bool _ready;                    /**< Card known to be ready for the next command */
 
     virtual void lock()
     {
+#if !MBED_CONF_SD_NULL_MUTEX
         _mutex.lock();
+#endif
     }
 
     virtual void unlock()
     {
+#if !MBED_CONF_SD_NULL_MUTEX
         _mutex.unlock();
+#endif
     }
 
+#if !MBED_CONF_SD_NULL_MUTEX
     PlatformMutex _mutex;
+#endif
     bd_size_t _block_size;
     bd_size_t _erase_size;
     bool _is_initialized;
     bool _dbg;
     bool _crc_on;
+    bool _busy_release;
     uint32_t _init_ref_count;
 
     MbedCRC<POLY_7BIT_SD, 7> _crc7;
@@ -0,0 +1,159 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SD_BUFFER_POOL_H
+#define MBED_SD_BUFFER_POOL_H
+
+#include "mbed.h"
+
+#ifndef MBED_CONF_SD_BUFFER_POOL_SIZE
+#define MBED_CONF_SD_BUFFER_POOL_SIZE       512     /*!< Size of a pool buffer in bytes, a multiple of 512 */
+#endif
+
+#ifndef MBED_CONF_SD_BUFFER_POOL_COUNT
+#define MBED_CONF_SD_BUFFER_POOL_COUNT      2       /*!< Number of buffers in the pool, at most 32, 0 for no pool */
+#endif
+
+#ifndef MBED_CONF_SD_BUFFER_POOL_ALIGN
+#define MBED_CONF_SD_BUFFER_POOL_ALIGN      32      /*!< Alignment of the pool buffers, at least the data cache line */
+#endif
+
+/** Occupancy of a buffer pool
+ */
+struct sd_pool_stats_t {
+    uint32_t count;             /*!< Buffers in the pool */
+    uint32_t in_use;            /*!< Buffers allocated now */
+    uint32_t peak;              /*!< Most buffers allocated at once */
+    uint32_t failures;          /*!< Allocations that found the pool empty */
+};
+
+/** Fixed pool of aligned sector buffers
+ *
+ *  The buffers live in the pool object itself, so they come from static
+ *  memory and never fragment the heap. Each buffer starts on an Align byte
+ *  boundary and spans a whole number of cache lines, so DMA and cache
+ *  maintenance on one buffer never touch a neighbour.
+ *
+ *  Allocation and release are lock-free, a single compare-and-swap on a
+ *  bitmap of free buffers, and can be called from interrupt context.
+ *
+ *  @tparam Size    Size of a buffer in bytes, a multiple of 512
+ *  @tparam Count   Number of buffers, 1 to 32
+ *  @tparam Align   Alignment of the buffers in bytes, a power of two
+ */
+template <size_t Size, size_t Count, size_t Align>
+class SDBufferPool {
+public:
+    /** Lifetime of the pool, with all buffers free
+     */
+    SDBufferPool()
+        : _free(Count < 32 ? ((1UL << Count) - 1) : 0xFFFFFFFFUL), _in_use(0), _peak(0), _failures(0)
+    {
+        MBED_STATIC_ASSERT((Count > 0) && (Count <= 32), "Buffer pool holds 1 to 32 buffers");
+        MBED_STATIC_ASSERT((Size % 512) == 0, "Pool buffers must be a multiple of 512 bytes");
+        MBED_STATIC_ASSERT((Align & (Align - 1)) == 0, "Pool alignment must be a power of two");
+        MBED_STATIC_ASSERT((Size % Align) == 0, "Pool buffers must be a multiple of the alignment");
+    }
+
+    /** Take a buffer from the pool
+     *
+     *  @return         Buffer of Size bytes, or NULL if all buffers are in use
+     */
+    void *alloc()
+    {
+        uint32_t map = _free;
+        while (map) {
+            uint32_t bit = map & (~map + 1);
+            if (core_util_atomic_cas_u32(&_free, &map, map & ~bit)) {
+                uint32_t in_use = core_util_atomic_incr_u32(&_in_use, 1);
+                uint32_t peak = _peak;
+                while ((in_use > peak) && !core_util_atomic_cas_u32(&_peak, &peak, in_use)) {
+                }
+                return _storage[_index(bit)];
+            }
+        }
+
+        core_util_atomic_incr_u32(&_failures, 1);
+        return NULL;
+    }
+
+    /** Return a buffer to the pool
+     *
+     *  @param buffer   Buffer from alloc(), or NULL
+     */
+    void free(void *buffer)
+    {
+        if (!buffer) {
+            return;
+        }
+
+        size_t index = ((uint8_t *)buffer - &_storage[0][0]) / Size;
+        MBED_ASSERT((index < Count) && (buffer == _storage[index]));
+
+        uint32_t bit = 1UL << index;
+        uint32_t map = _free;
+        MBED_ASSERT(!(map & bit));
+        while (!core_util_atomic_cas_u32(&_free, &map, map | bit)) {
+        }
+        core_util_atomic_decr_u32(&_in_use, 1);
+    }
+
+    /** Get the occupancy of the pool
+     *
+     *  @param stats    Structure receiving the counters
+     */
+    void get_stats(sd_pool_stats_t *stats) const
+    {
+        stats->count = Count;
+        stats->in_use = _in_use;
+        stats->peak = _peak;
+        stats->failures = _failures;
+    }
+
+    /** Size of each buffer
+     *
+     *  @return         Size of a buffer in bytes
+     */
+    size_t get_buffer_size() const
+    {
+        return Size;
+    }
+
+private:
+    static size_t _index(uint32_t bit)
+    {
+        size_t index = 0;
+        while (!(bit & 1)) {
+            bit >>= 1;
+            index++;
+        }
+        return index;
+    }
+
+    MBED_ALIGN(Align) uint8_t _storage[Count][Size];
+    volatile uint32_t _free;        /**< One bit per free buffer */
+    volatile uint32_t _in_use;
+    volatile uint32_t _peak;
+    volatile uint32_t _failures;
+};
+
+/** Sector buffer pool shared by all SD block devices and the layers on top of them
+ */
+typedef SDBufferPool<MBED_CONF_SD_BUFFER_POOL_SIZE,
+                     MBED_CONF_SD_BUFFER_POOL_COUNT,
+                     MBED_CONF_SD_BUFFER_POOL_ALIGN> sd_buffer_pool_t;
+
+#endif  /* MBED_SD_BUFFER_POOL_H */
@@ -0,0 +1,372 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SDFileExtent.h"
+#include "SDBlockDevice.h"
+#include "File.h"
+#include "mbed_debug.h"
+#include <ctype.h>
+
+#define EXTENT_DBG              0       /*!< 1 - Enable debugging */
+
+#define FAT_SECTOR_SIZE         512
+#define FAT_DIR_ENTRY_SIZE      32
+#define FAT_ATTR_LFN            0x0F
+#define FAT_ATTR_VOLUME_ID      0x08
+#define FAT_ENTRY_DELETED       0xE5
+
+static uint16_t le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// "log.bin" as the 11 byte directory entry name "LOG     BIN"
+static bool short_name(const char *path, uint8_t name[11])
+{
+    memset(name, ' ', 11);
+    if ('/' == *path) {
+        path++;
+    }
+
+    size_t i = 0;
+    size_t limit = 8;
+    for (; *path; path++) {
+        if ('.' == *path) {
+            if (limit != 8) {
+                return false;
+            }
+            i = 8;
+            limit = 11;
+        } else if (('/' == *path) || (i >= limit)) {
+            return false;
+        } else {
+            name[i++] = toupper((unsigned char)*path);
+        }
+    }
+    return (' ' != name[0]);
+}
+
+SDFileExtent::SDFileExtent()
+    : _fs(NULL), _bd(NULL), _sector_addr((bd_addr_t) -1), _fat32(false),
+      _cluster_size(0), _cluster_count(0), _fat_addr(0), _root_addr(0), _root_size(0),
+      _root_cluster(0), _data_addr(0), _start_cluster(0), _entry_addr(0), _addr(0),
+      _capacity(0), _length(0), _is_open(false)
+{
+}
+
+SDFileExtent::~SDFileExtent()
+{
+    close();
+}
+
+int SDFileExtent::open(FileSystem *fs, BlockDevice *bd, const char *path, bd_size_t size)
+{
+    uint8_t name[11];
+    uint8_t zero = 0;
+    File file;
+    int err;
+
+    // The directory entry holds a 32-bit size
+    if (_is_open || !size || (size > 0xFFFFFFFFULL) || !short_name(path, name)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    // Let the file system allocate the clusters and write the directory entry
+    err = file.open(fs, path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (err) {
+        return err;
+    }
+    if ((file.seek(size - 1, SEEK_SET) < 0) || (file.write(&zero, 1) != 1)) {
+        file.close();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    if ((err = file.close()) != 0) {
+        return err;
+    }
+
+    // From here on the volume is ours
+    if ((err = fs->unmount()) != 0) {
+        return err;
+    }
+    _fs = fs;
+    _bd = bd;
+    _sector_addr = (bd_addr_t) -1;
+
+    if ((err = _parse_volume()) != 0) {
+        goto fail;
+    }
+    if ((err = _find_entry(name)) != 0) {
+        goto fail;
+    }
+    _capacity = size;
+    _length = 0;
+    _addr = _data_addr + (bd_addr_t)(_start_cluster - 2) * _cluster_size;
+
+    // Every cluster of the chain must follow the previous one
+    for (uint32_t cluster = _start_cluster, i = 1; i < (size + _cluster_size - 1) / _cluster_size; i++) {
+        uint32_t next;
+        if ((err = _next_cluster(cluster, &next)) != 0) {
+            goto fail;
+        }
+        if (next != cluster + 1) {
+            debug_if(EXTENT_DBG, "%s is not contiguous after cluster %lu\n", path, cluster);
+            err = SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
+            goto fail;
+        }
+        cluster = next;
+    }
+
+    // The file starts out empty, its size follows the checkpoints
+    if ((err = _write_size(0)) != 0) {
+        goto fail;
+    }
+
+    debug_if(EXTENT_DBG, "%s: %llu bytes at 0x%llx\n", path, _capacity, _addr);
+    _is_open = true;
+    return BD_ERROR_OK;
+
+fail:
+    _fs->mount(_bd);
+    _fs = NULL;
+    _bd = NULL;
+    return err;
+}
+
+int SDFileExtent::append(const void *buffer, bd_size_t size)
+{
+    if (!_is_open) {
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+    if ((size % _bd->get_program_size()) || (_length + size > _capacity)) {
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+
+    int err = _bd->program(buffer, _addr + _length, size);
+    if (!err) {
+        _length += size;
+    }
+    return err;
+}
+
+int SDFileExtent::checkpoint()
+{
+    if (!_is_open) {
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    }
+
+    // The data must be on the card before the size covers it
+    int err = _bd->sync();
+    if (!err) {
+        err = _write_size(_length);
+    }
+    return err;
+}
+
+int SDFileExtent::close()
+{
+    if (!_is_open) {
+        return BD_ERROR_OK;
+    }
+
+    int err = checkpoint();
+    _is_open = false;
+
+    int mount_err = _fs->mount(_bd);
+    _fs = NULL;
+    _bd = NULL;
+    return err ? err : mount_err;
+}
+
+bd_size_t SDFileExtent::get_length() const
+{
+    return _length;
+}
+
+bd_size_t SDFileExtent::get_capacity() const
+{
+    return _capacity;
+}
+
+bd_addr_t SDFileExtent::get_addr() const
+{
+    return _addr;
+}
+
+int SDFileExtent::_read_sector(bd_addr_t addr)
+{
+    if (addr == _sector_addr) {
+        return BD_ERROR_OK;
+    }
+
+    int err = _bd->read(_sector, addr, FAT_SECTOR_SIZE);
+    _sector_addr = err ? (bd_addr_t) -1 : addr;
+    return err;
+}
+
+/* Volume layout
+ * -------------
+ * The boot sector is either the first sector of the device or, behind a
+ * partition table, the first sector of partition 1. Its BPB gives:
+ *
+ *   [11] bytes per sector   [16] number of FATs      [22] FAT size (FAT16)
+ *   [13] sectors/cluster    [17] root entries        [32] total sectors (32-bit)
+ *   [14] reserved sectors   [19] total sectors       [36] FAT size (FAT32)
+ *                                                    [44] root cluster (FAT32)
+ *
+ * The FATs follow the reserved sectors, then the FAT16 root directory, then
+ * the data area starting with cluster 2. The cluster count decides the FAT type.
+ */
+int SDFileExtent::_parse_volume()
+{
+    bd_addr_t volume = 0;
+    int err;
+
+    if ((err = _read_sector(0)) != 0) {
+        return err;
+    }
+    if ((_sector[0] != 0xEB) && (_sector[0] != 0xE9)) {
+        volume = (bd_addr_t)le32(&_sector[446 + 8]) * FAT_SECTOR_SIZE;
+        if ((err = _read_sector(volume)) != 0) {
+            return err;
+        }
+    }
+    if ((_sector[510] != 0x55) || (_sector[511] != 0xAA) || (le16(&_sector[11]) != FAT_SECTOR_SIZE)) {
+        return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
+    }
+
+    uint32_t sectors_per_cluster = _sector[13];
+    uint32_t reserved = le16(&_sector[14]);
+    uint32_t fats = _sector[16];
+    uint32_t root_entries = le16(&_sector[17]);
+    uint32_t total = le16(&_sector[19]) ? le16(&_sector[19]) : le32(&_sector[32]);
+    uint32_t fat_size = le16(&_sector[22]) ? le16(&_sector[22]) : le32(&_sector[36]);
+    uint32_t root_sectors = (root_entries * FAT_DIR_ENTRY_SIZE + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+    uint32_t data = reserved + fats * fat_size + root_sectors;
+
+    if (!sectors_per_cluster || (total <= data)) {
+        return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
+    }
+    _cluster_size = sectors_per_cluster * FAT_SECTOR_SIZE;
+    _cluster_count = (total - data) / sectors_per_cluster;
+    if (_cluster_count < 4085) {
+        // FAT12 is not worth supporting on an SD card
+        return SD_BLOCK_DEVICE_ERROR_UNSUPPORTED;
+    }
+    _fat32 = (_cluster_count >= 65525);
+    _root_cluster = _fat32 ? le32(&_sector[44]) : 0;
+
+    _fat_addr = volume + (bd_addr_t)reserved * FAT_SECTOR_SIZE;
+    _root_addr = volume + (bd_addr_t)(reserved + fats * fat_size) * FAT_SECTOR_SIZE;
+    _root_size = (bd_size_t)root_sectors * FAT_SECTOR_SIZE;
+    _data_addr = volume + (bd_addr_t)data * FAT_SECTOR_SIZE;
+
+    debug_if(EXTENT_DBG, "FAT%d: %lu clusters of %lu bytes\n", _fat32 ? 32 : 16, _cluster_count, _cluster_size);
+    return BD_ERROR_OK;
+}
+
+int SDFileExtent::_find_entry(const uint8_t name[11])
+{
+    bool found = false;
+    int err;
+
+    if (!_fat32) {
+        err = _find_in(_root_addr, _root_size, name, &found);
+        return err ? err : (found ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR);
+    }
+
+    // The FAT32 root directory is a cluster chain
+    uint32_t cluster = _root_cluster;
+    while (!found && (cluster >= 2) && (cluster < _cluster_count + 2)) {
+        bd_addr_t addr = _data_addr + (bd_addr_t)(cluster - 2) * _cluster_size;
+        if ((err = _find_in(addr, _cluster_size, name, &found)) != 0) {
+            return err;
+        }
+        if (!found && ((err = _next_cluster(cluster, &cluster)) != 0)) {
+            return err;
+        }
+    }
+    return found ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+}
+
+int SDFileExtent::_find_in(bd_addr_t addr, bd_size_t size, const uint8_t name[11], bool *found)
+{
+    for (bd_addr_t sector = addr; sector < addr + size; sector += FAT_SECTOR_SIZE) {
+        int err = _read_sector(sector);
+        if (err) {
+            return err;
+        }
+
+        for (size_t offset = 0; offset < FAT_SECTOR_SIZE; offset += FAT_DIR_ENTRY_SIZE) {
+            const uint8_t *entry = &_sector[offset];
+            if (0 == entry[0]) {
+                // End of the directory
+                return BD_ERROR_OK;
+            }
+            if ((FAT_ENTRY_DELETED == entry[0]) || (FAT_ATTR_LFN == entry[11]) ||
+                    (entry[11] & FAT_ATTR_VOLUME_ID) || memcmp(entry, name, 11)) {
+                continue;
+            }
+
+            _start_cluster = le16(&entry[26]) | (_fat32 ? ((uint32_t)le16(&entry[20]) << 16) : 0);
+            _entry_addr = sector + offset;
+            *found = (_start_cluster >= 2);
+            return BD_ERROR_OK;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+int SDFileExtent::_next_cluster(uint32_t cluster, uint32_t *next)
+{
+    bd_addr_t offset = (bd_addr_t)cluster * (_fat32 ? 4 : 2);
+    int err = _read_sector(_fat_addr + offset - (offset % FAT_SECTOR_SIZE));
+    if (err) {
+        return err;
+    }
+
+    const uint8_t *entry = &_sector[offset % FAT_SECTOR_SIZE];
+    *next = _fat32 ? (le32(entry) & 0x0FFFFFFF) : le16(entry);
+    return BD_ERROR_OK;
+}
+
+int SDFileExtent::_write_size(uint32_t size)
+{
+    bd_addr_t sector = _entry_addr - (_entry_addr % FAT_SECTOR_SIZE);
+    int err = _read_sector(sector);
+    if (err) {
+        return err;
+    }
+
+    uint8_t *field = &_sector[(_entry_addr % FAT_SECTOR_SIZE) + 28];
+    field[0] = size;
+    field[1] = size >> 8;
+    field[2] = size >> 16;
+    field[3] = size >> 24;
+
+    err = _bd->program(_sector, sector, FAT_SECTOR_SIZE);
+    if (!err) {
+        err = _bd->sync();
+    }
+    if (err) {
+        _sector_addr = (bd_addr_t) -1;
+    }
+    return err;
+}
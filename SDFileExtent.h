@@ -0,0 +1,153 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SD_FILE_EXTENT_H
+#define MBED_SD_FILE_EXTENT_H
+
+#include "BlockDevice.h"
+#include "FileSystem.h"
+#include "mbed.h"
+
+/** Preallocated contiguous file on a FAT volume, appended to without the file system
+ *
+ *  open() creates the file through the file system at its full size, then
+ *  unmounts the volume and looks up the file's clusters in the FAT. If they
+ *  are contiguous, the file is one extent of the block device: append()
+ *  programs the data straight to it, in transfers as large as the caller
+ *  likes, with no cluster chain walks and no FAT or directory updates.
+ *
+ *  The file size in the directory entry only moves at checkpoint() and
+ *  close(); after a power loss the file ends at the last checkpoint. Until
+ *  then it reads as shorter than its cluster chain, which disk checkers may
+ *  report. close() mounts the volume again.
+ *
+ *  The volume is unmounted while the extent is open, so no other file on it
+ *  may be in use. The file must be in the root directory and have an 8.3 name;
+ *  FAT16 and FAT32 volumes with 512 byte sectors are supported, with or
+ *  without a partition table.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "FATFileSystem.h"
+ * #include "SDFileExtent.h"
+ *
+ * SDBlockDevice sd(p5, p6, p7, p8);
+ * FATFileSystem fs("sd", &sd);
+ * SDFileExtent extent;
+ *
+ * int main() {
+ *     extent.open(&fs, &sd, "LOG.BIN", 64 * 1024 * 1024);
+ *     for (...) {
+ *         extent.append(samples, sizeof(samples));
+ *         if (every_second) {
+ *             extent.checkpoint();
+ *         }
+ *     }
+ *     extent.close();
+ * }
+ * @endcode
+ */
+class SDFileExtent {
+public:
+    /** Lifetime of an extent, closed
+     */
+    SDFileExtent();
+    virtual ~SDFileExtent();
+
+    /** Create a contiguous file and take over the volume
+     *
+     *  Any existing file with the same name is truncated first. Fails with
+     *  SD_BLOCK_DEVICE_ERROR_UNSUPPORTED if the file system could not place
+     *  the file contiguously, in which case the volume is mounted again.
+     *
+     *  @param fs       File system mounted on bd
+     *  @param bd       Block device holding the FAT volume
+     *  @param path     8.3 name of a file in the root directory
+     *  @param size     Capacity of the file in bytes, less than 4 GiB as FAT file sizes are 32-bit
+     *  @return         0 on success or a negative error code on failure
+     */
+    int open(FileSystem *fs, BlockDevice *bd, const char *path, bd_size_t size);
+
+    /** Append data to the file
+     *
+     *  @param buffer   Data to append
+     *  @param size     Size in bytes, a multiple of the program size of the block device
+     *  @return         0 on success or a negative error code on failure
+     */
+    int append(const void *buffer, bd_size_t size);
+
+    /** Commit the data appended so far to the file size
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int checkpoint();
+
+    /** Commit the file size and mount the volume again
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int close();
+
+    /** Get the data appended so far
+     *
+     *  @return         Length of the file in bytes
+     */
+    bd_size_t get_length() const;
+
+    /** Get the preallocated size
+     *
+     *  @return         Capacity of the file in bytes
+     */
+    bd_size_t get_capacity() const;
+
+    /** Get the location of the file on the block device
+     *
+     *  @return         Address of the first byte of the file
+     */
+    bd_addr_t get_addr() const;
+
+private:
+    int _read_sector(bd_addr_t addr);
+    int _parse_volume();
+    int _find_entry(const uint8_t name[11]);
+    int _find_in(bd_addr_t addr, bd_size_t size, const uint8_t name[11], bool *found);
+    int _next_cluster(uint32_t cluster, uint32_t *next);
+    int _write_size(uint32_t size);
+
+    FileSystem *_fs;
+    BlockDevice *_bd;
+    uint8_t _sector[512];
+    bd_addr_t _sector_addr;         /**< Address of the sector in _sector, or -1 */
+
+    bool _fat32;
+    uint32_t _cluster_size;         /**< Bytes per cluster */
+    uint32_t _cluster_count;
+    bd_addr_t _fat_addr;            /**< First FAT */
+    bd_addr_t _root_addr;           /**< FAT16 root directory */
+    bd_size_t _root_size;
+    uint32_t _root_cluster;         /**< FAT32 root directory */
+    bd_addr_t _data_addr;           /**< Cluster 2 */
+
+    uint32_t _start_cluster;
+    bd_addr_t _entry_addr;          /**< Directory entry of the file */
+    bd_addr_t _addr;
+    bd_size_t _capacity;
+    bd_size_t _length;
+    bool _is_open;
+};
+
+#endif  /* MBED_SD_FILE_EXTENT_H */
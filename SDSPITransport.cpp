@@ -0,0 +1,221 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* If the target has no SPI support then SDCard is not supported */
+#ifdef DEVICE_SPI
+
+#include "SDSPITransport.h"
+#include <algorithm>
+
+#define SPI_FILL_CHAR       (0xFF)
+
+SDSPITransport::SDSPITransport(PinName mosi, PinName miso, PinName sclk, PinName cs)
+    : _spi(mosi, miso, sclk), _cs(cs), _sclk(sclk)
+{
+    MBED_STATIC_ASSERT((MBED_CONF_SD_SPI_FRAME_BITS == 8) || (MBED_CONF_SD_SPI_FRAME_BITS == 16),
+                       "SPI frame size must be 8 or 16 bits");
+    _cs = 1;
+#if SD_SPI_WIDE
+    _wide = true;
+#endif
+#if DEVICE_SPI_ASYNCH
+    if (MBED_CONF_SD_SPI_DMA_THRESHOLD) {
+        _spi.set_dma_usage(DMA_USAGE_ALWAYS);
+    }
+#endif
+}
+
+SDSPITransport::~SDSPITransport()
+{
+}
+
+void SDSPITransport::init(uint32_t hz)
+{
+    _spi.lock();
+    // Set to SCK for initialization, and clock card with cs = 1
+    _spi.frequency(hz);
+    _spi.format(8, 0);
+    _spi.set_default_write_value(SPI_FILL_CHAR);
+    // Initial 74 cycles required for few cards, before selecting SPI mode
+    _cs = 1;
+    for (int i = 0; i < 10; i++) {
+        _spi.write(SPI_FILL_CHAR);
+    }
+    _spi.unlock();
+}
+
+void SDSPITransport::frequency(uint32_t hz)
+{
+    _spi.frequency(hz);
+}
+
+void SDSPITransport::transfer(const uint8_t *tx, uint8_t *rx, size_t length)
+{
+    _spi.write((const char *)tx, tx ? length : 0, (char *)rx, rx ? length : 0);
+}
+
+void SDSPITransport::transfer_chain(const sd_transfer_t *chain, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *tx = chain[i].tx;
+        uint8_t *rx = chain[i].rx;
+        size_t length = chain[i].length;
+
+#if SD_SPI_WIDE
+        // Payloads one way in 16-bit frames, what a refusing target left over in 8-bit frames
+        if (_wide && (length >= SD_SPI_WIDE_MIN_LENGTH) && !(length % 2) && !(tx && rx)) {
+            size_t done = _wide_transfer(tx, rx, length);
+            if (done == length) {
+                continue;
+            }
+            tx = tx ? (tx + done) : NULL;
+            rx = rx ? (rx + done) : NULL;
+            length -= done;
+        }
+#endif
+#if DEVICE_SPI_ASYNCH && MBED_CONF_SD_SPI_DMA_THRESHOLD
+        if (length >= MBED_CONF_SD_SPI_DMA_THRESHOLD) {
+            if (0 == _spi.transfer(tx, tx ? length : 0, rx, rx ? length : 0,
+                                   callback(this, &SDSPITransport::_dma_event), SPI_EVENT_ALL)) {
+                _dma_done.wait();
+                continue;
+            }
+        }
+#endif
+        _spi.write((const char *)tx, tx ? length : 0, (char *)rx, rx ? length : 0);
+    }
+}
+
+#if SD_SPI_WIDE
+size_t SDSPITransport::_wide_transfer(const uint8_t *tx, uint8_t *rx, size_t length)
+{
+    size_t done = 0;
+
+    _spi.format(16, 0);
+    while (done < length) {
+        size_t size = std::min(length - done, sizeof(_frames));
+
+        // The first byte goes out in the high half of the frame
+        for (size_t i = 0; i < size / 2; i++) {
+            _frames[i] = tx ? (uint16_t)((tx[done + 2 * i] << 8) | tx[done + 2 * i + 1]) : 0xFFFF;
+        }
+        if (0 != _spi.transfer(_frames, (int)size, rx ? _frames : (uint16_t *)NULL, rx ? (int)size : 0,
+                               callback(this, &SDSPITransport::_dma_event), SPI_EVENT_ALL)) {
+            _wide = false;
+            break;
+        }
+        _dma_done.wait();
+
+        for (size_t i = 0; rx && (i < size / 2); i++) {
+            rx[done + 2 * i] = _frames[i] >> 8;
+            rx[done + 2 * i + 1] = (uint8_t)_frames[i];
+        }
+        done += size;
+    }
+    _spi.format(8, 0);
+    return done;
+}
+#endif
+
+void SDSPITransport::fill_read(uint8_t *rx, size_t length)
+{
+    _spi.write(NULL, 0, (char *)rx, length);
+}
+
+bool SDSPITransport::poll(uint8_t value, uint32_t us)
+{
+    _timer.reset();
+    _timer.start();
+    do {
+        if (value == _spi.write(SPI_FILL_CHAR)) {
+            _timer.stop();
+            return true;
+        }
+    } while ((uint32_t)_timer.read_us() < us);
+    _timer.stop();
+    return false;
+}
+
+int SDSPITransport::transfer_async(const uint8_t *tx, uint8_t *rx, size_t length, Callback<void(int)> done)
+{
+#if DEVICE_SPI_ASYNCH
+    _async_done = done;
+    return _spi.transfer(tx, tx ? length : 0, rx, rx ? length : 0,
+                         callback(this, &SDSPITransport::_async_event), SPI_EVENT_ALL);
+#else
+    return SDTransport::transfer_async(tx, rx, length, done);
+#endif
+}
+
+#if DEVICE_SPI_ASYNCH
+void SDSPITransport::_dma_event(int event)
+{
+    (void)event;
+    _dma_done.release();
+}
+
+void SDSPITransport::_async_event(int event)
+{
+    if (_async_done) {
+        _async_done((event & SPI_EVENT_COMPLETE) ? 0 : -1);
+    }
+}
+#endif
+
+bool SDSPITransport::is_dma_safe(const void *buffer, size_t length) const
+{
+    if (!MBED_CONF_SD_SPI_DMA_THRESHOLD) {
+        return true;
+    }
+
+    uintptr_t start = (uintptr_t)buffer;
+    if ((start % MBED_CONF_SD_BUFFER_POOL_ALIGN) || (length % MBED_CONF_SD_BUFFER_POOL_ALIGN)) {
+        return false;
+    }
+#if defined(CCMDATARAM_BASE) && defined(CCMDATARAM_END)
+    if ((start <= CCMDATARAM_END) && (start + length > CCMDATARAM_BASE)) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+intptr_t SDSPITransport::get_bus_id() const
+{
+    return (intptr_t)_sclk;
+}
+
+bool SDSPITransport::set_frame_bits(uint8_t bits)
+{
+#if SD_SPI_WIDE
+    if ((8 == bits) || (16 == bits)) {
+        _wide = (16 == bits);
+        return true;
+    }
+#endif
+    return (8 == bits);
+}
+
+uint8_t SDSPITransport::get_frame_bits() const
+{
+#if SD_SPI_WIDE
+    return _wide ? 16 : 8;
+#else
+    return 8;
+#endif
+}
+
+#endif  /* DEVICE_SPI */
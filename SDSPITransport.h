@@ -0,0 +1,153 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SD_SPI_TRANSPORT_H
+#define MBED_SD_SPI_TRANSPORT_H
+
+/* If the target has no SPI support then SDCard is not supported */
+#ifdef DEVICE_SPI
+
+#include "SDTransport.h"
+#include "SDBufferPool.h"
+
+#ifndef MBED_CONF_SD_SPI_DMA_THRESHOLD
+#define MBED_CONF_SD_SPI_DMA_THRESHOLD      0       /*!< Chain steps of at least this many bytes use DMA, 0 for no DMA */
+#endif
+
+#ifndef MBED_CONF_SD_SPI_FRAME_BITS
+#define MBED_CONF_SD_SPI_FRAME_BITS         8       /*!< SPI frame size for block payloads, 8 or 16 bits */
+#endif
+
+#define SD_SPI_WIDE             (DEVICE_SPI_ASYNCH && (MBED_CONF_SD_SPI_FRAME_BITS == 16))
+#define SD_SPI_WIDE_MIN_LENGTH  64      /*!< Shorter chain steps are not worth a format switch */
+#define SD_SPI_WIDE_FRAMES      256     /*!< 16-bit frames staged at a time, one block */
+
+/** SD transport over an mbed SPI bus and a chip select pin
+ *
+ *  This is the transport SDBlockDevice creates when it is given pins. It is
+ *  then held inside the block device and called directly rather than through
+ *  SDTransport. The bus is locked while the card is selected, so other
+ *  devices can share it.
+ *
+ *  On targets with asynchronous SPI, chain steps of MBED_CONF_SD_SPI_DMA_THRESHOLD
+ *  bytes or more (the block payloads) are moved by DMA while the calling thread
+ *  sleeps.
+ *
+ *  With MBED_CONF_SD_SPI_FRAME_BITS set to 16 on those targets, the block
+ *  payloads are exchanged in 16-bit frames by an asynchronous transfer, which
+ *  halves the frames the SPI peripheral has to service. The bus sends the high
+ *  byte of a frame first, so the bytes are swapped through a 512-byte staging
+ *  buffer. If the target refuses the transfer, the transport goes back to
+ *  8-bit frames. Commands and short transfers always use 8-bit frames.
+ */
+class SDSPITransport : public SDTransport {
+public:
+    /** Lifetime of the transport
+     *
+     *  @param mosi     SPI master out, slave in pin
+     *  @param miso     SPI master in, slave out pin
+     *  @param sclk     SPI clock pin
+     *  @param cs       Chip select pin
+     */
+    SDSPITransport(PinName mosi, PinName miso, PinName sclk, PinName cs);
+    virtual ~SDSPITransport();
+
+    virtual void init(uint32_t hz);
+    virtual void frequency(uint32_t hz);
+    virtual void select();
+    virtual void deselect();
+    virtual uint8_t transfer(uint8_t data);
+    virtual void transfer(const uint8_t *tx, uint8_t *rx, size_t length);
+    virtual void transfer_chain(const sd_transfer_t *chain, size_t count);
+    virtual void fill_read(uint8_t *rx, size_t length);
+    virtual bool poll(uint8_t value, uint32_t us);
+    virtual int transfer_async(const uint8_t *tx, uint8_t *rx, size_t length, Callback<void(int)> done);
+
+    /** Check a buffer against the DMA constraints
+     *
+     *  With DMA enabled, buffers must be aligned to MBED_CONF_SD_BUFFER_POOL_ALIGN
+     *  and, on targets with core coupled memory, lie outside it.
+     *
+     *  @param buffer   Start of the user buffer
+     *  @param length   Length of the user buffer in bytes
+     *  @return         true if the buffer can be transferred as is
+     */
+    virtual bool is_dma_safe(const void *buffer, size_t length) const;
+
+    /** Identify the bus by its clock pin
+     *
+     *  @return         SPI clock pin
+     */
+    virtual intptr_t get_bus_id() const;
+
+    /** Set the SPI frame size of block payloads
+     *
+     *  Only call it while the card is idle.
+     *
+     *  @param bits     8, or 16 when built with MBED_CONF_SD_SPI_FRAME_BITS set to 16
+     *  @return         true if the frame size is supported
+     */
+    bool set_frame_bits(uint8_t bits);
+
+    /** Get the SPI frame size of block payloads
+     *
+     *  @return         8 or 16, 8 after the target refused a 16-bit transfer
+     */
+    uint8_t get_frame_bits() const;
+
+private:
+#if DEVICE_SPI_ASYNCH
+    void _async_event(int event);
+    void _dma_event(int event);
+    Callback<void(int)> _async_done;
+    Semaphore _dma_done;
+#endif
+#if SD_SPI_WIDE
+    size_t _wide_transfer(const uint8_t *tx, uint8_t *rx, size_t length);
+    MBED_ALIGN(MBED_CONF_SD_BUFFER_POOL_ALIGN) uint16_t _frames[SD_SPI_WIDE_FRAMES];
+    bool _wide;
+#endif
+
+    SPI _spi;
+    DigitalOut _cs;
+    PinName _sclk;
+    Timer _timer;
+};
+
+/* The per-byte functions are defined here so that SDBlockDevice, which calls
+ * the transport it creates from pins directly, inlines them */
+inline void SDSPITransport::select()
+{
+    _spi.lock();
+    _spi.write(0xFF);
+    _cs = 0;
+}
+
+inline void SDSPITransport::deselect()
+{
+    _cs = 1;
+    _spi.write(0xFF);
+    _spi.unlock();
+}
+
+inline uint8_t SDSPITransport::transfer(uint8_t data)
+{
+    return _spi.write(data);
+}
+
+#endif  /* DEVICE_SPI */
+
+#endif  /* MBED_SD_SPI_TRANSPORT_H */
@@ -0,0 +1,251 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SDStreamWriter.h"
+#include "mbed_debug.h"
+
+#define STREAM_DBG              0       /*!< 1 - Enable debugging */
+
+SDStreamWriter::SDStreamWriter(SDBlockDevice *sd, bd_addr_t addr, bd_size_t size, uint32_t rate,
+                               uint32_t headroom_ms)
+    : _bd(sd), _sd(sd)
+{
+    _setup(addr, size, rate, headroom_ms);
+}
+
+SDStreamWriter::SDStreamWriter(BlockDevice *bd, bd_addr_t addr, bd_size_t size, uint32_t rate,
+                               uint32_t headroom_ms)
+    : _bd(bd), _sd(NULL)
+{
+    _setup(addr, size, rate, headroom_ms);
+}
+
+void SDStreamWriter::_setup(bd_addr_t addr, bd_size_t size, uint32_t rate, uint32_t headroom_ms)
+{
+    MBED_STATIC_ASSERT(((MBED_CONF_SD_STREAM_CHUNK_SIZE % 512) == 0) &&
+                       ((MBED_CONF_SD_STREAM_CHUNK_SIZE & (MBED_CONF_SD_STREAM_CHUNK_SIZE - 1)) == 0),
+                       "Stream chunk size should be a power of two multiple of 512");
+
+    _addr = addr;
+    _size = size - (size % MBED_CONF_SD_STREAM_CHUNK_SIZE);
+    _written = 0;
+    _chunk_size = MBED_CONF_SD_STREAM_CHUNK_SIZE;
+
+    // Two chunks to write one while the other fills, plus the stall headroom
+    uint64_t needed = (uint64_t)rate * headroom_ms / 1000 + 2 * _chunk_size;
+    _ring_size = _chunk_size;
+    while (_ring_size < needed) {
+        _ring_size <<= 1;
+    }
+
+    _ring = NULL;
+    _head = 0;
+    _tail = 0;
+    _full = false;
+    _records_dropped = 0;
+    _bytes_dropped = 0;
+    _max_fill = 0;
+    _max_write_ms = 0;
+    _error = BD_ERROR_OK;
+    _thread = NULL;
+    _stop = false;
+    _streaming = false;
+}
+
+SDStreamWriter::~SDStreamWriter()
+{
+    stop();
+}
+
+int SDStreamWriter::start()
+{
+    if (_thread) {
+        return BD_ERROR_OK;
+    }
+
+    _ring = new uint8_t[_ring_size];
+    _head = 0;
+    _tail = 0;
+    _written = 0;
+    _full = false;
+    _records_dropped = 0;
+    _bytes_dropped = 0;
+    _max_fill = 0;
+    _max_write_ms = 0;
+    _error = BD_ERROR_OK;
+    _stop = false;
+
+    _thread = new Thread(osPriorityNormal, MBED_CONF_SD_STREAM_STACK_SIZE);
+    if (_thread->start(callback(this, &SDStreamWriter::_run)) != osOK) {
+        delete _thread;
+        _thread = NULL;
+        delete[] _ring;
+        _ring = NULL;
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    debug_if(STREAM_DBG, "Stream of %llu bytes, ring of %lu bytes\n", _size, _ring_size);
+    return BD_ERROR_OK;
+}
+
+int SDStreamWriter::stop()
+{
+    if (!_thread) {
+        return _error;
+    }
+
+    _stop = true;
+    _flags.set(STREAM_STOP);
+    _thread->join();
+    delete _thread;
+    _thread = NULL;
+    delete[] _ring;
+    _ring = NULL;
+    return _error;
+}
+
+bool SDStreamWriter::write(const void *data, size_t size)
+{
+    uint32_t head = _head;
+    uint32_t fill = head - _tail;
+
+    if (!_ring || _full || (size > _ring_size - fill)) {
+        _records_dropped++;
+        _bytes_dropped += size;
+        return false;
+    }
+
+    uint32_t index = head & (_ring_size - 1);
+    size_t first = (size < _ring_size - index) ? size : (_ring_size - index);
+    memcpy(&_ring[index], data, first);
+    memcpy(&_ring[0], (const uint8_t *)data + first, size - first);
+
+    // The data must be in the ring before the writer can see it
+    __DMB();
+    _head = head + size;
+
+    fill += size;
+    if (fill > _max_fill) {
+        _max_fill = fill;
+    }
+
+    // Wake the writer whenever a chunk is completed
+    if ((head / _chunk_size) != ((head + size) / _chunk_size)) {
+        _flags.set(STREAM_WAKE);
+    }
+    return true;
+}
+
+void SDStreamWriter::get_stats(sd_stream_stats_t *stats) const
+{
+    stats->bytes_written = _written;
+    stats->records_dropped = _records_dropped;
+    stats->bytes_dropped = _bytes_dropped;
+    stats->max_fill = _max_fill;
+    stats->ring_size = _ring_size;
+    stats->max_write_ms = _max_write_ms;
+}
+
+bd_size_t SDStreamWriter::get_written() const
+{
+    return _written;
+}
+
+void SDStreamWriter::_run()
+{
+    if (_sd) {
+        _error = _sd->stream_begin(_addr, _size);
+        _streaming = (BD_ERROR_OK == _error);
+        _full = !_streaming;
+    }
+
+    while (true) {
+        _flags.wait_any(STREAM_WAKE | STREAM_STOP);
+
+        // Whole chunks never wrap, the ring is a multiple of the chunk size
+        while (!_full && ((_head - _tail) >= _chunk_size)) {
+            int err = _write_chunk(&_ring[_tail & (_ring_size - 1)], _chunk_size);
+            _tail += _chunk_size;
+            if (err) {
+                _error = err;
+                _full = true;
+            }
+        }
+
+        if (_stop) {
+            break;
+        }
+    }
+
+    // Producers are done, pad what is left to the program size
+    uint32_t fill = _head - _tail;
+    if (!_full && fill) {
+        bd_size_t program = _bd->get_program_size();
+        bd_size_t padded = ((fill + program - 1) / program) * program;
+        uint8_t *chunk = &_ring[_tail & (_ring_size - 1)];
+        memset(chunk + fill, 0, padded - fill);
+
+        int err = _write_chunk(chunk, padded);
+        _tail += fill;
+        if (err) {
+            _error = err;
+        }
+    }
+
+    if (_streaming) {
+        int err = _sd->stream_end();
+        _streaming = false;
+        if (!_error) {
+            _error = err;
+        }
+    }
+}
+
+int SDStreamWriter::_write_chunk(const uint8_t *chunk, bd_size_t size)
+{
+    Timer timer;
+    int err;
+
+    if (_written + size > _size) {
+        _full = true;
+        return BD_ERROR_OK;
+    }
+
+    timer.start();
+    if (_sd) {
+        err = _sd->stream_program(chunk, size);
+        _streaming = _streaming && !err;        // A failed stream_program() ends the stream
+    } else {
+        err = _bd->program(chunk, _addr + _written, size);
+    }
+    timer.stop();
+
+    if ((uint32_t)timer.read_ms() > _max_write_ms) {
+        _max_write_ms = timer.read_ms();
+    }
+    if (!err) {
+        _written += size;
+        if (_written >= _size) {
+            // Region used up, the stream is closed right away rather than at stop()
+            if (_streaming) {
+                err = _sd->stream_end();
+                _streaming = false;
+            }
+            _full = true;
+        }
+    }
+    debug_if(STREAM_DBG && err, "Stream write at %llu failed: %d\n", _written, err);
+    return err;
+}
@@ -0,0 +1,184 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SD_STREAM_WRITER_H
+#define MBED_SD_STREAM_WRITER_H
+
+#include "BlockDevice.h"
+#include "SDBlockDevice.h"
+#include "mbed.h"
+#include "rtos.h"
+
+#ifndef MBED_CONF_SD_STREAM_CHUNK_SIZE
+#define MBED_CONF_SD_STREAM_CHUNK_SIZE      4096    /*!< Bytes written to the card at a time, a power of two multiple of 512 */
+#endif
+
+#ifndef MBED_CONF_SD_STREAM_HEADROOM_MS
+#define MBED_CONF_SD_STREAM_HEADROOM_MS     500     /*!< Longest card stall the ring buffer absorbs without dropping data */
+#endif
+
+#ifndef MBED_CONF_SD_STREAM_STACK_SIZE
+#define MBED_CONF_SD_STREAM_STACK_SIZE      1024    /*!< Stack size of the writer thread */
+#endif
+
+/** Counters of a stream writer, since it was started
+ */
+struct sd_stream_stats_t {
+    uint64_t bytes_written;     /*!< Bytes handed to the block device */
+    uint32_t records_dropped;   /*!< Records refused because the ring was full or the region used up */
+    uint32_t bytes_dropped;     /*!< Bytes of the dropped records */
+    uint32_t max_fill;          /*!< Most bytes waiting in the ring at once */
+    uint32_t ring_size;         /*!< Size of the ring in bytes */
+    uint32_t max_write_ms;      /*!< Longest single chunk write, card stalls included */
+};
+
+/** Streaming data logger
+ *
+ *  Records written from interrupt handlers are appended to a lock-free
+ *  single producer, single consumer ring. A writer thread drains the ring a
+ *  chunk at a time, straight from ring memory, to a region of the block
+ *  device: on an SDBlockDevice as one long multiple block write (CMD25),
+ *  on other block devices as sequential programs. While one chunk is
+ *  written, the producer fills the next.
+ *
+ *  The ring holds headroom_ms worth of data at the given rate on top of two
+ *  chunks, so a card pausing for garbage collection up to that long loses
+ *  nothing. Records that do not fit are dropped whole and counted.
+ *
+ *  Only one context may call write(): one interrupt handler, or one thread.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "SDStreamWriter.h"
+ *
+ * SDBlockDevice sd(p5, p6, p7, p8);
+ * SDStreamWriter logger(&sd, 0, 64 * 1024 * 1024, 32 * 1024);
+ * Ticker ticker;
+ *
+ * void sample() {
+ *     uint16_t value = read_sensor();
+ *     logger.write(&value, sizeof(value));
+ * }
+ *
+ * int main() {
+ *     sd.init();
+ *     logger.start();
+ *     ticker.attach_us(sample, 100);
+ *     ...
+ *     ticker.detach();
+ *     logger.stop();
+ *     sd.deinit();
+ * }
+ * @endcode
+ */
+class SDStreamWriter {
+public:
+    /** Lifetime of a stream writer on an SD card, using a single write stream
+     *
+     *  @param sd           Initialized SD block device
+     *  @param addr         Start of the log region, a multiple of the program size
+     *  @param size         Size of the log region, a multiple of the chunk size
+     *  @param rate         Expected data rate in bytes per second
+     *  @param headroom_ms  Card stall to absorb without dropping data
+     */
+    SDStreamWriter(SDBlockDevice *sd, bd_addr_t addr, bd_size_t size, uint32_t rate,
+                   uint32_t headroom_ms = MBED_CONF_SD_STREAM_HEADROOM_MS);
+
+    /** Lifetime of a stream writer on any block device, using sequential programs
+     *
+     *  @param bd           Initialized block device, with a program size dividing the chunk size
+     *  @param addr         Start of the log region, a multiple of the chunk size
+     *  @param size         Size of the log region, a multiple of the chunk size
+     *  @param rate         Expected data rate in bytes per second
+     *  @param headroom_ms  Card stall to absorb without dropping data
+     */
+    SDStreamWriter(BlockDevice *bd, bd_addr_t addr, bd_size_t size, uint32_t rate,
+                   uint32_t headroom_ms = MBED_CONF_SD_STREAM_HEADROOM_MS);
+    virtual ~SDStreamWriter();
+
+    /** Allocate the ring and start the writer thread
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int start();
+
+    /** Write the data left in the ring and stop the writer thread
+     *
+     *  The last chunk is padded with zeroes to the program size.
+     *
+     *  @return         0 on success, or the first error the writer ran into
+     */
+    int stop();
+
+    /** Append a record to the ring
+     *
+     *  Safe to call from interrupt context. Never blocks.
+     *
+     *  @param data     Record to log
+     *  @param size     Size of the record in bytes
+     *  @return         true if the record was queued, false if it was dropped
+     */
+    bool write(const void *data, size_t size);
+
+    /** Get the counters of the stream
+     *
+     *  @param stats    Structure receiving the counters
+     */
+    void get_stats(sd_stream_stats_t *stats) const;
+
+    /** Get the number of bytes logged so far
+     *
+     *  @return         Offset of the next chunk in the log region
+     */
+    bd_size_t get_written() const;
+
+private:
+    enum {
+        STREAM_WAKE = (1 << 0),
+        STREAM_STOP = (1 << 1),
+    };
+
+    void _setup(bd_addr_t addr, bd_size_t size, uint32_t rate, uint32_t headroom_ms);
+    void _run();
+    int _write_chunk(const uint8_t *chunk, bd_size_t size);
+
+    BlockDevice *_bd;
+    SDBlockDevice *_sd;             /**< Same device as _bd when streaming with CMD25 */
+    bool _streaming;                /**< Write stream open on _sd */
+    bd_addr_t _addr;
+    bd_size_t _size;
+    bd_size_t _written;
+    size_t _chunk_size;
+
+    uint8_t *_ring;
+    uint32_t _ring_size;            /**< Power of two, a multiple of the chunk size */
+    volatile uint32_t _head;        /**< Bytes ever written by the producer */
+    volatile uint32_t _tail;        /**< Bytes ever consumed by the writer */
+    volatile bool _full;            /**< Region used up, further records are dropped */
+
+    volatile uint32_t _records_dropped;
+    volatile uint32_t _bytes_dropped;
+    volatile uint32_t _max_fill;
+    uint32_t _max_write_ms;
+    int _error;
+
+    Thread *_thread;
+    EventFlags _flags;
+    volatile bool _stop;
+};
+
+#endif  /* MBED_SD_STREAM_WRITER_H */
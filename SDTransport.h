@@ -0,0 +1,182 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SD_TRANSPORT_H
+#define MBED_SD_TRANSPORT_H
+
+#include "mbed.h"
+
+/** One step of a transfer chain
+ */
+struct sd_transfer_t {
+    const uint8_t *tx;          /*!< Bytes to send, NULL to send 0xFF */
+    uint8_t *rx;                /*!< Buffer receiving the bytes, NULL to discard them */
+    size_t length;              /*!< Number of bytes */
+};
+
+/** Byte stream between the SD protocol logic and a card in SPI mode
+ *
+ *  SDBlockDevice speaks the SD protocol through this interface only. The
+ *  default implementation, SDSPITransport, drives an mbed SPI bus and a chip
+ *  select pin. Other implementations can move the data with DMA, through a
+ *  dual or quad SPI bridge, or to a simulated card on the host.
+ *
+ *  Every transfer happens between select() and deselect(). The SD block
+ *  device holds its own lock around them, the transport only has to keep
+ *  other users of a shared bus away while the card is selected.
+ */
+class SDTransport {
+public:
+    virtual ~SDTransport() {}
+
+    /** Prepare the bus for card initialization
+     *
+     *  Sets the clock, deselects the card and sends at least 74 clock
+     *  cycles, as the card requires before its first command.
+     *
+     *  @param hz       Initialization clock frequency, 100 kHz to 400 kHz
+     */
+    virtual void init(uint32_t hz) = 0;
+
+    /** Set the clock frequency for the following transfers
+     *
+     *  @param hz       Clock frequency
+     */
+    virtual void frequency(uint32_t hz) = 0;
+
+    /** Take the bus and select the card
+     */
+    virtual void select() = 0;
+
+    /** Deselect the card and release the bus
+     */
+    virtual void deselect() = 0;
+
+    /** Exchange one byte
+     *
+     *  @param data     Byte to send
+     *  @return         Byte received
+     */
+    virtual uint8_t transfer(uint8_t data) = 0;
+
+    /** Exchange a block of bytes
+     *
+     *  Must accept any buffer, including those is_dma_safe() rejects.
+     *
+     *  @param tx       Bytes to send, NULL to send 0xFF
+     *  @param rx       Buffer receiving length bytes, NULL to discard them
+     *  @param length   Number of bytes
+     */
+    virtual void transfer(const uint8_t *tx, uint8_t *rx, size_t length) = 0;
+
+    /** Run a chain of block transfers back to back
+     *
+     *  The data phase of a block (token, payload, CRC and data response) is
+     *  handed over as one chain, with the payload step pointing straight at
+     *  the caller's buffer. Transports with scatter-gather DMA can queue the
+     *  whole chain at once.
+     *
+     *  @param chain    Transfers, in bus order
+     *  @param count    Number of transfers in the chain
+     */
+    virtual void transfer_chain(const sd_transfer_t *chain, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            transfer(chain[i].tx, chain[i].rx, chain[i].length);
+        }
+    }
+
+    /** Receive a block of bytes while sending 0xFF
+     *
+     *  @param rx       Buffer receiving the bytes
+     *  @param length   Number of bytes
+     */
+    virtual void fill_read(uint8_t *rx, size_t length)
+    {
+        transfer(NULL, rx, length);
+    }
+
+    /** Clock 0xFF until a given byte is received
+     *
+     *  @param value    Byte to wait for
+     *  @param us       Timeout in microseconds
+     *  @return         true if the byte was received before the timeout
+     */
+    virtual bool poll(uint8_t value, uint32_t us)
+    {
+        Timer timer;
+        timer.start();
+        do {
+            if (value == transfer(0xFF)) {
+                return true;
+            }
+        } while ((uint32_t)timer.read_us() < us);
+        return false;
+    }
+
+    /** Exchange a block of bytes in the background
+     *
+     *  The card stays selected until done is called. Transports without
+     *  background transfers complete the transfer before returning.
+     *
+     *  @param tx       Bytes to send, NULL to send 0xFF
+     *  @param rx       Buffer receiving length bytes, NULL to discard them
+     *  @param length   Number of bytes
+     *  @param done     Called with 0 once the transfer completed, or a negative error code
+     *  @return         0 if the transfer was started or a negative error code
+     */
+    virtual int transfer_async(const uint8_t *tx, uint8_t *rx, size_t length, Callback<void(int)> done)
+    {
+        transfer(tx, rx, length);
+        if (done) {
+            done(0);
+        }
+        return 0;
+    }
+
+    /** Check whether block transfers can use a buffer directly
+     *
+     *  Buffers the transport cannot move data to or from efficiently, such as
+     *  unaligned buffers or memory its DMA cannot reach, are staged by the SD
+     *  block device through an aligned bounce buffer instead. When no bounce
+     *  buffer is free, their data goes through transfer() rather than
+     *  transfer_chain().
+     *
+     *  @param buffer   Start of the user buffer
+     *  @param length   Length of the user buffer in bytes
+     *  @return         true if the buffer can be transferred as is
+     */
+    virtual bool is_dma_safe(const void *buffer, size_t length) const
+    {
+        (void)buffer;
+        (void)length;
+        return true;
+    }
+
+    /** Identify the bus the card is on
+     *
+     *  Cards sharing a bus are brought up together by
+     *  SDBlockDevice::init_concurrent(), cards on different buses in parallel.
+     *
+     *  @return         Identifier equal for all transports on the same bus
+     */
+    virtual intptr_t get_bus_id() const
+    {
+        return (intptr_t)this;
+    }
+};
+
+#endif  /* MBED_SD_TRANSPORT_H */
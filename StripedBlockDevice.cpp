@@ -0,0 +1,420 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Striping
+ * --------
+ * The logical address space is cut into stripe units which are handed out
+ * round robin to the members:
+ *
+ *   stripe   = addr / stripe_size
+ *   member   = stripe % member_count
+ *   location = (stripe / member_count) * stripe_size + addr % stripe_size
+ *
+ * A request is split by member rather than by stripe: each member's worker
+ * handles the stripes of the request that belong to it, so the members only
+ * synchronise once per request. Requests that fit in a single stripe unit are
+ * issued directly from the calling thread.
+ *
+ * Consecutive stripes of one member sit back to back on the member, so the
+ * member's share of a request is a single range there. Trims cover it in one
+ * call. Reads and programs move it through the member's staging buffer, one
+ * transfer per staging buffer, scattering the data to or gathering it from
+ * the stripe units in the caller's buffer. Without a staging buffer each
+ * stripe unit is transferred on its own.
+ */
+
+#include "StripedBlockDevice.h"
+#include "mbed_debug.h"
+#include <algorithm>
+#include <new>
+#include <string.h>
+
+#define STRIPED_DBG 0
+
+StripedBlockDevice::StripedBlockDevice(BlockDevice **bds, size_t bd_count, bd_size_t stripe_size)
+    : _staging_size(0), _bd_count(0), _stripe_size(stripe_size), _member_size(0),
+      _read_size(0), _program_size(0), _erase_size(0), _init_ref_count(0), _is_initialized(false)
+{
+    _attach(bds, bd_count);
+}
+
+StripedBlockDevice::~StripedBlockDevice()
+{
+    if (_is_initialized) {
+        _init_ref_count = 1;
+        deinit();
+    }
+}
+
+void StripedBlockDevice::_attach(BlockDevice **bds, size_t bd_count)
+{
+    MBED_ASSERT(bd_count <= MBED_CONF_SD_STRIPED_MAX_MEMBERS);
+    if (bd_count > MBED_CONF_SD_STRIPED_MAX_MEMBERS) {
+        bd_count = MBED_CONF_SD_STRIPED_MAX_MEMBERS;
+    }
+
+    _bd_count = bd_count;
+    for (size_t i = 0; i < _bd_count; i++) {
+        _bds[i] = bds[i];
+        _workers[i] = NULL;
+        _staging[i] = NULL;
+        _jobs[i].owner = this;
+        _jobs[i].member = i;
+    }
+}
+
+int StripedBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+    size_t i;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count != 1) {
+        goto end;
+    }
+
+    if (_bd_count == 0) {
+        err = BD_ERROR_DEVICE_ERROR;
+        goto fail;
+    }
+
+    _member_size = 0;
+    _read_size = 0;
+    _program_size = 0;
+    _erase_size = 0;
+
+    for (i = 0; i < _bd_count; i++) {
+        err = _bds[i]->init();
+        if (err) {
+            goto fail_members;
+        }
+
+        bd_size_t size = _bds[i]->size();
+        if (i == 0 || size < _member_size) {
+            _member_size = size;
+        }
+        _read_size = std::max(_read_size, _bds[i]->get_read_size());
+        _program_size = std::max(_program_size, _bds[i]->get_program_size());
+        _erase_size = std::max(_erase_size, _bds[i]->get_erase_size());
+    }
+    _member_size -= _member_size % _stripe_size;
+
+    // The stripe unit is the smallest piece handed to a member, every member
+    // must be able to trim it on its own
+    if ((_stripe_size == 0) || (_stripe_size % _erase_size) || (_stripe_size % _program_size)) {
+        debug_if(STRIPED_DBG, "Stripe size %llu not a multiple of the member erase size %llu\n",
+                 _stripe_size, _erase_size);
+        err = BD_ERROR_DEVICE_ERROR;
+        goto fail_members;
+    }
+
+    for (i = 0; i < _bd_count; i++) {
+        _workers[i] = new BlockDeviceWorker();
+        err = _workers[i]->start();
+        if (err) {
+            goto fail_workers;
+        }
+    }
+
+    // A member without a staging buffer still works, one stripe unit at a time
+    _staging_size = MBED_CONF_SD_STRIPED_STAGING_SIZE;
+    _staging_size -= _staging_size % std::max(_read_size, _program_size);
+    for (i = 0; (i < _bd_count) && _staging_size; i++) {
+        _staging[i] = new (std::nothrow) uint8_t[_staging_size];
+        debug_if(STRIPED_DBG && !_staging[i], "No staging buffer for member %d\n", i);
+    }
+
+    _is_initialized = true;
+    goto end;
+
+fail_workers:
+    for (i = 0; i < _bd_count; i++) {
+        delete _workers[i];
+        _workers[i] = NULL;
+    }
+    i = _bd_count;
+fail_members:
+    while (i--) {
+        _bds[i]->deinit();
+    }
+fail:
+    _init_ref_count = 0;
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int StripedBlockDevice::deinit()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+        goto end;
+    }
+
+    _init_ref_count--;
+
+    if (_init_ref_count) {
+        goto end;
+    }
+
+    _free_staging();
+    for (size_t i = 0; i < _bd_count; i++) {
+        delete _workers[i];
+        _workers[i] = NULL;
+
+        int member_err = _bds[i]->deinit();
+        if (!err) {
+            err = member_err;
+        }
+    }
+    _is_initialized = false;
+
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int StripedBlockDevice::sync()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+    for (size_t i = 0; i < _bd_count && _is_initialized; i++) {
+        int member_err = _bds[i]->sync();
+        if (!err) {
+            err = member_err;
+        }
+    }
+    _mutex.unlock();
+    return err;
+}
+
+int StripedBlockDevice::read(void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_read(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return _transfer(OP_READ, static_cast<uint8_t *>(b), addr, size);
+}
+
+int StripedBlockDevice::program(const void *b, bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_program(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return _transfer(OP_PROGRAM, static_cast<uint8_t *>(const_cast<void *>(b)), addr, size);
+}
+
+int StripedBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    if (!is_valid_erase(addr, size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    return _transfer(OP_TRIM, NULL, addr, size);
+}
+
+bd_size_t StripedBlockDevice::get_read_size() const
+{
+    return _read_size;
+}
+
+bd_size_t StripedBlockDevice::get_program_size() const
+{
+    return _program_size;
+}
+
+bd_size_t StripedBlockDevice::get_erase_size() const
+{
+    return _erase_size;
+}
+
+bd_size_t StripedBlockDevice::size() const
+{
+    return _member_size * _bd_count;
+}
+
+bd_size_t StripedBlockDevice::get_stripe_size() const
+{
+    return _stripe_size;
+}
+
+int StripedBlockDevice::_transfer(op_t op, uint8_t *buffer, bd_addr_t addr, bd_size_t size)
+{
+    if (size == 0) {
+        return BD_ERROR_OK;
+    }
+
+    _mutex.lock();
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    _op = op;
+    _buffer = buffer;
+    _addr = addr;
+    _size = size;
+
+    bd_addr_t first = addr / _stripe_size;
+    bd_addr_t last = (addr + size - 1) / _stripe_size;
+    int err = BD_ERROR_OK;
+
+    if (first == last) {
+        // Single stripe unit, no point in waking a worker
+        err = _member_transfer(first % _bd_count);
+    } else {
+        size_t members = (last - first + 1 < _bd_count) ? (last - first + 1) : _bd_count;
+        size_t member = first % _bd_count;
+
+        for (size_t i = 0; i < members; i++) {
+            _workers[member]->post(callback(_member_job, &_jobs[member]));
+            member = (member + 1) % _bd_count;
+        }
+
+        // Report the first member error, but always join every worker
+        member = first % _bd_count;
+        for (size_t i = 0; i < members; i++) {
+            int member_err = _workers[member]->wait();
+            if (!err) {
+                err = member_err;
+            }
+            member = (member + 1) % _bd_count;
+        }
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int StripedBlockDevice::_member_job(member_job_t *job)
+{
+    return job->owner->_member_transfer(job->member);
+}
+
+int StripedBlockDevice::_member_transfer(size_t member)
+{
+    BlockDevice *bd = _bds[member];
+    bd_addr_t end = _addr + _size;
+
+    // First and last stripes of the request that live on this member
+    bd_addr_t stripe = _addr / _stripe_size;
+    stripe += (member + _bd_count - stripe % _bd_count) % _bd_count;
+    bd_addr_t last = (end - 1) / _stripe_size;
+    last -= (last % _bd_count + _bd_count - member) % _bd_count;
+    if (stripe > last) {
+        return BD_ERROR_OK;
+    }
+
+    // Their range on the member, in one piece
+    bd_addr_t lo = std::max(stripe * _stripe_size, _addr);
+    bd_addr_t hi = std::min((last + 1) * _stripe_size, end);
+    bd_addr_t member_lo = _member_addr(lo);
+    bd_addr_t member_hi = _member_addr(hi - 1) + 1;
+    int err = BD_ERROR_OK;
+
+    if (OP_TRIM == _op) {
+        err = bd->trim(member_lo, member_hi - member_lo);
+    } else if ((stripe == last) || !_staging[member]) {
+        return _member_units(member, stripe, end);
+    } else {
+        for (bd_addr_t addr = member_lo; (addr < member_hi) && !err; addr += _staging_size) {
+            bd_size_t size = std::min(member_hi - addr, _staging_size);
+            if (OP_PROGRAM == _op) {
+                _stage(member, addr, size, true);
+                err = bd->program(_staging[member], addr, size);
+            } else {
+                err = bd->read(_staging[member], addr, size);
+                _stage(member, addr, size, false);
+            }
+        }
+    }
+
+    if (err) {
+        debug_if(STRIPED_DBG, "Member %d failed in 0x%llx-0x%llx: %d\n", member, member_lo, member_hi, err);
+    }
+    return err;
+}
+
+// One transfer per stripe unit, straight from the caller's buffer
+int StripedBlockDevice::_member_units(size_t member, bd_addr_t stripe, bd_addr_t end)
+{
+    BlockDevice *bd = _bds[member];
+
+    for (; stripe * _stripe_size < end; stripe += _bd_count) {
+        bd_addr_t lo = std::max(stripe * _stripe_size, _addr);
+        bd_addr_t hi = std::min((stripe + 1) * _stripe_size, end);
+        bd_addr_t member_addr = _member_addr(lo);
+        int err;
+
+        if (OP_READ == _op) {
+            err = bd->read(_buffer + (lo - _addr), member_addr, hi - lo);
+        } else {
+            err = bd->program(_buffer + (lo - _addr), member_addr, hi - lo);
+        }
+
+        if (err) {
+            debug_if(STRIPED_DBG, "Member %d failed at 0x%llx: %d\n", member, member_addr, err);
+            return err;
+        }
+    }
+    return BD_ERROR_OK;
+}
+
+// Copy a range of a member between its staging buffer and the stripe units of the caller's buffer
+void StripedBlockDevice::_stage(size_t member, bd_addr_t member_addr, bd_size_t size, bool gather)
+{
+    uint8_t *staging = _staging[member];
+
+    while (size) {
+        bd_addr_t offset = member_addr % _stripe_size;
+        bd_size_t piece = std::min(_stripe_size - offset, size);
+        bd_addr_t addr = ((member_addr / _stripe_size) * _bd_count + member) * _stripe_size + offset;
+
+        if (gather) {
+            memcpy(staging, _buffer + (addr - _addr), piece);
+        } else {
+            memcpy(_buffer + (addr - _addr), staging, piece);
+        }
+        staging += piece;
+        member_addr += piece;
+        size -= piece;
+    }
+}
+
+bd_addr_t StripedBlockDevice::_member_addr(bd_addr_t addr) const
+{
+    bd_addr_t stripe = addr / _stripe_size;
+    return (stripe / _bd_count) * _stripe_size + addr % _stripe_size;
+}
+
+void StripedBlockDevice::_free_staging()
+{
+    for (size_t i = 0; i < _bd_count; i++) {
+        delete[] _staging[i];
+        _staging[i] = NULL;
+    }
+}
@@ -0,0 +1,203 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_STRIPED_BLOCK_DEVICE_H
+#define MBED_STRIPED_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "BlockDeviceWorker.h"
+#include "mbed.h"
+#include "platform/PlatformMutex.h"
+
+#ifndef MBED_CONF_SD_STRIPED_MAX_MEMBERS
+#define MBED_CONF_SD_STRIPED_MAX_MEMBERS    4       /*!< Maximum number of striped member devices */
+#endif
+
+#ifndef MBED_CONF_SD_STRIPED_STAGING_SIZE
+#define MBED_CONF_SD_STRIPED_STAGING_SIZE   8192    /*!< Staging buffer per member, 0 for one transfer per stripe unit */
+#endif
+
+/** Block device striped (RAID-0) across multiple block devices
+ *
+ *  Consecutive stripe units of the logical address space are spread round
+ *  robin across the member devices. Transfers that span several members run
+ *  concurrently, one worker thread per member, so members on separate SPI
+ *  buses add up their throughput.
+ *
+ *  The stripe units of a request that live on one member are contiguous on
+ *  that member. They are moved in a single read or program per
+ *  MBED_CONF_SD_STRIPED_STAGING_SIZE bytes, gathered into or scattered from a
+ *  staging buffer of the member, so a card sees one long multiple block
+ *  transfer instead of one short transfer per stripe unit.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "StripedBlockDevice.h"
+ *
+ * SDBlockDevice sd0(p5, p6, p7, p8);
+ * SDBlockDevice sd1(p11, p12, p13, p14);
+ * BlockDevice *members[] = {&sd0, &sd1};
+ * StripedBlockDevice striped(members, 16 * 1024);
+ * @endcode
+ */
+class StripedBlockDevice : public BlockDevice {
+public:
+    /** Lifetime of the striped block device
+     *
+     *  @param bds          Array of member block devices
+     *  @param bd_count     Number of member block devices, at most MBED_CONF_SD_STRIPED_MAX_MEMBERS
+     *  @param stripe_size  Size of a stripe unit in bytes, must be a multiple of the
+     *                      erase size of every member
+     */
+    StripedBlockDevice(BlockDevice **bds, size_t bd_count, bd_size_t stripe_size);
+
+    /** Lifetime of the striped block device
+     *
+     *  @param bds          Array of member block devices
+     *  @param stripe_size  Size of a stripe unit in bytes, must be a multiple of the
+     *                      erase size of every member
+     */
+    template <size_t Size>
+    StripedBlockDevice(BlockDevice *(&bds)[Size], bd_size_t stripe_size)
+        : _bd_count(0), _stripe_size(stripe_size), _member_size(0),
+          _read_size(0), _program_size(0), _erase_size(0), _init_ref_count(0), _is_initialized(false)
+    {
+        _attach(bds, Size);
+    }
+
+    virtual ~StripedBlockDevice();
+
+    /** Initialize the member block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize the member block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from the striped block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to the striped block device
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Mark blocks as no longer in use
+     *
+     *  @param addr     Address of block to mark as unused
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the total size of the striped block device
+     *
+     *  @return         Size of the striped block device in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Get the size of a stripe unit
+     *
+     *  @return         Size of a stripe unit in bytes
+     */
+    bd_size_t get_stripe_size() const;
+
+private:
+    enum op_t {
+        OP_READ,
+        OP_PROGRAM,
+        OP_TRIM,
+    };
+
+    /* Work handed to the worker of one member */
+    struct member_job_t {
+        StripedBlockDevice *owner;
+        size_t member;
+    };
+
+    void _attach(BlockDevice **bds, size_t bd_count);
+    int _transfer(op_t op, uint8_t *buffer, bd_addr_t addr, bd_size_t size);
+    int _member_transfer(size_t member);
+    int _member_units(size_t member, bd_addr_t stripe, bd_addr_t end);
+    void _stage(size_t member, bd_addr_t member_addr, bd_size_t size, bool gather);
+    bd_addr_t _member_addr(bd_addr_t addr) const;
+    void _free_staging();
+    static int _member_job(member_job_t *job);
+
+    BlockDevice *_bds[MBED_CONF_SD_STRIPED_MAX_MEMBERS];
+    BlockDeviceWorker *_workers[MBED_CONF_SD_STRIPED_MAX_MEMBERS];
+    member_job_t _jobs[MBED_CONF_SD_STRIPED_MAX_MEMBERS];
+    uint8_t *_staging[MBED_CONF_SD_STRIPED_MAX_MEMBERS];    /**< NULL when it could not be allocated */
+    bd_size_t _staging_size;
+    size_t _bd_count;
+    bd_size_t _stripe_size;
+    bd_size_t _member_size;
+    bd_size_t _read_size;
+    bd_size_t _program_size;
+    bd_size_t _erase_size;
+
+    /* Request currently being split across the workers */
+    op_t _op;
+    uint8_t *_buffer;
+    bd_addr_t _addr;
+    bd_size_t _size;
+
+    PlatformMutex _mutex;
+    uint32_t _init_ref_count;
+    bool _is_initialized;
+};
+
+#endif  /* MBED_STRIPED_BLOCK_DEVICE_H */
@@ -47,6 +47,7 @@
 #include "utest.h"
 
 #include "SDBlockDevice.h"
+#include "SDSPITransport.h"
 #include <stdlib.h>
 
 using namespace utest::v1;
@@ -158,9 +159,437 @@ void test_read_write() {
         }
     }
 
+    // Retries are fine at 8MHz, errors that got through them are not
+    sd_stats_t stats;
+    sd.get_stats(&stats);
+    printf("read retries: %u, write retries: %u (%u blocks kept)\n",
+           (unsigned)stats.read_retries, (unsigned)stats.write_retries, (unsigned)stats.write_blocks_kept);
+    TEST_ASSERT_EQUAL(0, stats.read_errors);
+    TEST_ASSERT_EQUAL(0, stats.write_errors);
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+static volatile int init_async_result = 1;
+
+static void init_async_ready(int err) {
+    init_async_result = err;
+}
+
+void test_init_async() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    uint8_t block[512];
+
+    // Nothing to wait for before a background init was started
+    int err = sd.wait_init(0);
+    TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_NO_INIT, err);
+
+    // Fail fast: operations issued before the card is ready are refused
+    err = sd.init_async(init_async_ready, true);
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.read(block, 0, sizeof(block));
+    TEST_ASSERT(err == SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK || err == 0);
+
+    err = sd.wait_init();
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_EQUAL(0, init_async_result);
+
+    err = sd.read(block, 0, sizeof(block));
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+
+    // Queued: operations issued before the card is ready wait for it
+    err = sd.init_async();
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.read(block, 0, sizeof(block));
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_sd_status() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    sd_status_t status;
+
+    int err = sd.get_sd_status(&status);
+    TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_NO_INIT, err);
+
+    err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.get_sd_status(&status);
+    TEST_ASSERT_EQUAL(0, err);
+    printf("AU size: %llu bytes\n", status.au_size);
+    printf("Speed class: %d, UHS grade: %d, video class: %d\n",
+           status.speed_class, status.uhs_speed_grade, status.video_speed_class);
+    printf("Erase: %d AU in %d s + %d s, sectors of %llu bytes\n", status.erase_size, status.erase_timeout,
+           status.erase_offset, status.erase_block_size);
+
+    // The AU is a whole number of erase sectors, the erase size stays a block for file systems
+    TEST_ASSERT_EQUAL(status.au_size, sd.get_allocation_unit_size());
+    TEST_ASSERT_EQUAL(512, sd.get_erase_size());
+    TEST_ASSERT_EQUAL(0, status.erase_block_size % sd.get_erase_size());
+    if (status.au_size) {
+        TEST_ASSERT_EQUAL(0, status.au_size % status.erase_block_size);
+    }
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_write_zeroes() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    uint8_t block[512];
+    uint8_t zeroes[512];
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+    printf("erase value: %d\n", sd.get_erase_value());
+
+    // Unaligned ends around a run of whole erase blocks
+    bd_size_t erase_size = sd.get_erase_size();
+    bd_addr_t start = 8 * erase_size - sizeof(block);
+    bd_size_t size = 4 * erase_size + 2 * sizeof(block);
+
+    memset(block, 0xa5, sizeof(block));
+    for (bd_addr_t addr = start; addr < start + size; addr += sizeof(block)) {
+        err = sd.program(block, addr, sizeof(block));
+        TEST_ASSERT_EQUAL(0, err);
+    }
+
+    err = sd.write_zeroes(start, size);
+    TEST_ASSERT_EQUAL(0, err);
+
+    memset(zeroes, 0, sizeof(zeroes));
+    for (bd_addr_t addr = start; addr < start + size; addr += sizeof(block)) {
+        err = sd.read(block, addr, sizeof(block));
+        TEST_ASSERT_EQUAL(0, err);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(zeroes, block, sizeof(block));
+    }
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_trim_deferral() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    uint8_t written[512];
+    uint8_t block[512];
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+
+    bd_size_t erase_size = sd.get_erase_size();
+    TEST_ASSERT_EQUAL(sizeof(block), erase_size);
+    bd_addr_t base = 64 * erase_size;
+
+    // Trims smaller than the card's erase sector are skipped, nothing to see
+    sd_status_t status;
+    if ((0 == sd.get_sd_status(&status)) && (status.erase_block_size > erase_size)) {
+        TEST_ASSERT_EQUAL(0, sd.deinit());
+        TEST_IGNORE_MESSAGE("card erases in sectors larger than a block, skipping");
+    }
+
+    memset(written, 0x5a, sizeof(written));
+    for (int i = 0; i < 4; i++) {
+        err = sd.program(written, base + i * erase_size, erase_size);
+        TEST_ASSERT_EQUAL(0, err);
+    }
+
+    // Queue two adjacent trims, then program into the middle of them
+    sd.set_trim_deferral(50);
+    err = sd.trim(base, 2 * erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+    err = sd.trim(base + 2 * erase_size, 2 * erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+
+    memset(written, 0xa5, sizeof(written));
+    err = sd.program(written, base + erase_size, erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+
+    // Reads see the trims, programs take precedence over them
+    err = sd.read(block, base + erase_size, erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(written, block, erase_size);
+
+    err = sd.read(block, base + 3 * erase_size, erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_NOT_EQUAL(0x5a, block[0]);
+
+    // Let the background erase run, the programmed block must survive it
+    wait_ms(200);
+    err = sd.sync();
+    TEST_ASSERT_EQUAL(0, err);
+
+    err = sd.read(block, base + erase_size, erase_size);
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(written, block, erase_size);
+
+    sd.set_trim_deferral(0);
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_erased_map() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    uint8_t written[512];
+    uint8_t block[512];
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+
+    // Four granules, or four pages when the map is disabled
+    bd_size_t granule = MBED_CONF_SD_ERASED_MAP_GRANULE ? MBED_CONF_SD_ERASED_MAP_GRANULE : 4096;
+    bd_size_t size = 4 * granule;
+    bd_addr_t base = 256 * granule;
+
+    err = sd.trim(base, size);
+    TEST_ASSERT_EQUAL(0, err);
+    printf("erase value: %d, known erased: %llu bytes\n", sd.get_erase_value(), sd.get_erased_size());
+    bool mapped = MBED_CONF_SD_ERASED_MAP_GRANULE &&
+                  (sd.size() / granule / 8 < MBED_CONF_SD_ERASED_MAP_MAX_SIZE);
+    if (mapped && sd.get_erase_value() >= 0) {
+        TEST_ASSERT(sd.get_erased_size() >= size);
+    }
+
+    // Program one block in the second granule, the rest still reads as erased
+    memset(written, 0xa5, sizeof(written));
+    err = sd.program(written, base + granule + sizeof(block), sizeof(block));
+    TEST_ASSERT_EQUAL(0, err);
+
+    for (bd_addr_t addr = base; addr < base + size; addr += sizeof(block)) {
+        err = sd.read(block, addr, sizeof(block));
+        TEST_ASSERT_EQUAL(0, err);
+        if (addr == base + granule + sizeof(block)) {
+            TEST_ASSERT_EQUAL_UINT8_ARRAY(written, block, sizeof(block));
+        } else if (sd.get_erase_value() >= 0) {
+            TEST_ASSERT_EQUAL(sd.get_erase_value(), block[0]);
+            TEST_ASSERT_EQUAL(sd.get_erase_value(), block[sizeof(block) - 1]);
+        }
+    }
+
+    // A read spanning erased and programmed granules
+    uint8_t *span = new uint8_t[3 * granule];
+    err = sd.read(span, base, 3 * granule);
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(written, span + granule + sizeof(block), sizeof(block));
+    delete[] span;
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_transport() {
+    SDSPITransport transport(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice sd(&transport);
+    uint8_t written[512];
+    uint8_t block[512];
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+
+    for (size_t i = 0; i < sizeof(written); i++) {
+        written[i] = i * 7;
+    }
+    err = sd.program(written, 32 * sizeof(block), sizeof(block));
+    TEST_ASSERT_EQUAL(0, err);
+    err = sd.read(block, 32 * sizeof(block), sizeof(block));
+    TEST_ASSERT_EQUAL(0, err);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(written, block, sizeof(block));
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+// Reports one data block of a multiple block write as rejected after the card accepted it
+class FaultTransport : public SDSPITransport {
+public:
+    FaultTransport()
+        : SDSPITransport(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS),
+          reject(0), blocks(0)
+    {
+    }
+
+    virtual void transfer_chain(const sd_transfer_t *chain, size_t count)
+    {
+        SDSPITransport::transfer_chain(chain, count);
+
+        // A data block is the start token, the data, then the CRC and the data response token
+        if ((3 == count) && chain[0].tx && (0xFC == chain[0].tx[0]) && (++blocks == reject)) {
+            chain[2].rx[2] = 0x0B;      // CRC error
+        }
+    }
+
+    int reject;                         // Block to reject, counting from 1
+    int blocks;
+};
+
+void test_write_recovery() {
+    FaultTransport transport;
+    SDBlockDevice sd(&transport);
+    static uint8_t written[4 * 512];
+    static uint8_t block[4 * 512];
+    sd_stats_t stats;
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+
+    // Rejecting a block in the middle resends the blocks after it, the last one nothing
+    for (int reject = 2; reject <= 4; reject += 2) {
+        for (size_t i = 0; i < sizeof(written); i++) {
+            written[i] = i * reject;
+        }
+        sd.reset_stats();
+        transport.blocks = 0;
+        transport.reject = reject;
+        err = sd.program(written, 48 * 512, sizeof(written));
+        transport.reject = 0;
+        TEST_ASSERT_EQUAL(0, err);
+
+        sd.get_stats(&stats);
+        printf("Rejected block %d: %u retries, %u blocks kept\n",
+               reject, (unsigned)stats.write_retries, (unsigned)stats.write_blocks_kept);
+        TEST_ASSERT_EQUAL(0, stats.write_errors);
+        TEST_ASSERT_EQUAL((reject < 4) ? 1 : 0, stats.write_retries);
+
+        err = sd.read(block, 48 * 512, sizeof(block));
+        TEST_ASSERT_EQUAL(0, err);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(written, block, sizeof(block));
+    }
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+void test_buffer_pool() {
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    sd_buffer_pool_t *pool = SDBlockDevice::get_buffer_pool();
+    void *buffers[MBED_CONF_SD_BUFFER_POOL_COUNT];
+    sd_pool_stats_t stats;
+
+    // The driver returns its staging buffers
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+    err = sd.write_zeroes(0, 4 * 512);
+    TEST_ASSERT_EQUAL(0, err);
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+    pool->get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.in_use);
+    TEST_ASSERT(stats.peak >= 1);
+
+    uint32_t failures = stats.failures;
+    for (int i = 0; i < MBED_CONF_SD_BUFFER_POOL_COUNT; i++) {
+        buffers[i] = pool->alloc();
+        TEST_ASSERT_NOT_NULL(buffers[i]);
+        TEST_ASSERT_EQUAL(0, (uintptr_t)buffers[i] % MBED_CONF_SD_BUFFER_POOL_ALIGN);
+        memset(buffers[i], i, pool->get_buffer_size());
+    }
+    TEST_ASSERT_NULL(pool->alloc());
+
+    pool->get_stats(&stats);
+    TEST_ASSERT_EQUAL(MBED_CONF_SD_BUFFER_POOL_COUNT, stats.in_use);
+    TEST_ASSERT_EQUAL(MBED_CONF_SD_BUFFER_POOL_COUNT, stats.peak);
+    TEST_ASSERT_EQUAL(failures + 1, stats.failures);
+
+    for (int i = 0; i < MBED_CONF_SD_BUFFER_POOL_COUNT; i++) {
+        TEST_ASSERT_EQUAL(i, ((uint8_t *)buffers[i])[pool->get_buffer_size() - 1]);
+        pool->free(buffers[i]);
+    }
+    pool->get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.in_use);
+}
+
+// Transport that takes no user buffer directly, so every transfer bounces
+class BounceTransport : public SDSPITransport {
+public:
+    BounceTransport()
+        : SDSPITransport(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS)
+    {
+    }
+
+    virtual bool is_dma_safe(const void *buffer, size_t length) const
+    {
+        return false;
+    }
+};
+
+void test_bounce() {
+    BounceTransport transport;
+    SDBlockDevice sd(&transport);
+    static uint8_t written[4 * 512 + 1];
+    static uint8_t block[4 * 512 + 1];
+    sd_stats_t stats;
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+    sd.reset_stats();
+
+    // Odd addresses, one and several blocks
+    for (size_t i = 0; i < sizeof(written); i++) {
+        written[i] = i * 13;
+    }
+    for (int count = 1; count <= 4; count += 3) {
+        err = sd.program(written + 1, 40 * 512, count * 512);
+        TEST_ASSERT_EQUAL(0, err);
+        err = sd.read(block + 1, 40 * 512, count * 512);
+        TEST_ASSERT_EQUAL(0, err);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(written + 1, block + 1, count * 512);
+    }
+
+    sd.get_stats(&stats);
+    TEST_ASSERT_EQUAL(4, stats.bounced);
+    TEST_ASSERT_EQUAL(0, stats.unstaged);
+
+    err = sd.deinit();
+    TEST_ASSERT_EQUAL(0, err);
+}
+
+void test_bounce_exhausted() {
+    BounceTransport transport;
+    SDBlockDevice sd(&transport);
+    sd_buffer_pool_t *pool = SDBlockDevice::get_buffer_pool();
+    void *buffers[MBED_CONF_SD_BUFFER_POOL_COUNT];
+    static uint8_t written[4 * 512 + 1];
+    static uint8_t block[4 * 512 + 1];
+    sd_stats_t stats;
+
+    int err = sd.init();
+    TEST_ASSERT_EQUAL(0, err);
+    sd.reset_stats();
+
+    // With every buffer taken, odd addresses still go through, without staging
+    for (int i = 0; i < MBED_CONF_SD_BUFFER_POOL_COUNT; i++) {
+        buffers[i] = pool->alloc();
+        TEST_ASSERT_NOT_NULL(buffers[i]);
+    }
+    for (size_t i = 0; i < sizeof(written); i++) {
+        written[i] = i * 11;
+    }
+    err = sd.program(written + 1, 56 * 512, 4 * 512);
+    TEST_ASSERT_EQUAL(0, err);
+    err = sd.read(block + 1, 56 * 512, 4 * 512);
+    TEST_ASSERT_EQUAL(0, err);
+    for (int i = 0; i < MBED_CONF_SD_BUFFER_POOL_COUNT; i++) {
+        pool->free(buffers[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(written + 1, block + 1, 4 * 512);
+
+    sd.get_stats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.bounced);
+    TEST_ASSERT_EQUAL(2, stats.unstaged);
+
     err = sd.deinit();
     TEST_ASSERT_EQUAL(0, err);
 }
+#endif
 
 // Test setup
 utest::v1::status_t test_setup(const size_t number_of_cases) {
@@ -170,6 +599,18 @@ utest::v1::status_t test_setup(const size_t number_of_cases) {
 
 Case cases[] = {
     Case("Testing read write random blocks", test_read_write),
+    Case("Testing background init", test_init_async),
+    Case("Testing SD Status", test_sd_status),
+    Case("Testing deferred trim", test_trim_deferral),
+    Case("Testing write zeroes", test_write_zeroes),
+    Case("Testing erased range map", test_erased_map),
+    Case("Testing external transport", test_transport),
+    Case("Testing write recovery", test_write_recovery),
+#if MBED_CONF_SD_BUFFER_POOL_COUNT
+    Case("Testing buffer pool", test_buffer_pool),
+    Case("Testing bounce buffers", test_bounce),
+    Case("Testing bounce buffers with the pool exhausted", test_bounce_exhausted),
+#endif
 };
 
 Specification specification(test_setup, cases);
@@ -0,0 +1,161 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Log-structured block device test
+ *
+ * Checks that data written through a LogBlockDevice survives a deinit/init
+ * cycle, and compares random 4 KiB write IOPS with and without the log, on a
+ * simulated slow card and on the real card.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include "SlicingBlockDevice.h"
+#include "LogBlockDevice.h"
+#include "util/SlowCardBlockDevice.h"
+#include <stdlib.h>
+
+using namespace utest::v1;
+
+#define TEST_REGION_SIZE        (4 * 1024 * 1024)
+#define TEST_WRITE_SIZE         4096
+#define TEST_DIRECT_WRITES      50
+#define TEST_LOG_WRITES         400
+#define TEST_VERIFY_BLOCKS      64
+#define TEST_MIN_GAIN           10
+
+static uint8_t write_buffer[TEST_WRITE_SIZE];
+static uint8_t read_buffer[TEST_WRITE_SIZE];
+
+// Random 4 KiB writes over the whole device, in writes per second
+static float bench_random_writes(const char *name, BlockDevice *bd, int writes)
+{
+    Timer timer;
+    bd_size_t blocks = bd->size() / TEST_WRITE_SIZE;
+
+    timer.start();
+    for (int i = 0; i < writes; i++) {
+        write_buffer[0] = i;
+        TEST_ASSERT_EQUAL(0, bd->program(write_buffer, (rand() % blocks) * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+    }
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    timer.stop();
+
+    float iops = writes / timer.read();
+    printf("%-12s: %d random writes in %.3f sec, %.1f IOPS\n", name, writes, timer.read(), iops);
+    return iops;
+}
+
+void test_log_persistence()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice(&sd, 0, TEST_REGION_SIZE);
+    LogBlockDevice log(&slice);
+
+    TEST_ASSERT_EQUAL(0, log.init());
+    bd_size_t blocks = log.size() / TEST_WRITE_SIZE;
+    printf("log: %llu blocks of %d bytes, %d segments free\n", blocks, TEST_WRITE_SIZE, (int)log.get_free_segments());
+
+    // Write each test block twice, so the first copies turn into garbage
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < TEST_VERIFY_BLOCKS; i++) {
+            memset(write_buffer, pass * TEST_VERIFY_BLOCKS + i, TEST_WRITE_SIZE);
+            TEST_ASSERT_EQUAL(0, log.program(write_buffer, (i * 7 % blocks) * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+        }
+    }
+    TEST_ASSERT_EQUAL(0, log.trim(0, TEST_WRITE_SIZE));
+    TEST_ASSERT_EQUAL(0, log.deinit());
+
+    TEST_ASSERT_EQUAL(0, log.init());
+    TEST_ASSERT_EQUAL(0, log.collect());
+    for (int i = 1; i < TEST_VERIFY_BLOCKS; i++) {
+        memset(write_buffer, TEST_VERIFY_BLOCKS + i, TEST_WRITE_SIZE);
+        TEST_ASSERT_EQUAL(0, log.read(read_buffer, (i * 7 % blocks) * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, TEST_WRITE_SIZE);
+    }
+
+    // Trimmed blocks read as erased
+    memset(write_buffer, 0xff, TEST_WRITE_SIZE);
+    TEST_ASSERT_EQUAL(0, log.read(read_buffer, 0, TEST_WRITE_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, TEST_WRITE_SIZE);
+
+    TEST_ASSERT_EQUAL(0, log.deinit());
+}
+
+void test_log_iops_simulated()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice(&sd, 0, TEST_REGION_SIZE);
+    SlowCardBlockDevice slow(&slice);
+    LogBlockDevice log(&slow);
+
+    TEST_ASSERT_EQUAL(0, slow.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(8000000));
+    float direct = bench_random_writes("direct", &slow, TEST_DIRECT_WRITES);
+
+    TEST_ASSERT_EQUAL(0, log.init());
+    float logged = bench_random_writes("log", &log, TEST_LOG_WRITES);
+    printf("log gain on simulated slow card: %.1fx\n", logged / direct);
+    TEST_ASSERT(logged >= TEST_MIN_GAIN * direct);
+
+    TEST_ASSERT_EQUAL(0, log.deinit());
+    TEST_ASSERT_EQUAL(0, slow.deinit());
+}
+
+void test_log_iops_card()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice(&sd, 0, TEST_REGION_SIZE);
+    LogBlockDevice log(&slice);
+
+    TEST_ASSERT_EQUAL(0, slice.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(8000000));
+    float direct = bench_random_writes("direct", &slice, TEST_LOG_WRITES);
+
+    TEST_ASSERT_EQUAL(0, log.init());
+    float logged = bench_random_writes("log", &log, TEST_LOG_WRITES);
+
+    // Real cards differ too much to hold them to a number
+    printf("log gain on this card: %.1fx\n", logged / direct);
+
+    TEST_ASSERT_EQUAL(0, log.deinit());
+    TEST_ASSERT_EQUAL(0, slice.deinit());
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(300, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing log persistence", test_log_persistence),
+    Case("Testing log IOPS on a simulated slow card", test_log_iops_simulated),
+    Case("Testing log IOPS on the card", test_log_iops_card),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
@@ -0,0 +1,378 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Multiple SD card test
+ *
+ * These tests need a second SD card. A card sharing the bus with the default
+ * card is configured with sd.SPI_CS2 in mbed_app.json, a card on a second bus
+ * with sd.SPI2_MOSI, sd.SPI2_MISO, sd.SPI2_CLK and sd.SPI2_CS. Test cases are
+ * skipped when the card they need is not connected.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include "StripedBlockDevice.h"
+#include "MirroredBlockDevice.h"
+#include "SlicingBlockDevice.h"
+#include "TraceBlockDevice.h"
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace utest::v1;
+
+#define TEST_BLOCK_SIZE         512
+#define TEST_BLOCK_COUNT        2048
+#define TEST_THREAD_STACK       1024
+#define TEST_STRIPE_SIZE        4096
+#define TEST_CHUNK_SIZE         16384
+#define TEST_CHUNK_COUNT        64
+
+#ifndef MBED_CONF_SD_SPI_CS2
+#define MBED_CONF_SD_SPI_CS2    NC
+#endif
+
+#ifndef MBED_CONF_SD_SPI2_CS
+#define MBED_CONF_SD_SPI2_MOSI  NC
+#define MBED_CONF_SD_SPI2_MISO  NC
+#define MBED_CONF_SD_SPI2_CLK   NC
+#define MBED_CONF_SD_SPI2_CS    NC
+#endif
+
+// Second card, preferably on its own bus
+static SDBlockDevice *new_second_card()
+{
+    if (MBED_CONF_SD_SPI2_CS != NC) {
+        return new SDBlockDevice(MBED_CONF_SD_SPI2_MOSI, MBED_CONF_SD_SPI2_MISO, MBED_CONF_SD_SPI2_CLK, MBED_CONF_SD_SPI2_CS);
+    }
+    if (MBED_CONF_SD_SPI_CS2 != NC) {
+        return new SDBlockDevice(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS2);
+    }
+    return NULL;
+}
+
+struct bench_t {
+    SDBlockDevice *sd;
+    const uint8_t *buffer;
+    int err;
+};
+
+static uint8_t write_block[2][TEST_BLOCK_SIZE];
+
+static void bench_program(bench_t *bench)
+{
+    bench->err = 0;
+    for (bd_addr_t b = 0; b < TEST_BLOCK_COUNT && !bench->err; b++) {
+        bench->err = bench->sd->program(bench->buffer, b * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+    }
+}
+
+// Program both cards from their own thread and report the combined throughput
+static float bench_shared_bus(SDBlockDevice *sd0, SDBlockDevice *sd1, bool busy_release)
+{
+    Thread thread0(osPriorityNormal, TEST_THREAD_STACK);
+    Thread thread1(osPriorityNormal, TEST_THREAD_STACK);
+    bench_t bench[2] = {{sd0, write_block[0], 0}, {sd1, write_block[1], 0}};
+    Timer timer;
+
+    sd0->set_busy_release(busy_release);
+    sd1->set_busy_release(busy_release);
+
+    timer.start();
+    thread0.start(callback(bench_program, &bench[0]));
+    thread1.start(callback(bench_program, &bench[1]));
+    thread0.join();
+    thread1.join();
+    timer.stop();
+
+    TEST_ASSERT_EQUAL(0, bench[0].err);
+    TEST_ASSERT_EQUAL(0, bench[1].err);
+
+    float kib = 2.0f * TEST_BLOCK_COUNT * TEST_BLOCK_SIZE / 1024;
+    float speed = kib / timer.read();
+    printf("busy release %-3s: %.0f KiB in %.3f sec, %.1f KiB/s combined\n",
+           busy_release ? "on" : "off", kib, timer.read(), speed);
+    return speed;
+}
+
+void test_shared_bus_busy_release()
+{
+    if (MBED_CONF_SD_SPI_CS2 == NC) {
+        TEST_IGNORE_MESSAGE("sd.SPI_CS2 not configured, skipping");
+    }
+
+    SDBlockDevice sd0(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice sd1(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS2);
+
+    TEST_ASSERT_EQUAL(0, sd0.init());
+    TEST_ASSERT_EQUAL(0, sd1.init());
+    TEST_ASSERT_EQUAL(0, sd0.frequency(8000000));
+    TEST_ASSERT_EQUAL(0, sd1.frequency(8000000));
+
+    for (int i = 0; i < TEST_BLOCK_SIZE; i++) {
+        write_block[0][i] = 0xff & rand();
+        write_block[1][i] = 0xff & rand();
+    }
+
+    float held = bench_shared_bus(&sd0, &sd1, false);
+    float released = bench_shared_bus(&sd0, &sd1, true);
+    printf("busy release speedup: %.2fx\n", released / held);
+
+    // Data written by one card must not have leaked onto the other
+    uint8_t read_block[TEST_BLOCK_SIZE];
+    TEST_ASSERT_EQUAL(0, sd0.read(read_block, 0, TEST_BLOCK_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_block[0], read_block, TEST_BLOCK_SIZE);
+    TEST_ASSERT_EQUAL(0, sd1.read(read_block, 0, TEST_BLOCK_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_block[1], read_block, TEST_BLOCK_SIZE);
+
+    TEST_ASSERT_EQUAL(0, sd0.deinit());
+    TEST_ASSERT_EQUAL(0, sd1.deinit());
+}
+
+// Write then read back a run of large chunks, report the throughput of both
+static void bench_chunks(const char *name, BlockDevice *bd, uint8_t *write_chunk, uint8_t *read_chunk)
+{
+    Timer timer;
+    float kib = (float)TEST_CHUNK_COUNT * TEST_CHUNK_SIZE / 1024;
+
+    timer.start();
+    for (bd_addr_t c = 0; c < TEST_CHUNK_COUNT; c++) {
+        TEST_ASSERT_EQUAL(0, bd->program(write_chunk, c * TEST_CHUNK_SIZE, TEST_CHUNK_SIZE));
+    }
+    timer.stop();
+    printf("%-8s write: %.0f KiB in %.3f sec, %.1f KiB/s\n", name, kib, timer.read(), kib / timer.read());
+
+    timer.reset();
+    timer.start();
+    for (bd_addr_t c = 0; c < TEST_CHUNK_COUNT; c++) {
+        TEST_ASSERT_EQUAL(0, bd->read(read_chunk, c * TEST_CHUNK_SIZE, TEST_CHUNK_SIZE));
+    }
+    timer.stop();
+    printf("%-8s read:  %.0f KiB in %.3f sec, %.1f KiB/s\n", name, kib, timer.read(), kib / timer.read());
+
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk, read_chunk, TEST_CHUNK_SIZE);
+}
+
+void test_striped_throughput()
+{
+    SDBlockDevice sd0(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice *sd1 = new_second_card();
+    if (!sd1) {
+        TEST_IGNORE_MESSAGE("no second card configured, skipping");
+    }
+
+    uint8_t *write_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    uint8_t *read_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    for (int i = 0; i < TEST_CHUNK_SIZE; i++) {
+        write_chunk[i] = 0xff & rand();
+    }
+
+    // Single card baseline
+    TEST_ASSERT_EQUAL(0, sd0.init());
+    TEST_ASSERT_EQUAL(0, sd0.frequency(8000000));
+    bench_chunks("single", &sd0, write_chunk, read_chunk);
+    TEST_ASSERT_EQUAL(0, sd0.deinit());
+
+    BlockDevice *members[] = {&sd0, sd1};
+    StripedBlockDevice striped(members, TEST_STRIPE_SIZE);
+    TEST_ASSERT_EQUAL(0, striped.init());
+    TEST_ASSERT_EQUAL(0, sd0.frequency(8000000));
+    TEST_ASSERT_EQUAL(0, sd1->frequency(8000000));
+    TEST_ASSERT_EQUAL(TEST_STRIPE_SIZE, striped.get_stripe_size());
+    printf("striped size: %llu bytes over 2 cards\n", striped.size());
+
+    bench_chunks("striped", &striped, write_chunk, read_chunk);
+
+    // Each member holds every other stripe unit of the first chunk
+    TEST_ASSERT_EQUAL(0, sd1->read(read_chunk, 0, TEST_STRIPE_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk + TEST_STRIPE_SIZE, read_chunk, TEST_STRIPE_SIZE);
+
+    TEST_ASSERT_EQUAL(0, striped.deinit());
+    delete[] write_chunk;
+    delete[] read_chunk;
+    delete sd1;
+}
+
+// Transfers a striped request makes on one member
+static size_t member_transfers(bd_size_t member_size)
+{
+    if (!MBED_CONF_SD_STRIPED_STAGING_SIZE) {
+        return member_size / TEST_STRIPE_SIZE;
+    }
+    return (member_size + MBED_CONF_SD_STRIPED_STAGING_SIZE - 1) / MBED_CONF_SD_STRIPED_STAGING_SIZE;
+}
+
+void test_striped_transfers()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice0(&sd, 0, TEST_BLOCK_COUNT * TEST_BLOCK_SIZE / 2);
+    SlicingBlockDevice slice1(&sd, TEST_BLOCK_COUNT * TEST_BLOCK_SIZE / 2, TEST_BLOCK_COUNT * TEST_BLOCK_SIZE);
+    static sd_trace_record_t records[2][16];
+    TraceBlockDevice trace0(&slice0, records[0], 16);
+    TraceBlockDevice trace1(&slice1, records[1], 16);
+    TraceBlockDevice *traces[] = {&trace0, &trace1};
+
+    uint8_t *write_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    uint8_t *read_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    for (int i = 0; i < TEST_CHUNK_SIZE; i++) {
+        write_chunk[i] = 0xff & rand();
+    }
+
+    // Both members on one card, only the requests reaching them matter here
+    BlockDevice *members[] = {&trace0, &trace1};
+    StripedBlockDevice striped(members, TEST_STRIPE_SIZE);
+    TEST_ASSERT_EQUAL(0, striped.init());
+
+    // Half a stripe unit in, so each member gets partial units at the ends
+    bd_addr_t addr = TEST_STRIPE_SIZE / 2;
+    size_t transfers = member_transfers(TEST_CHUNK_SIZE / 2);
+    TEST_ASSERT_EQUAL(0, striped.program(write_chunk, addr, TEST_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL(0, striped.read(read_chunk, addr, TEST_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk, read_chunk, TEST_CHUNK_SIZE);
+
+    for (int i = 0; i < 2; i++) {
+        printf("member %d: %u requests for 2 x %d bytes\n", i, (unsigned)traces[i]->get_record_count(), TEST_CHUNK_SIZE / 2);
+        TEST_ASSERT_EQUAL(2 * transfers, traces[i]->get_record_count());
+        TEST_ASSERT_EQUAL(SD_TRACE_PROGRAM, records[i][0].op);
+        TEST_ASSERT_EQUAL(SD_TRACE_READ, records[i][transfers].op);
+    }
+
+    // Member 0 holds the second half of unit 0 followed by unit 2
+    TEST_ASSERT_EQUAL(0, trace0.read(read_chunk, TEST_STRIPE_SIZE / 2, TEST_STRIPE_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk, read_chunk, TEST_STRIPE_SIZE / 2);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk + TEST_STRIPE_SIZE + TEST_STRIPE_SIZE / 2,
+                                  read_chunk + TEST_STRIPE_SIZE / 2, TEST_STRIPE_SIZE / 2);
+
+    TEST_ASSERT_EQUAL(0, striped.deinit());
+    delete[] write_chunk;
+    delete[] read_chunk;
+}
+
+void test_mirrored_reads()
+{
+    SDBlockDevice sd0(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice *sd1 = new_second_card();
+    if (!sd1) {
+        TEST_IGNORE_MESSAGE("no second card configured, skipping");
+    }
+
+    uint8_t *write_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    uint8_t *read_chunk = new uint8_t[TEST_CHUNK_SIZE];
+    for (int i = 0; i < TEST_CHUNK_SIZE; i++) {
+        write_chunk[i] = 0xff & rand();
+    }
+
+    MirroredBlockDevice mirrored(&sd0, sd1);
+    TEST_ASSERT_EQUAL(0, mirrored.init());
+    TEST_ASSERT_EQUAL(0, sd0.frequency(8000000));
+    TEST_ASSERT_EQUAL(0, sd1->frequency(8000000));
+
+    // Large reads are split across both members
+    bench_chunks("mirrored", &mirrored, write_chunk, read_chunk);
+
+    // Both members hold a full copy
+    TEST_ASSERT_EQUAL(0, sd0.read(read_chunk, 0, TEST_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk, read_chunk, TEST_CHUNK_SIZE);
+    TEST_ASSERT_EQUAL(0, sd1->read(read_chunk, 0, TEST_CHUNK_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_chunk, read_chunk, TEST_CHUNK_SIZE);
+
+    // Small reads go to a single member, report the worst case latency
+    Timer timer;
+    int worst_us = 0;
+    for (int i = 0; i < 256; i++) {
+        bd_addr_t block = (rand() % (TEST_CHUNK_COUNT * TEST_CHUNK_SIZE / TEST_BLOCK_SIZE)) * TEST_BLOCK_SIZE;
+        timer.reset();
+        timer.start();
+        TEST_ASSERT_EQUAL(0, mirrored.read(read_chunk, block, TEST_BLOCK_SIZE));
+        timer.stop();
+        worst_us = std::max(worst_us, timer.read_us());
+    }
+    printf("mirrored small read worst case: %d us, member latency %lu/%lu us per block\n",
+           worst_us, (unsigned long)mirrored.get_read_latency(0), (unsigned long)mirrored.get_read_latency(1));
+    TEST_ASSERT_NOT_EQUAL(0, mirrored.get_read_latency(0));
+    TEST_ASSERT_NOT_EQUAL(0, mirrored.get_read_latency(1));
+
+    TEST_ASSERT_EQUAL(0, mirrored.deinit());
+    delete[] write_chunk;
+    delete[] read_chunk;
+    delete sd1;
+}
+
+void test_concurrent_init()
+{
+    SDBlockDevice sd0(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice *sd1 = new_second_card();
+    if (!sd1) {
+        TEST_IGNORE_MESSAGE("no second card configured, skipping");
+    }
+    SDBlockDevice *sds[] = {&sd0, sd1};
+    int errs[2];
+    Timer timer;
+
+    // Cards are reset into the idle state by both inits, so the runs are comparable
+    timer.start();
+    TEST_ASSERT_EQUAL(0, sd0.init());
+    TEST_ASSERT_EQUAL(0, sd1->init());
+    timer.stop();
+    int sequential_ms = timer.read_ms();
+    TEST_ASSERT_EQUAL(0, sd0.deinit());
+    TEST_ASSERT_EQUAL(0, sd1->deinit());
+
+    timer.reset();
+    timer.start();
+    TEST_ASSERT_EQUAL(0, SDBlockDevice::init_concurrent(sds, 2, errs));
+    timer.stop();
+    int concurrent_ms = timer.read_ms();
+    TEST_ASSERT_EQUAL(0, errs[0]);
+    TEST_ASSERT_EQUAL(0, errs[1]);
+
+    printf("init of 2 cards: sequential %d ms, concurrent %d ms\n", sequential_ms, concurrent_ms);
+
+    // Both cards are usable
+    uint8_t block[TEST_BLOCK_SIZE];
+    TEST_ASSERT_EQUAL(0, sd0.read(block, 0, TEST_BLOCK_SIZE));
+    TEST_ASSERT_EQUAL(0, sd1->read(block, 0, TEST_BLOCK_SIZE));
+
+    TEST_ASSERT_EQUAL(0, sd0.deinit());
+    TEST_ASSERT_EQUAL(0, sd1->deinit());
+    delete sd1;
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(240, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing busy release on a shared bus", test_shared_bus_busy_release),
+    Case("Testing striped throughput against a single card", test_striped_throughput),
+    Case("Testing striped transfers per member", test_striped_transfers),
+    Case("Testing mirrored reads", test_mirrored_reads),
+    Case("Testing concurrent init", test_concurrent_init),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
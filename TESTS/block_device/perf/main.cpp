@@ -0,0 +1,278 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Sustained write throughput test
+ *
+ * Writes a region of the card with small programs, sequentially and in random
+ * order within each segment, directly to the card and through a
+ * CoalescingBlockDevice, and reports the sustained write speed of each. Also
+ * reports the rate of single-block commands, which is bound by command overhead.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include "CoalescingBlockDevice.h"
+#include <stdlib.h>
+
+using namespace utest::v1;
+
+#define TEST_WRITE_SIZE         4096
+#define TEST_SEGMENT_SIZE       32768
+#define TEST_REGION_SIZE        (1024 * 1024)
+#define TEST_FREQUENCY          8000000
+#define TEST_COMMANDS           500
+#define TEST_FAST_FREQUENCY     25000000
+#define TEST_DATA_PASSES        64
+
+static uint8_t write_buffer[TEST_WRITE_SIZE];
+static uint8_t read_buffer[TEST_WRITE_SIZE];
+
+// Offset of the n-th write, shuffled within each segment when random is set
+static bd_addr_t write_offset(size_t n, bool random)
+{
+    const size_t per_segment = TEST_SEGMENT_SIZE / TEST_WRITE_SIZE;
+    size_t segment = n / per_segment;
+    size_t slot = n % per_segment;
+    if (random) {
+        // Odd multiplier is a permutation of the slots in the segment
+        slot = (slot * 5 + segment) % per_segment;
+    }
+    return segment * TEST_SEGMENT_SIZE + slot * TEST_WRITE_SIZE;
+}
+
+static float bench_write(const char *name, BlockDevice *bd, bool random)
+{
+    Timer timer;
+    const size_t writes = TEST_REGION_SIZE / TEST_WRITE_SIZE;
+
+    timer.start();
+    for (size_t n = 0; n < writes; n++) {
+        write_buffer[0] = n;
+        TEST_ASSERT_EQUAL(0, bd->program(write_buffer, write_offset(n, random), TEST_WRITE_SIZE));
+    }
+    TEST_ASSERT_EQUAL(0, bd->sync());
+    timer.stop();
+
+    float speed = TEST_REGION_SIZE / timer.read() / (1024 * 1024);
+    printf("%-10s %-10s: %d KiB in %.3f sec, %.2f MB/s\n", name, random ? "random" : "sequential",
+           TEST_REGION_SIZE / 1024, timer.read(), speed);
+
+    // Spot check the data
+    for (size_t n = 0; n < writes; n += 37) {
+        TEST_ASSERT_EQUAL(0, bd->read(read_buffer, write_offset(n, random), TEST_WRITE_SIZE));
+        TEST_ASSERT_EQUAL(0xff & n, read_buffer[0]);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer + 1, read_buffer + 1, TEST_WRITE_SIZE - 1);
+    }
+    return speed;
+}
+
+void test_coalesced_write_speed()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+
+    for (int i = 0; i < TEST_WRITE_SIZE; i++) {
+        write_buffer[i] = 0xff & rand();
+    }
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(TEST_FREQUENCY));
+    printf("allocation unit: %llu bytes\n", sd.get_allocation_unit_size());
+
+    float direct_seq = bench_write("direct", &sd, false);
+    float direct_rand = bench_write("direct", &sd, true);
+
+    CoalescingBlockDevice coalesced(&sd, TEST_SEGMENT_SIZE);
+    TEST_ASSERT_EQUAL(0, coalesced.init());
+    float coalesced_seq = bench_write("coalesced", &coalesced, false);
+    float coalesced_rand = bench_write("coalesced", &coalesced, true);
+
+    printf("coalescing speedup: %.2fx sequential, %.2fx random\n",
+           coalesced_seq / direct_seq, coalesced_rand / direct_rand);
+
+    TEST_ASSERT_EQUAL(0, coalesced.deinit());
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+}
+
+void test_coalesced_partial_segment()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    CoalescingBlockDevice coalesced(&sd, TEST_SEGMENT_SIZE);
+    bd_size_t block = sd.get_program_size();
+
+    TEST_ASSERT_EQUAL(0, coalesced.init());
+
+    // A single block stays buffered until sync(), reads must see it anyway
+    memset(write_buffer, 0x3c, block);
+    TEST_ASSERT_EQUAL(0, coalesced.program(write_buffer, 3 * block, block));
+    TEST_ASSERT_EQUAL(0, coalesced.read(read_buffer, 3 * block, block));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, block);
+
+    TEST_ASSERT_EQUAL(0, coalesced.sync());
+    TEST_ASSERT_EQUAL(0, sd.read(read_buffer, 3 * block, block));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, block);
+
+    TEST_ASSERT_EQUAL(0, coalesced.deinit());
+}
+
+void test_command_rate()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    bd_size_t block = sd.get_program_size();
+    Timer timer;
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(TEST_FREQUENCY));
+
+    timer.start();
+    for (int i = 0; i < TEST_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL(0, sd.read(read_buffer, i * block, block));
+    }
+    timer.stop();
+    printf("single-block reads   : %.0f commands/s\n", TEST_COMMANDS / timer.read());
+
+    timer.reset();
+    timer.start();
+    for (int i = 0; i < TEST_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL(0, sd.program(write_buffer, i * block, block));
+    }
+    timer.stop();
+    printf("single-block programs: %.0f commands/s\n", TEST_COMMANDS / timer.read());
+
+    // Each trim is three commands (CMD32, CMD33, CMD38)
+    timer.reset();
+    timer.start();
+    for (int i = 0; i < TEST_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL(0, sd.trim(i * sd.get_erase_size(), sd.get_erase_size()));
+    }
+    timer.stop();
+    printf("trims                : %.0f commands/s\n", 3 * TEST_COMMANDS / timer.read());
+
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+}
+
+// Time spent per block beyond the 512 data bytes and CRC on the wire
+void test_data_phase_overhead()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    bd_size_t block = sd.get_program_size();
+    int blocks = TEST_DATA_PASSES * TEST_WRITE_SIZE / block;
+    float wire_us = (block + 2) * 8 * 1000000.0f / TEST_FAST_FREQUENCY;
+    Timer timer;
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(TEST_FAST_FREQUENCY));
+
+    timer.start();
+    for (int i = 0; i < TEST_DATA_PASSES; i++) {
+        TEST_ASSERT_EQUAL(0, sd.read(read_buffer, i * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+    }
+    timer.stop();
+    printf("multi-block reads : %.1f us per block, %.1f us over the wire time\n",
+           timer.read_us() / (float)blocks, timer.read_us() / (float)blocks - wire_us);
+
+    timer.reset();
+    timer.start();
+    for (int i = 0; i < TEST_DATA_PASSES; i++) {
+        TEST_ASSERT_EQUAL(0, sd.program(write_buffer, i * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+    }
+    timer.stop();
+    printf("multi-block writes: %.1f us per block, %.1f us over the wire time\n",
+           timer.read_us() / (float)blocks, timer.read_us() / (float)blocks - wire_us);
+
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+}
+
+// Block payloads in 8 and then 16-bit frames, over a transport of our own to switch between them
+void test_frame_bits()
+{
+#if SD_SPI_WIDE
+    SDSPITransport transport(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDBlockDevice sd(&transport);
+    float kib = TEST_DATA_PASSES * TEST_WRITE_SIZE / 1024.0f;
+    float write_speed[2];
+    float read_speed[2];
+    Timer timer;
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    TEST_ASSERT_EQUAL(0, sd.frequency(TEST_FAST_FREQUENCY));
+
+    for (int wide = 0; wide < 2; wide++) {
+        TEST_ASSERT_TRUE(transport.set_frame_bits(wide ? 16 : 8));
+        for (int i = 0; i < TEST_WRITE_SIZE; i++) {
+            write_buffer[i] = 0xff & rand();
+        }
+
+        timer.reset();
+        timer.start();
+        for (int i = 0; i < TEST_DATA_PASSES; i++) {
+            TEST_ASSERT_EQUAL(0, sd.program(write_buffer, i * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+        }
+        timer.stop();
+        write_speed[wide] = kib / timer.read();
+
+        timer.reset();
+        timer.start();
+        for (int i = 0; i < TEST_DATA_PASSES; i++) {
+            TEST_ASSERT_EQUAL(0, sd.read(read_buffer, i * TEST_WRITE_SIZE, TEST_WRITE_SIZE));
+        }
+        timer.stop();
+        read_speed[wide] = kib / timer.read();
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, TEST_WRITE_SIZE);
+
+        printf("%2d-bit frames: write %.1f KiB/s, read %.1f KiB/s\n",
+               transport.get_frame_bits(), write_speed[wide], read_speed[wide]);
+    }
+
+    // What went out in 16-bit frames reads back the same in 8-bit frames
+    TEST_ASSERT_TRUE(transport.set_frame_bits(8));
+    TEST_ASSERT_EQUAL(0, sd.read(read_buffer, 0, TEST_WRITE_SIZE));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(write_buffer, read_buffer, TEST_WRITE_SIZE);
+
+    printf("16-bit frames gain: write %+.1f%%, read %+.1f%%\n",
+           100 * (write_speed[1] / write_speed[0] - 1), 100 * (read_speed[1] / read_speed[0] - 1));
+
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+#else
+    TEST_IGNORE_MESSAGE("needs asynchronous SPI and sd.SPI_FRAME_BITS set to 16, skipping");
+#endif
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(300, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing coalesced partial segment", test_coalesced_partial_segment),
+    Case("Testing coalesced write speed", test_coalesced_write_speed),
+    Case("Testing command rate", test_command_rate),
+    Case("Testing data phase overhead", test_data_phase_overhead),
+    Case("Testing 16-bit frames", test_frame_bits),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
@@ -0,0 +1,230 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Streaming data logger test
+ *
+ * Logs records from a 1 kHz ticker interrupt through an SDStreamWriter, on a
+ * simulated slow card pausing for garbage collection and on the real card,
+ * and checks that every record reaches the card in order. A writer without
+ * headroom for the pauses must count the records it drops. Stream calls from
+ * another thread than the one that opened the stream must be refused.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include "SlicingBlockDevice.h"
+#include "SDStreamWriter.h"
+#include "util/SlowCardBlockDevice.h"
+
+using namespace utest::v1;
+
+#define TEST_REGION_SIZE        (4 * 1024 * 1024)
+#define TEST_PERIOD_US          1000
+#define TEST_DURATION_MS        4000
+#define TEST_HEADROOM_MS        400
+#define TEST_READ_SIZE          4096
+
+struct test_record_t {
+    uint32_t sequence;
+    uint32_t time_us;
+    uint32_t check;
+    uint32_t reserved;
+};
+
+#define TEST_RATE               (sizeof(test_record_t) * 1000000 / TEST_PERIOD_US)
+
+// Class 4 card pausing 250 ms for garbage collection every 16 KiB
+static const slow_card_profile_t stalling_profile = {
+    64 * 1024,  // au_size
+    200,        // command_us
+    250,        // kib_us
+    20,         // seek_ms
+    100,        // au_switch_ms
+    250,        // stall_ms
+    16 * 1024,  // stall_interval
+};
+
+// Same card pausing for a full second, longer than two chunks of records take
+static const slow_card_profile_t overflow_profile = {
+    64 * 1024,  // au_size
+    200,        // command_us
+    250,        // kib_us
+    20,         // seek_ms
+    100,        // au_switch_ms
+    1000,       // stall_ms
+    16 * 1024,  // stall_interval
+};
+
+static SDStreamWriter *logger;
+static Timer clock_timer;
+static uint32_t sequence;
+static uint8_t read_buffer[TEST_READ_SIZE];
+
+static void sample()
+{
+    test_record_t record;
+    record.sequence = sequence++;
+    record.time_us = clock_timer.read_us();
+    record.check = record.sequence ^ 0xA5A5A5A5;
+    record.reserved = 0;
+    logger->write(&record, sizeof(record));
+}
+
+// Log from the ticker for the test duration, then stop the writer
+static void run_logger(SDStreamWriter *writer, sd_stream_stats_t *stats)
+{
+    Ticker ticker;
+
+    logger = writer;
+    sequence = 0;
+    clock_timer.reset();
+    clock_timer.start();
+
+    TEST_ASSERT_EQUAL(0, writer->start());
+    ticker.attach_us(sample, TEST_PERIOD_US);
+    wait_ms(TEST_DURATION_MS);
+    ticker.detach();
+    TEST_ASSERT_EQUAL(0, writer->stop());
+
+    writer->get_stats(stats);
+    printf("%lu records, %llu bytes written, %lu dropped, ring %lu/%lu bytes, longest write %lu ms\n",
+           sequence, stats->bytes_written, stats->records_dropped,
+           stats->max_fill, stats->ring_size, stats->max_write_ms);
+}
+
+// Every record on the device, in order
+static void verify_records(BlockDevice *bd, uint32_t count)
+{
+    uint32_t expected = 0;
+
+    for (bd_addr_t addr = 0; expected < count; addr += TEST_READ_SIZE) {
+        TEST_ASSERT_EQUAL(0, bd->read(read_buffer, addr, TEST_READ_SIZE));
+        test_record_t *records = (test_record_t *)read_buffer;
+        for (size_t i = 0; (i < TEST_READ_SIZE / sizeof(test_record_t)) && (expected < count); i++) {
+            TEST_ASSERT_EQUAL(expected, records[i].sequence);
+            TEST_ASSERT_EQUAL(expected ^ 0xA5A5A5A5, records[i].check);
+            expected++;
+        }
+    }
+}
+
+void test_stream_slow_card()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice(&sd, 0, TEST_REGION_SIZE);
+    SlowCardBlockDevice slow(&slice, stalling_profile);
+    SDStreamWriter writer(&slow, 0, TEST_REGION_SIZE, TEST_RATE, TEST_HEADROOM_MS);
+    sd_stream_stats_t stats;
+
+    TEST_ASSERT_EQUAL(0, slow.init());
+    run_logger(&writer, &stats);
+
+    // The pauses are shorter than the headroom, nothing may be lost
+    TEST_ASSERT_EQUAL(0, stats.records_dropped);
+    TEST_ASSERT(stats.max_write_ms >= stalling_profile.stall_ms);
+    verify_records(&slice, sequence);
+
+    TEST_ASSERT_EQUAL(0, slow.deinit());
+}
+
+void test_stream_card()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SDStreamWriter writer(&sd, 0, TEST_REGION_SIZE, TEST_RATE, TEST_HEADROOM_MS);
+    sd_stream_stats_t stats;
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    run_logger(&writer, &stats);
+
+    TEST_ASSERT_EQUAL(0, stats.records_dropped);
+    verify_records(&sd, sequence);
+
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+}
+
+void test_stream_overflow()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice slice(&sd, 0, TEST_REGION_SIZE);
+    SlowCardBlockDevice slow(&slice, overflow_profile);
+    SDStreamWriter writer(&slow, 0, TEST_REGION_SIZE, TEST_RATE, 0);
+    sd_stream_stats_t stats;
+
+    TEST_ASSERT_EQUAL(0, slow.init());
+    run_logger(&writer, &stats);
+
+    // Without headroom the pauses overflow the ring, whole records are dropped
+    TEST_ASSERT(stats.records_dropped > 0);
+    TEST_ASSERT_EQUAL(stats.records_dropped * sizeof(test_record_t), stats.bytes_dropped);
+
+    TEST_ASSERT_EQUAL(0, slow.deinit());
+}
+
+static uint8_t stream_block[512];
+static int intruder_program_err;
+static int intruder_end_err;
+
+static void stream_intruder(SDBlockDevice *sd)
+{
+    intruder_program_err = sd->stream_program(stream_block, sizeof(stream_block));
+    intruder_end_err = sd->stream_end();
+}
+
+void test_stream_owner()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    Thread intruder(osPriorityNormal, 1024);
+
+    TEST_ASSERT_EQUAL(0, sd.init());
+    TEST_ASSERT_EQUAL(0, sd.stream_begin(0, 2 * sizeof(stream_block)));
+    TEST_ASSERT_EQUAL(0, sd.stream_program(stream_block, sizeof(stream_block)));
+
+    // Only the thread that opened the stream may feed or close it
+    intruder.start(callback(stream_intruder, &sd));
+    intruder.join();
+    TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_PARAMETER, intruder_program_err);
+    TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_PARAMETER, intruder_end_err);
+
+    TEST_ASSERT_EQUAL(0, sd.stream_program(stream_block, sizeof(stream_block)));
+    TEST_ASSERT_EQUAL(0, sd.stream_end());
+    TEST_ASSERT_EQUAL(0, sd.deinit());
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(120, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing stream on a slow card with pauses", test_stream_slow_card),
+    Case("Testing stream on the card", test_stream_card),
+    Case("Testing stream overflow counters", test_stream_overflow),
+    Case("Testing stream owner thread", test_stream_owner),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
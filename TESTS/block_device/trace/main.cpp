@@ -0,0 +1,219 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Trace recording and replay test
+ *
+ * Records the requests of a small two-thread workload with TraceBlockDevice,
+ * to RAM and to a second region of the card, and checks the traces. Then
+ * replays the trace against a simulated slow card, directly and through a
+ * CoalescingBlockDevice, and reports the cost of each stack.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include "SlicingBlockDevice.h"
+#include "CoalescingBlockDevice.h"
+#include "TraceBlockDevice.h"
+#include "util/SlowCardBlockDevice.h"
+#include "util/TraceReplayer.h"
+
+using namespace utest::v1;
+
+#define TEST_REGION_SIZE        (4 * 1024 * 1024)
+#define TEST_TRACE_SIZE         (64 * 1024)
+#define TEST_WRITE_SIZE         4096
+#define TEST_SEGMENT_SIZE       32768
+#define TEST_WRITES             64
+#define TEST_READS              64
+#define TEST_RECORDS            256
+#define TEST_THREAD_STACK       1024
+
+static sd_trace_record_t records[TEST_RECORDS];
+static size_t record_count;
+static uint8_t write_buffer[TEST_WRITE_SIZE];
+static uint8_t read_buffer[512];
+static int workload_err;
+
+// 4 KiB programs in shuffled order within each 32 KiB segment
+static void writer(BlockDevice *bd)
+{
+    const size_t per_segment = TEST_SEGMENT_SIZE / TEST_WRITE_SIZE;
+    for (size_t n = 0; n < TEST_WRITES; n++) {
+        size_t slot = ((n % per_segment) * 5 + n / per_segment) % per_segment;
+        bd_addr_t addr = (n / per_segment) * TEST_SEGMENT_SIZE + slot * TEST_WRITE_SIZE;
+        int err = bd->program(write_buffer, addr, TEST_WRITE_SIZE);
+        workload_err = err ? err : workload_err;
+    }
+}
+
+// Single block lookups spread over the second half of the region
+static void reader(BlockDevice *bd)
+{
+    for (size_t n = 0; n < TEST_READS; n++) {
+        bd_addr_t addr = TEST_REGION_SIZE / 2 + ((n * 2654435761u) % 4096) * 512;
+        int err = bd->read(read_buffer, addr, 512);
+        workload_err = err ? err : workload_err;
+    }
+}
+
+static void run_workload(BlockDevice *bd)
+{
+    Thread write_thread(osPriorityNormal, TEST_THREAD_STACK);
+    Thread read_thread(osPriorityNormal, TEST_THREAD_STACK);
+
+    workload_err = 0;
+    write_thread.start(callback(writer, bd));
+    read_thread.start(callback(reader, bd));
+    write_thread.join();
+    read_thread.join();
+    TEST_ASSERT_EQUAL(0, workload_err);
+
+    TEST_ASSERT_EQUAL(0, bd->trim(TEST_REGION_SIZE - TEST_SEGMENT_SIZE, TEST_SEGMENT_SIZE));
+    TEST_ASSERT_EQUAL(0, bd->sync());
+}
+
+void test_trace_ram()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice data(&sd, 0, TEST_REGION_SIZE);
+    TraceBlockDevice traced(&data, records, TEST_RECORDS);
+    size_t ops[SD_TRACE_OPS] = {0};
+    uint8_t writer_thread = 0xFF;
+
+    TEST_ASSERT_EQUAL(0, traced.init());
+    run_workload(&traced);
+    record_count = traced.get_record_count();
+    TEST_ASSERT_EQUAL(0, traced.get_dropped_count());
+    TEST_ASSERT_EQUAL(0, traced.deinit());
+
+    TEST_ASSERT_EQUAL(TEST_WRITES + TEST_READS + 2, record_count);
+    for (size_t i = 0; i < record_count; i++) {
+        TEST_ASSERT(records[i].op < SD_TRACE_OPS);
+        ops[records[i].op]++;
+        if (i) {
+            TEST_ASSERT(records[i].time_us >= records[i - 1].time_us);
+        }
+
+        // The writer and the reader each have a thread index of their own
+        if (SD_TRACE_PROGRAM == records[i].op) {
+            TEST_ASSERT_EQUAL(TEST_WRITE_SIZE / SD_TRACE_BLOCK_SIZE, records[i].count);
+            if (0xFF == writer_thread) {
+                writer_thread = records[i].thread;
+            }
+            TEST_ASSERT_EQUAL(writer_thread, records[i].thread);
+        } else if ((SD_TRACE_READ == records[i].op) && (0xFF != writer_thread)) {
+            TEST_ASSERT(writer_thread != records[i].thread);
+        }
+    }
+    TEST_ASSERT_EQUAL(TEST_WRITES, ops[SD_TRACE_PROGRAM]);
+    TEST_ASSERT_EQUAL(TEST_READS, ops[SD_TRACE_READ]);
+    TEST_ASSERT_EQUAL(1, ops[SD_TRACE_TRIM]);
+    TEST_ASSERT_EQUAL(1, ops[SD_TRACE_SYNC]);
+    TEST_ASSERT_EQUAL(SD_TRACE_SYNC, records[record_count - 1].op);
+
+    printf("%u records over %lu us\n", (unsigned)record_count, records[record_count - 1].time_us);
+}
+
+void test_trace_device()
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice data(&sd, 0, TEST_REGION_SIZE);
+    SlicingBlockDevice trace(&sd, TEST_REGION_SIZE, TEST_REGION_SIZE + TEST_TRACE_SIZE);
+
+    // Trace the same requests to RAM and to the trace region at once
+    TraceBlockDevice ram(&data, records, TEST_RECORDS);
+    TraceBlockDevice traced(&ram, &trace);
+
+    TEST_ASSERT_EQUAL(0, traced.init());
+    run_workload(&traced);
+    TEST_ASSERT_EQUAL(ram.get_record_count(), traced.get_record_count());
+    record_count = ram.get_record_count();
+    TEST_ASSERT_EQUAL(0, traced.deinit());
+
+    TraceReplayer replayer;
+    TEST_ASSERT_EQUAL(0, trace.init());
+    TEST_ASSERT_EQUAL(0, replayer.load(&trace));
+    TEST_ASSERT_EQUAL(0, trace.deinit());
+
+    TEST_ASSERT_EQUAL(record_count, replayer.get_record_count());
+    const sd_trace_record_t *loaded = replayer.get_records();
+    for (size_t i = 0; i < record_count; i++) {
+        TEST_ASSERT_EQUAL(records[i].op, loaded[i].op);
+        TEST_ASSERT_EQUAL(records[i].block, loaded[i].block);
+        TEST_ASSERT_EQUAL(records[i].count, loaded[i].count);
+    }
+}
+
+// Replay the RAM trace against a simulated card, with or without coalescing
+static uint32_t replay(bool coalesce)
+{
+    SDBlockDevice sd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    SlicingBlockDevice data(&sd, 0, TEST_REGION_SIZE);
+    SlowCardBlockDevice card(&data);
+    CoalescingBlockDevice coalesced(&card, TEST_SEGMENT_SIZE);
+    BlockDevice *stack = coalesce ? (BlockDevice *)&coalesced : (BlockDevice *)&card;
+    TraceReplayer replayer(records, record_count);
+    trace_replay_stats_t stats;
+
+    replayer.set_threaded(true);
+    TEST_ASSERT_EQUAL(0, stack->init());
+    TEST_ASSERT_EQUAL(0, replayer.replay(stack, &stats));
+    TEST_ASSERT_EQUAL(0, stack->deinit());
+
+    TEST_ASSERT_EQUAL(0, stats.errors);
+    TEST_ASSERT_EQUAL(TEST_WRITES, stats.ops[SD_TRACE_PROGRAM]);
+    TEST_ASSERT_EQUAL(TEST_READS, stats.ops[SD_TRACE_READ]);
+
+    printf("%-10s: %lu ms, %lu ms simulated card time, longest request %lu us\n",
+           coalesce ? "coalesced" : "direct", stats.elapsed_ms, card.get_delay_ms(), stats.max_latency_us);
+    return card.get_delay_ms();
+}
+
+void test_trace_replay()
+{
+    TEST_ASSERT(record_count > 0);
+
+    uint32_t direct = replay(false);
+    uint32_t coalesced = replay(true);
+
+    // Shuffled 4 KiB writes become whole segments, the simulated card seeks less
+    TEST_ASSERT(coalesced <= direct);
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(120, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing trace to RAM", test_trace_ram),
+    Case("Testing trace to a second device", test_trace_device),
+    Case("Testing trace replay", test_trace_replay),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
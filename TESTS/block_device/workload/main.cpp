@@ -0,0 +1,368 @@
+/*
+ * mbed Microcontroller Library
+ * Copyright (c) 2006-2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** @file main.cpp Workload generator test
+ *
+ * Drives the card with mixes of concurrent jobs resembling production load,
+ * in the spirit of fio. Each job is one line of a workload table: region,
+ * transfer size, read percentage, access pattern, thread count, rate limit
+ * and bursts. All jobs of a workload run at once for its duration, and each
+ * reports throughput, IOPS and latency percentiles.
+ *
+ * To evaluate a driver or card change, run the test before and after and
+ * compare the job reports, or add a workload of your own to the table.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+
+#include "SDBlockDevice.h"
+#include <algorithm>
+
+using namespace utest::v1;
+
+#define TEST_FREQUENCY          25000000
+#define TEST_THREAD_STACK       1024
+#define TEST_MAX_JOBS           4
+#define TEST_MAX_THREADS        8
+#define TEST_SAMPLES            512         // Latency samples kept per job
+#define TEST_ZIPF_BUCKETS       256         // Granularity of the hot spots
+
+#define KiB                     1024
+#define MiB                     (1024 * 1024)
+
+enum workload_pattern_t {
+    WORKLOAD_SEQUENTIAL,        /*!< Consecutive transfers, wrapping at the end of the region */
+    WORKLOAD_UNIFORM,           /*!< Uniformly random transfers */
+    WORKLOAD_ZIPF,              /*!< Random transfers, bucket k of the region hit with weight 1/k */
+};
+
+/** One job of a workload
+ */
+struct workload_job_t {
+    const char *name;
+    bd_addr_t start;            /*!< Region of the card, jobs writing should not overlap */
+    bd_size_t size;
+    uint32_t block_size;        /*!< Bytes per transfer, a multiple of 512 */
+    uint32_t read_percent;      /*!< Share of reads, the rest are writes */
+    workload_pattern_t pattern;
+    uint32_t threads;           /*!< Threads issuing transfers, one at a time each */
+    uint32_t rate_iops;         /*!< Combined rate limit of the threads, 0 for none */
+    uint32_t burst;             /*!< Transfers per burst, 0 for no bursts */
+    uint32_t burst_gap_ms;      /*!< Pause after each burst */
+};
+
+struct workload_t {
+    const char *name;
+    uint32_t duration_ms;
+    workload_job_t jobs[TEST_MAX_JOBS];     /*!< Terminated by a job without a name */
+};
+
+// 70/30 read/write split over a 16 MiB region, two threads
+static const workload_t mixed_workload = {
+    "70/30 random mix", 5000, {
+        {"mix", 0, 16 * MiB, 4 * KiB, 70, WORKLOAD_UNIFORM, 2, 0, 0, 0},
+        {NULL},
+    }
+};
+
+// Metadata-like hot spots, most transfers land in a few buckets
+static const workload_t zipf_workload = {
+    "zipfian hot spots", 5000, {
+        {"hot", 0, 16 * MiB, 512, 50, WORKLOAD_ZIPF, 1, 0, 0, 0},
+        {NULL},
+    }
+};
+
+// A logger writing bursts of four 32 KiB blocks every 100 ms while a reader looks up records
+static const workload_t logger_workload = {
+    "bursty logger and reader", 5000, {
+        {"logger", 0, 16 * MiB, 32 * KiB, 0, WORKLOAD_SEQUENTIAL, 1, 0, 4, 100},
+        {"reader", 16 * MiB, 16 * MiB, 512, 100, WORKLOAD_UNIFORM, 1, 0, 0, 0},
+        {NULL},
+    }
+};
+
+// Rate limited writers sharing the card with unlimited readers
+static const workload_t limited_workload = {
+    "rate limited writers", 5000, {
+        {"writers", 0, 8 * MiB, 4 * KiB, 0, WORKLOAD_UNIFORM, 2, 50, 0, 0},
+        {"readers", 8 * MiB, 8 * MiB, 4 * KiB, 100, WORKLOAD_SEQUENTIAL, 2, 0, 0, 0},
+        {NULL},
+    }
+};
+
+struct job_stats_t {
+    Mutex lock;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t errors;
+    uint32_t max_us;
+    uint32_t samples[TEST_SAMPLES];
+    uint32_t sampled;           /*!< Transfers offered to the reservoir */
+    uint32_t next_block;        /*!< Sequential pattern position, shared by the threads */
+};
+
+struct worker_t {
+    const workload_job_t *job;
+    job_stats_t *stats;
+    uint32_t seed;
+};
+
+static SDBlockDevice *sd;
+static Timer clock_timer;
+static uint32_t duration_us;
+static job_stats_t job_stats[TEST_MAX_JOBS];
+static uint32_t zipf_cdf[TEST_ZIPF_BUCKETS];
+
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Cumulative weights of 1/k for k = 1..TEST_ZIPF_BUCKETS, scaled to 2^31
+static void zipf_setup()
+{
+    float total = 0;
+    for (int k = 1; k <= TEST_ZIPF_BUCKETS; k++) {
+        total += 1.0f / k;
+    }
+
+    float sum = 0;
+    for (int k = 1; k <= TEST_ZIPF_BUCKETS; k++) {
+        sum += 1.0f / k;
+        zipf_cdf[k - 1] = (uint32_t)(sum / total * 2147483648.0f);
+    }
+    zipf_cdf[TEST_ZIPF_BUCKETS - 1] = 0x80000000;
+}
+
+// Block of the next transfer of a job, counted in transfers from the region start
+static uint32_t next_block(worker_t *worker)
+{
+    const workload_job_t *job = worker->job;
+    uint32_t blocks = job->size / job->block_size;
+
+    switch (job->pattern) {
+        case WORKLOAD_SEQUENTIAL: {
+            worker->stats->lock.lock();
+            uint32_t block = worker->stats->next_block++ % blocks;
+            worker->stats->lock.unlock();
+            return block;
+        }
+
+        case WORKLOAD_ZIPF: {
+            uint32_t r = xorshift(&worker->seed) & 0x7FFFFFFF;
+            uint32_t rank = std::upper_bound(zipf_cdf, zipf_cdf + TEST_ZIPF_BUCKETS, r) - zipf_cdf;
+
+            // Scatter the ranks over the region, the hottest bucket is not the first
+            uint32_t bucket = (rank * 97) % TEST_ZIPF_BUCKETS;
+            uint32_t per_bucket = blocks / TEST_ZIPF_BUCKETS;
+            return bucket * per_bucket + xorshift(&worker->seed) % per_bucket;
+        }
+
+        default:
+            return xorshift(&worker->seed) % blocks;
+    }
+}
+
+static void record(job_stats_t *stats, bool read, uint32_t latency_us, int err, uint32_t *seed)
+{
+    stats->lock.lock();
+    if (err) {
+        stats->errors++;
+    } else if (read) {
+        stats->reads++;
+    } else {
+        stats->writes++;
+    }
+    stats->max_us = std::max(stats->max_us, latency_us);
+
+    // Reservoir sampling keeps an unbiased subset of every transfer's latency
+    uint32_t n = stats->sampled++;
+    if (n < TEST_SAMPLES) {
+        stats->samples[n] = latency_us;
+    } else {
+        uint32_t slot = xorshift(seed) % (n + 1);
+        if (slot < TEST_SAMPLES) {
+            stats->samples[slot] = latency_us;
+        }
+    }
+    stats->lock.unlock();
+}
+
+static void run_worker(worker_t *worker)
+{
+    const workload_job_t *job = worker->job;
+    uint8_t *buffer = new uint8_t[job->block_size];
+    uint32_t period_us = job->rate_iops ? (1000000 * job->threads / job->rate_iops) : 0;
+    uint32_t next_us = clock_timer.read_us();
+    uint32_t in_burst = 0;
+
+    memset(buffer, worker->seed, job->block_size);
+
+    while ((uint32_t)clock_timer.read_us() < duration_us) {
+        bool read = (xorshift(&worker->seed) % 100) < job->read_percent;
+        bd_addr_t addr = job->start + (bd_addr_t)next_block(worker) * job->block_size;
+
+        uint32_t begin = clock_timer.read_us();
+        int err = read ? sd->read(buffer, addr, job->block_size)
+                  : sd->program(buffer, addr, job->block_size);
+        record(worker->stats, read, clock_timer.read_us() - begin, err, &worker->seed);
+
+        if (job->burst && (++in_burst == job->burst)) {
+            in_burst = 0;
+            Thread::wait(job->burst_gap_ms);
+        }
+        if (period_us) {
+            next_us += period_us;
+            int32_t ahead = next_us - clock_timer.read_us();
+            if (ahead > 0) {
+                Thread::wait((ahead + 999) / 1000);
+            }
+        }
+    }
+
+    delete[] buffer;
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t count, uint32_t p)
+{
+    return count ? sorted[(count - 1) * p / 100] : 0;
+}
+
+static void report(const workload_job_t *job, job_stats_t *stats, float seconds)
+{
+    uint32_t count = std::min<uint32_t>(stats->sampled, TEST_SAMPLES);
+    std::sort(stats->samples, stats->samples + count);
+
+    uint32_t ios = stats->reads + stats->writes;
+    float kib = (float)ios * job->block_size / 1024;
+    printf("%-8s %6.1f IOPS (%lu reads, %lu writes), %8.1f KiB/s, latency us p50 %lu p90 %lu p99 %lu max %lu\n",
+           job->name, ios / seconds, stats->reads, stats->writes, kib / seconds,
+           percentile(stats->samples, count, 50), percentile(stats->samples, count, 90),
+           percentile(stats->samples, count, 99), stats->max_us);
+}
+
+static void run_workload(const workload_t *workload)
+{
+    Thread *threads[TEST_MAX_THREADS];
+    worker_t workers[TEST_MAX_THREADS];
+    size_t thread_count = 0;
+
+    SDBlockDevice card(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+    TEST_ASSERT_EQUAL(0, card.init());
+    TEST_ASSERT_EQUAL(0, card.frequency(TEST_FREQUENCY));
+    sd = &card;
+
+    printf("workload %s, %lu ms\n", workload->name, workload->duration_ms);
+    duration_us = workload->duration_ms * 1000;
+    clock_timer.reset();
+    clock_timer.start();
+
+    for (size_t j = 0; (j < TEST_MAX_JOBS) && workload->jobs[j].name; j++) {
+        const workload_job_t *job = &workload->jobs[j];
+        TEST_ASSERT(job->start + job->size <= card.size());
+        TEST_ASSERT_EQUAL(0, job->block_size % card.get_program_size());
+
+        job_stats_t *stats = &job_stats[j];
+        stats->reads = stats->writes = stats->errors = 0;
+        stats->max_us = stats->sampled = stats->next_block = 0;
+
+        for (uint32_t t = 0; t < job->threads; t++) {
+            TEST_ASSERT(thread_count < TEST_MAX_THREADS);
+            worker_t *worker = &workers[thread_count];
+            worker->job = job;
+            worker->stats = stats;
+            worker->seed = 0x9E3779B9 * (thread_count + 1);
+
+            threads[thread_count] = new Thread(osPriorityNormal, TEST_THREAD_STACK);
+            TEST_ASSERT_EQUAL(osOK, threads[thread_count]->start(callback(run_worker, worker)));
+            thread_count++;
+        }
+    }
+
+    for (size_t t = 0; t < thread_count; t++) {
+        threads[t]->join();
+        delete threads[t];
+    }
+    clock_timer.stop();
+    float seconds = clock_timer.read();
+
+    for (size_t j = 0; (j < TEST_MAX_JOBS) && workload->jobs[j].name; j++) {
+        const workload_job_t *job = &workload->jobs[j];
+        job_stats_t *stats = &job_stats[j];
+        report(job, stats, seconds);
+
+        TEST_ASSERT_EQUAL(0, stats->errors);
+        TEST_ASSERT(stats->reads + stats->writes > 0);
+        if (job->rate_iops) {
+            // Within 10% and a transfer per thread of the limit
+            TEST_ASSERT((stats->reads + stats->writes) / seconds <= job->rate_iops * 1.1f + job->threads);
+        }
+    }
+
+    TEST_ASSERT_EQUAL(0, card.deinit());
+}
+
+void test_mixed_workload()
+{
+    run_workload(&mixed_workload);
+}
+
+void test_zipf_workload()
+{
+    run_workload(&zipf_workload);
+}
+
+void test_logger_workload()
+{
+    run_workload(&logger_workload);
+}
+
+void test_limited_workload()
+{
+    run_workload(&limited_workload);
+}
+
+// Test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(120, "default_auto");
+    zipf_setup();
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Testing 70/30 random mix", test_mixed_workload),
+    Case("Testing zipfian hot spots", test_zipf_workload),
+    Case("Testing bursty logger and reader", test_logger_workload),
+    Case("Testing rate limited writers", test_limited_workload),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
@@ -0,0 +1,257 @@
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+#include <stdlib.h>
+#include <errno.h>
+
+using namespace utest::v1;
+
+// test configuration
+#ifndef MBED_TEST_FILESYSTEM
+#define MBED_TEST_FILESYSTEM FATFileSystem
+#endif
+
+#ifndef MBED_TEST_FILESYSTEM_DECL
+#define MBED_TEST_FILESYSTEM_DECL MBED_TEST_FILESYSTEM fs("fs")
+#endif
+
+#ifndef MBED_TEST_BLOCKDEVICE
+#define MBED_TEST_BLOCKDEVICE SDBlockDevice
+#define MBED_TEST_BLOCKDEVICE_DECL SDBlockDevice bd(MBED_CONF_SD_SPI_MOSI, MBED_CONF_SD_SPI_MISO, MBED_CONF_SD_SPI_CLK, MBED_CONF_SD_SPI_CS);
+#endif
+
+#ifndef MBED_TEST_BLOCKDEVICE_DECL
+#define MBED_TEST_BLOCKDEVICE_DECL MBED_TEST_BLOCKDEVICE bd
+#endif
+
+#ifndef MBED_TEST_BUFFER
+#define MBED_TEST_BUFFER 8192
+#endif
+
+#ifndef MBED_TEST_TIMEOUT
+#define MBED_TEST_TIMEOUT 240
+#endif
+
+// Bytes logged by each method, and the size of a plain file write
+#ifndef MBED_TEST_LOG_SIZE
+#define MBED_TEST_LOG_SIZE (2*1024*1024)
+#endif
+
+#ifndef MBED_TEST_RECORD_SIZE
+#define MBED_TEST_RECORD_SIZE 512
+#endif
+
+
+// declarations
+#define STRINGIZE(x) STRINGIZE2(x)
+#define STRINGIZE2(x) #x
+#define INCLUDE(x) STRINGIZE(x.h)
+
+#include INCLUDE(MBED_TEST_FILESYSTEM)
+#include INCLUDE(MBED_TEST_BLOCKDEVICE)
+#include "SDFileExtent.h"
+
+MBED_TEST_FILESYSTEM_DECL;
+MBED_TEST_BLOCKDEVICE_DECL;
+
+File file;
+SDFileExtent extent;
+Timer timer;
+uint8_t buffer[MBED_TEST_BUFFER];
+uint32_t plain_kbps;
+
+static void fill(uint8_t *data, size_t size, uint32_t offset)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)((offset + i) * 31 + ((offset + i) >> 9));
+    }
+}
+
+static uint32_t kbps(bd_size_t bytes, int ms)
+{
+    return (uint32_t)(bytes * 1000 / 1024 / (ms ? ms : 1));
+}
+
+
+// tests
+
+void test_plain_writes() {
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+
+    {
+        res = MBED_TEST_FILESYSTEM::format(&bd);
+        TEST_ASSERT_EQUAL(0, res);
+        res = fs.mount(&bd);
+        TEST_ASSERT_EQUAL(0, res);
+        res = file.open(&fs, "plain.bin", O_WRONLY | O_CREAT | O_TRUNC);
+        TEST_ASSERT_EQUAL(0, res);
+
+        timer.reset();
+        timer.start();
+        for (uint32_t offset = 0; offset < MBED_TEST_LOG_SIZE; offset += MBED_TEST_RECORD_SIZE) {
+            fill(buffer, MBED_TEST_RECORD_SIZE, offset);
+            res = file.write(buffer, MBED_TEST_RECORD_SIZE);
+            TEST_ASSERT_EQUAL(MBED_TEST_RECORD_SIZE, res);
+        }
+        res = file.close();
+        TEST_ASSERT_EQUAL(0, res);
+        timer.stop();
+
+        plain_kbps = kbps(MBED_TEST_LOG_SIZE, timer.read_ms());
+        printf("plain file writes: %d bytes in %d ms, %lu KiB/s\n",
+               MBED_TEST_LOG_SIZE, timer.read_ms(), plain_kbps);
+        res = fs.unmount();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+void test_extent_appends() {
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+
+    {
+        res = fs.mount(&bd);
+        TEST_ASSERT_EQUAL(0, res);
+        res = extent.open(&fs, &bd, "extent.bin", 4ULL * 1024 * 1024 * 1024);
+        TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_PARAMETER, res);
+        res = extent.open(&fs, &bd, "extent.bin", MBED_TEST_LOG_SIZE);
+        TEST_ASSERT_EQUAL(0, res);
+        TEST_ASSERT_EQUAL(MBED_TEST_LOG_SIZE, extent.get_capacity());
+
+        timer.reset();
+        timer.start();
+        for (uint32_t offset = 0; offset < MBED_TEST_LOG_SIZE; offset += MBED_TEST_BUFFER) {
+            fill(buffer, MBED_TEST_BUFFER, offset);
+            res = extent.append(buffer, MBED_TEST_BUFFER);
+            TEST_ASSERT_EQUAL(0, res);
+            if (offset + MBED_TEST_BUFFER == MBED_TEST_LOG_SIZE / 2) {
+                res = extent.checkpoint();
+                TEST_ASSERT_EQUAL(0, res);
+            }
+        }
+        // Appends past the capacity are refused
+        res = extent.append(buffer, 512);
+        TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_PARAMETER, res);
+        res = extent.close();
+        TEST_ASSERT_EQUAL(0, res);
+        timer.stop();
+
+        uint32_t extent_kbps = kbps(MBED_TEST_LOG_SIZE, timer.read_ms());
+        printf("extent appends: %d bytes in %d ms, %lu KiB/s, %lu%% of plain writes\n",
+               MBED_TEST_LOG_SIZE, timer.read_ms(), extent_kbps,
+               plain_kbps ? extent_kbps * 100 / plain_kbps : 0);
+        TEST_ASSERT(extent_kbps >= plain_kbps);
+
+        // So are appends to a closed extent
+        res = extent.append(buffer, 512);
+        TEST_ASSERT_EQUAL(SD_BLOCK_DEVICE_ERROR_NO_INIT, res);
+        res = fs.unmount();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+void test_extent_contents() {
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+
+    {
+        res = fs.mount(&bd);
+        TEST_ASSERT_EQUAL(0, res);
+        res = file.open(&fs, "extent.bin", O_RDONLY);
+        TEST_ASSERT_EQUAL(0, res);
+        TEST_ASSERT_EQUAL(MBED_TEST_LOG_SIZE, file.size());
+
+        for (uint32_t offset = 0; offset < MBED_TEST_LOG_SIZE; offset += MBED_TEST_BUFFER) {
+            res = file.read(buffer, MBED_TEST_BUFFER);
+            TEST_ASSERT_EQUAL(MBED_TEST_BUFFER, res);
+            for (size_t i = 0; i < MBED_TEST_BUFFER; i++) {
+                uint32_t pos = offset + i;
+                TEST_ASSERT_EQUAL((uint8_t)(pos * 31 + (pos >> 9)), buffer[i]);
+            }
+        }
+        res = file.close();
+        TEST_ASSERT_EQUAL(0, res);
+        res = fs.unmount();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+void test_extent_checkpoint() {
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+
+    {
+        res = fs.mount(&bd);
+        TEST_ASSERT_EQUAL(0, res);
+        res = extent.open(&fs, &bd, "extent.bin", MBED_TEST_LOG_SIZE);
+        TEST_ASSERT_EQUAL(0, res);
+
+        fill(buffer, MBED_TEST_BUFFER, 0);
+        res = extent.append(buffer, MBED_TEST_BUFFER);
+        TEST_ASSERT_EQUAL(0, res);
+        res = extent.checkpoint();
+        TEST_ASSERT_EQUAL(0, res);
+
+        // Appended after the checkpoint, not part of the file until the next one
+        res = extent.append(buffer, MBED_TEST_BUFFER);
+        TEST_ASSERT_EQUAL(0, res);
+
+        // What a power cut now would leave on the card
+        {
+            MBED_TEST_FILESYSTEM fs2("fs2");
+            res = fs2.mount(&bd);
+            TEST_ASSERT_EQUAL(0, res);
+            res = file.open(&fs2, "extent.bin", O_RDONLY);
+            TEST_ASSERT_EQUAL(0, res);
+            TEST_ASSERT_EQUAL(MBED_TEST_BUFFER, file.size());
+            res = file.close();
+            TEST_ASSERT_EQUAL(0, res);
+            res = fs2.unmount();
+            TEST_ASSERT_EQUAL(0, res);
+        }
+
+        res = extent.close();
+        TEST_ASSERT_EQUAL(0, res);
+        res = file.open(&fs, "extent.bin", O_RDONLY);
+        TEST_ASSERT_EQUAL(0, res);
+        TEST_ASSERT_EQUAL(2*MBED_TEST_BUFFER, file.size());
+        res = file.close();
+        TEST_ASSERT_EQUAL(0, res);
+        res = fs.unmount();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+
+// test setup
+utest::v1::status_t test_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(MBED_TEST_TIMEOUT, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Plain file writes", test_plain_writes),
+    Case("Extent appends", test_extent_appends),
+    Case("Extent contents", test_extent_contents),
+    Case("Extent checkpoint", test_extent_checkpoint),
+};
+
+Specification specification(test_setup, cases);
+
+int main() {
+    return !Harness::run(specification);
+}
@@ -0,0 +1,297 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Trace pages
+ * -----------
+ * On a trace device, records are collected in a page buffer of the device's
+ * program size. A page is programmed as soon as it is full, and the page
+ * being filled is programmed padded with SD_TRACE_END records at every sync
+ * and at deinit, so a trace read back from the device always ends with an
+ * end marker or at the end of the region. Records after the last full page
+ * are rewritten in place by later syncs.
+ */
+
+#include "TraceBlockDevice.h"
+#include "rtos.h"
+#include "mbed_debug.h"
+#include <string.h>
+
+#define TRACE_DBG 0
+
+TraceBlockDevice::TraceBlockDevice(BlockDevice *bd, sd_trace_record_t *records, size_t count)
+    : _bd(bd), _records(records), _capacity(count), _count(0), _dropped(0), _trace(NULL),
+      _trace_addr(0), _trace_size(0), _page_records(0), _thread_count(0), _init_ref_count(0),
+      _is_initialized(false)
+{
+}
+
+TraceBlockDevice::TraceBlockDevice(BlockDevice *bd, BlockDevice *trace, bd_addr_t addr, bd_size_t size)
+    : _bd(bd), _records(NULL), _capacity(0), _count(0), _dropped(0), _trace(trace),
+      _trace_addr(addr), _trace_size(size), _page_records(0), _thread_count(0), _init_ref_count(0),
+      _is_initialized(false)
+{
+}
+
+TraceBlockDevice::~TraceBlockDevice()
+{
+    if (_is_initialized) {
+        _init_ref_count = 1;
+        deinit();
+    }
+}
+
+int TraceBlockDevice::init()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+    }
+
+    _init_ref_count++;
+
+    if (_init_ref_count != 1) {
+        goto end;
+    }
+
+    err = _bd->init();
+    if (err) {
+        goto fail;
+    }
+
+    if (_trace) {
+        err = _trace->init();
+        if (err) {
+            goto fail_bd;
+        }
+
+        bd_size_t page_size = _trace->get_program_size();
+        bd_size_t region = _trace_size ? _trace_size : _trace->size() - _trace_addr;
+        if ((page_size % sizeof(sd_trace_record_t)) || (_trace_addr % page_size) ||
+                (_trace_addr + region > _trace->size()) || (region < page_size)) {
+            debug_if(TRACE_DBG, "Trace region does not fit the trace device\n");
+            err = BD_ERROR_DEVICE_ERROR;
+            goto fail_trace;
+        }
+        _page_records = page_size / sizeof(sd_trace_record_t);
+        _capacity = (region / page_size) * _page_records;
+        _records = new sd_trace_record_t[_page_records];
+    }
+
+    _count = 0;
+    _dropped = 0;
+    _thread_count = 0;
+    _timer.reset();
+    _timer.start();
+    _is_initialized = true;
+    goto end;
+
+fail_trace:
+    _trace->deinit();
+fail_bd:
+    _bd->deinit();
+fail:
+    _init_ref_count = 0;
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int TraceBlockDevice::deinit()
+{
+    int err = BD_ERROR_OK;
+
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _init_ref_count = 0;
+        goto end;
+    }
+
+    _init_ref_count--;
+
+    if (_init_ref_count) {
+        goto end;
+    }
+
+    _timer.stop();
+    _is_initialized = false;
+
+    if (_trace) {
+        err = _write_last_page();
+        delete[] _records;
+        _records = NULL;
+
+        int trace_err = _trace->deinit();
+        if (!err) {
+            err = trace_err;
+        }
+    }
+
+    {
+        int bd_err = _bd->deinit();
+        if (!err) {
+            err = bd_err;
+        }
+    }
+
+end:
+    _mutex.unlock();
+    return err;
+}
+
+int TraceBlockDevice::sync()
+{
+    _record(SD_TRACE_SYNC, 0, 0);
+
+    int err = _bd->sync();
+    if (_trace) {
+        _mutex.lock();
+        int trace_err = _is_initialized ? _write_last_page() : BD_ERROR_DEVICE_ERROR;
+        if (!trace_err) {
+            trace_err = _trace->sync();
+        }
+        _mutex.unlock();
+        if (!err) {
+            err = trace_err;
+        }
+    }
+    return err;
+}
+
+int TraceBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    _record(SD_TRACE_READ, addr, size);
+    return _bd->read(buffer, addr, size);
+}
+
+int TraceBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    _record(SD_TRACE_PROGRAM, addr, size);
+    return _bd->program(buffer, addr, size);
+}
+
+int TraceBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    _record(SD_TRACE_ERASE, addr, size);
+    return _bd->erase(addr, size);
+}
+
+int TraceBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    _record(SD_TRACE_TRIM, addr, size);
+    return _bd->trim(addr, size);
+}
+
+bd_size_t TraceBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t TraceBlockDevice::get_program_size() const
+{
+    return _bd->get_program_size();
+}
+
+bd_size_t TraceBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size();
+}
+
+bd_size_t TraceBlockDevice::size() const
+{
+    return _bd->size();
+}
+
+size_t TraceBlockDevice::get_record_count() const
+{
+    return _count;
+}
+
+size_t TraceBlockDevice::get_dropped_count() const
+{
+    return _dropped;
+}
+
+void TraceBlockDevice::_record(uint8_t op, bd_addr_t addr, bd_size_t size)
+{
+    _mutex.lock();
+
+    if (!_is_initialized) {
+        _mutex.unlock();
+        return;
+    }
+
+    if (_count >= _capacity) {
+        _dropped++;
+        _mutex.unlock();
+        return;
+    }
+
+    sd_trace_record_t *record = _trace ? &_records[_count % _page_records] : &_records[_count];
+    record->time_us = _timer.read_us();
+    record->block = addr / SD_TRACE_BLOCK_SIZE;
+    record->count = (size + SD_TRACE_BLOCK_SIZE - 1) / SD_TRACE_BLOCK_SIZE;
+    record->op = op;
+    record->thread = _thread_index();
+    record->reserved = 0;
+    _count++;
+
+    // A full page goes out right away, the buffer then collects the next one
+    if (_trace && !(_count % _page_records)) {
+        int err = _write_page((_count - 1) / _page_records);
+        debug_if(TRACE_DBG && err, "Trace page write failed: %d\n", err);
+    }
+
+    _mutex.unlock();
+}
+
+uint8_t TraceBlockDevice::_thread_index()
+{
+    osThreadId id = Thread::gettid();
+
+    for (size_t i = 0; i < _thread_count; i++) {
+        if (_threads[i] == id) {
+            return i;
+        }
+    }
+    if (_thread_count < SD_TRACE_THREADS) {
+        _threads[_thread_count] = id;
+        return _thread_count++;
+    }
+    return SD_TRACE_THREADS - 1;
+}
+
+// Program a page with the records logged in it so far, the rest marked as the end
+int TraceBlockDevice::_write_page(size_t page)
+{
+    size_t fill = _count - page * _page_records;
+    memset(&_records[fill], 0xFF, (_page_records - fill) * sizeof(sd_trace_record_t));
+
+    bd_size_t page_size = _page_records * sizeof(sd_trace_record_t);
+    return _trace->program(_records, _trace_addr + page * page_size, page_size);
+}
+
+// Program the page being filled, unless the region is full and the trace ends with it
+int TraceBlockDevice::_write_last_page()
+{
+    if (_count >= _capacity) {
+        return BD_ERROR_OK;
+    }
+    return _write_page(_count / _page_records);
+}
@@ -0,0 +1,210 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_TRACE_BLOCK_DEVICE_H
+#define MBED_TRACE_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "mbed.h"
+#include "platform/PlatformMutex.h"
+
+#define SD_TRACE_BLOCK_SIZE     512     /*!< Unit of the block and count fields of a trace record */
+#define SD_TRACE_THREADS        8       /*!< Threads told apart in a trace, later ones share the last index */
+
+/** Requests in a trace
+ */
+enum sd_trace_op_t {
+    SD_TRACE_READ = 0,
+    SD_TRACE_PROGRAM = 1,
+    SD_TRACE_ERASE = 2,
+    SD_TRACE_TRIM = 3,
+    SD_TRACE_SYNC = 4,
+    SD_TRACE_OPS = 5,
+    SD_TRACE_END = 0xFF,        /*!< Padding after the last record of a trace stored on a device */
+};
+
+/** One request of a trace, 16 bytes
+ */
+struct sd_trace_record_t {
+    uint32_t time_us;           /*!< Time of the request since init, wraps after 71 minutes */
+    uint32_t block;             /*!< First block of the request, in SD_TRACE_BLOCK_SIZE units */
+    uint32_t count;             /*!< Length of the request, in SD_TRACE_BLOCK_SIZE units */
+    uint8_t op;                 /*!< One of sd_trace_op_t */
+    uint8_t thread;             /*!< Index of the calling thread, in order of first request */
+    uint16_t reserved;
+};
+
+/** Block device recording every request to another block device
+ *
+ *  Each read, program, erase, trim and sync is logged as a compact record
+ *  before it is passed on. Records go to an array in RAM, or a page at a
+ *  time to a region of a second block device, so production traffic can be
+ *  captured in the field and replayed in the lab with util/TraceReplayer.
+ *
+ *  A trace on a device ends with SD_TRACE_END records. The page holding the
+ *  last records is rewritten at every sync() and at deinit(), records logged
+ *  since the last of those are lost on power failure. When the array or the
+ *  region is full, further records are counted and dropped.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDBlockDevice.h"
+ * #include "SlicingBlockDevice.h"
+ * #include "TraceBlockDevice.h"
+ *
+ * SDBlockDevice sd(p5, p6, p7, p8);
+ * SlicingBlockDevice data(&sd, 0, -16 * 1024 * 1024);
+ * SlicingBlockDevice trace(&sd, -16 * 1024 * 1024);
+ * TraceBlockDevice traced(&data, &trace);
+ * FATFileSystem fs("sd", &traced);
+ * @endcode
+ */
+class TraceBlockDevice : public BlockDevice {
+public:
+    /** Lifetime of a trace block device recording to RAM
+     *
+     *  @param bd       Underlying block device
+     *  @param records  Array receiving the trace
+     *  @param count    Number of records the array holds
+     */
+    TraceBlockDevice(BlockDevice *bd, sd_trace_record_t *records, size_t count);
+
+    /** Lifetime of a trace block device recording to a second block device
+     *
+     *  @param bd       Underlying block device
+     *  @param trace    Block device receiving the trace, with a program size that
+     *                  is a multiple of the record size
+     *  @param addr     Start of the trace region on the trace device
+     *  @param size     Size of the trace region, 0 for the rest of the device
+     */
+    TraceBlockDevice(BlockDevice *bd, BlockDevice *trace, bd_addr_t addr = 0, bd_size_t size = 0);
+    virtual ~TraceBlockDevice();
+
+    /** Initialize both block devices and start the trace clock
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Write the last trace page and deinitialize both block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Record a sync, write the last trace page and sync both block devices
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Record and pass on a read
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Record and pass on a program
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Record and pass on an erase
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Record and pass on a trim
+     *
+     *  @param addr     Address of block to mark as unused
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of an erasable block
+     *
+     *  @return         Size of an erasable block in bytes
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+    /** Get the number of records in the trace
+     *
+     *  @return         Records stored since init, dropped ones excluded
+     */
+    size_t get_record_count() const;
+
+    /** Get the number of records that did not fit
+     *
+     *  @return         Records dropped since init
+     */
+    size_t get_dropped_count() const;
+
+private:
+    void _record(uint8_t op, bd_addr_t addr, bd_size_t size);
+    uint8_t _thread_index();
+    int _write_page(size_t page);
+    int _write_last_page();
+
+    BlockDevice *_bd;
+    sd_trace_record_t *_records;    /**< RAM trace, or the page buffer of a device trace */
+    size_t _capacity;               /**< Records the RAM array or the trace region holds */
+    size_t _count;
+    size_t _dropped;
+
+    BlockDevice *_trace;            /**< NULL when recording to RAM */
+    bd_addr_t _trace_addr;
+    bd_size_t _trace_size;
+    size_t _page_records;           /**< Records per trace page */
+
+    osThreadId _threads[SD_TRACE_THREADS];
+    size_t _thread_count;
+    Timer _timer;
+
+    PlatformMutex _mutex;
+    uint32_t _init_ref_count;
+    bool _is_initialized;
+};
+
+#endif  /* MBED_TRACE_BLOCK_DEVICE_H */
@@ -0,0 +1,123 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SlowCardBlockDevice.h"
+
+const slow_card_profile_t SlowCardBlockDevice::DEFAULT_PROFILE = {
+    64 * 1024,  // au_size
+    200,        // command_us
+    250,        // kib_us, about 4 MB/s
+    20,         // seek_ms
+    100,        // au_switch_ms
+    0,          // stall_ms
+    0,          // stall_interval
+};
+
+SlowCardBlockDevice::SlowCardBlockDevice(BlockDevice *bd, const slow_card_profile_t &profile)
+    : _bd(bd), _profile(profile), _next(0), _since_stall(0), _delay_us(0)
+{
+}
+
+SlowCardBlockDevice::~SlowCardBlockDevice()
+{
+}
+
+int SlowCardBlockDevice::init()
+{
+    return _bd->init();
+}
+
+int SlowCardBlockDevice::deinit()
+{
+    return _bd->deinit();
+}
+
+int SlowCardBlockDevice::sync()
+{
+    return _bd->sync();
+}
+
+int SlowCardBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    _delay(_profile.command_us + _profile.kib_us * size / 1024);
+    return _bd->read(buffer, addr, size);
+}
+
+int SlowCardBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    uint32_t us = _profile.command_us + _profile.kib_us * size / 1024;
+
+    if (addr != _next) {
+        if (addr / _profile.au_size != _next / _profile.au_size) {
+            us += _profile.au_switch_ms * 1000;
+        } else {
+            us += _profile.seek_ms * 1000;
+        }
+    }
+    _next = addr + size;
+
+    _since_stall += size;
+    if (_profile.stall_ms && (_since_stall >= _profile.stall_interval)) {
+        us += _profile.stall_ms * 1000;
+        _since_stall = 0;
+    }
+
+    _delay(us);
+    return _bd->program(buffer, addr, size);
+}
+
+int SlowCardBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    return _bd->erase(addr, size);
+}
+
+int SlowCardBlockDevice::trim(bd_addr_t addr, bd_size_t size)
+{
+    _delay(_profile.command_us);
+    return _bd->trim(addr, size);
+}
+
+bd_size_t SlowCardBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t SlowCardBlockDevice::get_program_size() const
+{
+    return _bd->get_program_size();
+}
+
+bd_size_t SlowCardBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size();
+}
+
+bd_size_t SlowCardBlockDevice::size() const
+{
+    return _bd->size();
+}
+
+uint32_t SlowCardBlockDevice::get_delay_ms() const
+{
+    return _delay_us / 1000;
+}
+
+void SlowCardBlockDevice::_delay(uint32_t us)
+{
+    _delay_us += us;
+    wait_ms(us / 1000);
+    wait_us(us % 1000);
+}
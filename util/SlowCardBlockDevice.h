@@ -0,0 +1,86 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SLOW_CARD_BLOCK_DEVICE_H
+#define MBED_SLOW_CARD_BLOCK_DEVICE_H
+
+#include "BlockDevice.h"
+#include "mbed.h"
+
+/** Timing model of a cheap SD card
+ */
+struct slow_card_profile_t {
+    bd_size_t au_size;          /*!< Allocation unit the card writes in */
+    uint32_t command_us;        /*!< Fixed cost of every command */
+    uint32_t kib_us;            /*!< Transfer cost per KiB */
+    uint32_t seek_ms;           /*!< Cost of a write that does not follow the previous one in the same AU */
+    uint32_t au_switch_ms;      /*!< Cost of a write that does not follow the previous one, in another AU */
+    uint32_t stall_ms;          /*!< Garbage collection pause, 0 for none */
+    bd_size_t stall_interval;   /*!< Bytes written between garbage collection pauses */
+};
+
+/** Block device adding the write timing of a slow card to another block device
+ *
+ *  Cheap cards only keep one allocation unit open for writing. A write that
+ *  continues where the previous one ended is fast; any other write makes the
+ *  card copy the rest of the open AU before it can proceed, which costs tens
+ *  to hundreds of milliseconds. This layer adds those delays on top of the
+ *  underlying device, so write patterns can be compared reproducibly without
+ *  a bad card at hand.
+ */
+class SlowCardBlockDevice : public BlockDevice {
+public:
+    /** Default profile, a class 4 card with 64 KiB allocation units
+     */
+    static const slow_card_profile_t DEFAULT_PROFILE;
+
+    /** Lifetime of the slow card block device
+     *
+     *  @param bd       Underlying block device
+     *  @param profile  Timing model
+     */
+    SlowCardBlockDevice(BlockDevice *bd, const slow_card_profile_t &profile = DEFAULT_PROFILE);
+    virtual ~SlowCardBlockDevice();
+
+    virtual int init();
+    virtual int deinit();
+    virtual int sync();
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+    virtual bd_size_t get_read_size() const;
+    virtual bd_size_t get_program_size() const;
+    virtual bd_size_t get_erase_size() const;
+    virtual bd_size_t size() const;
+
+    /** Get the time spent in simulated delays
+     *
+     *  @return         Total simulated delay in milliseconds
+     */
+    uint32_t get_delay_ms() const;
+
+private:
+    void _delay(uint32_t us);
+
+    BlockDevice *_bd;
+    slow_card_profile_t _profile;
+    bd_addr_t _next;                /**< Address following the last write */
+    bd_size_t _since_stall;         /**< Bytes written since the last garbage collection pause */
+    uint64_t _delay_us;
+};
+
+#endif  /* MBED_SLOW_CARD_BLOCK_DEVICE_H */
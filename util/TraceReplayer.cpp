@@ -0,0 +1,244 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TraceReplayer.h"
+#include <string.h>
+
+#define TRACE_REPLAY_STACK      1024
+
+TraceReplayer::TraceReplayer(const sd_trace_record_t *records, size_t count)
+    : _records(records), _loaded(NULL), _count(count), _speed(0), _threaded(false),
+      _bd(NULL), _buffer_size(0), _stats(NULL)
+{
+}
+
+TraceReplayer::TraceReplayer()
+    : _records(NULL), _loaded(NULL), _count(0), _speed(0), _threaded(false),
+      _bd(NULL), _buffer_size(0), _stats(NULL)
+{
+}
+
+TraceReplayer::~TraceReplayer()
+{
+    delete[] _loaded;
+}
+
+int TraceReplayer::load(BlockDevice *trace, bd_addr_t addr, bd_size_t size)
+{
+    bd_size_t page_size = trace->get_program_size();
+    size_t page_records = page_size / sizeof(sd_trace_record_t);
+    bd_size_t region = size ? size : trace->size() - addr;
+    sd_trace_record_t *page = new sd_trace_record_t[page_records];
+    size_t count = 0;
+    bool done = false;
+    int err = BD_ERROR_OK;
+
+    // Count the records up to the end marker, then read them for good
+    for (bd_addr_t a = addr; (a + page_size <= addr + region) && !done; a += page_size) {
+        err = trace->read(page, a, page_size);
+        if (err) {
+            goto end;
+        }
+        for (size_t i = 0; (i < page_records) && !done; i++) {
+            done = (SD_TRACE_END == page[i].op);
+            count += done ? 0 : 1;
+        }
+    }
+
+    delete[] _loaded;
+    _loaded = new sd_trace_record_t[count ? count : 1];
+    for (size_t read = 0; read < count; read += page_records) {
+        err = trace->read(page, addr + (read / page_records) * page_size, page_size);
+        if (err) {
+            goto end;
+        }
+        memcpy(&_loaded[read], page, ((count - read < page_records) ? count - read : page_records) *
+               sizeof(sd_trace_record_t));
+    }
+
+end:
+    delete[] page;
+    _records = _loaded;
+    _count = err ? 0 : count;
+    return err;
+}
+
+void TraceReplayer::set_speed(float speed)
+{
+    _speed = speed;
+}
+
+void TraceReplayer::set_threaded(bool threaded)
+{
+    _threaded = threaded;
+}
+
+size_t TraceReplayer::get_record_count() const
+{
+    return _count;
+}
+
+const sd_trace_record_t *TraceReplayer::get_records() const
+{
+    return _records;
+}
+
+int TraceReplayer::replay(BlockDevice *bd, trace_replay_stats_t *stats)
+{
+    worker_t workers[SD_TRACE_THREADS];
+    Thread *threads[SD_TRACE_THREADS];
+    bool present[SD_TRACE_THREADS] = {false};
+    size_t worker_count = 0;
+    int err = BD_ERROR_OK;
+
+    memset(stats, 0, sizeof(*stats));
+    _bd = bd;
+    _stats = stats;
+
+    // One buffer per worker, large enough for the largest request
+    _buffer_size = bd->get_read_size();
+    for (size_t i = 0; i < _count; i++) {
+        if ((SD_TRACE_READ == _records[i].op) || (SD_TRACE_PROGRAM == _records[i].op)) {
+            bd_size_t size = (bd_size_t)_records[i].count * SD_TRACE_BLOCK_SIZE;
+            _buffer_size = (size > _buffer_size) ? size : _buffer_size;
+        }
+        present[_records[i].thread % SD_TRACE_THREADS] = true;
+    }
+
+    if (_threaded) {
+        for (uint8_t t = 0; t < SD_TRACE_THREADS; t++) {
+            if (present[t]) {
+                workers[worker_count].thread = t;
+                worker_count++;
+            }
+        }
+    } else {
+        workers[0].thread = SD_TRACE_THREADS;
+        worker_count = 1;
+    }
+
+    _timer.reset();
+    _timer.start();
+    for (size_t w = 0; w < worker_count; w++) {
+        workers[w].replayer = this;
+        workers[w].buffer = new uint8_t[_buffer_size];
+        workers[w].err = BD_ERROR_OK;
+        threads[w] = NULL;
+        if (_threaded) {
+            threads[w] = new Thread(osPriorityNormal, TRACE_REPLAY_STACK);
+            threads[w]->start(callback(TraceReplayer::_worker, &workers[w]));
+        }
+    }
+
+    if (!_threaded) {
+        _run(&workers[0]);
+    }
+
+    for (size_t w = 0; w < worker_count; w++) {
+        if (threads[w]) {
+            threads[w]->join();
+            delete threads[w];
+        }
+        delete[] workers[w].buffer;
+        if (!err) {
+            err = workers[w].err;
+        }
+    }
+
+    if (!err) {
+        err = bd->sync();
+    }
+    _timer.stop();
+    stats->elapsed_ms = _timer.read_ms();
+    return err;
+}
+
+void TraceReplayer::_worker(worker_t *worker)
+{
+    worker->replayer->_run(worker);
+}
+
+void TraceReplayer::_run(worker_t *worker)
+{
+    for (size_t i = 0; i < _count; i++) {
+        const sd_trace_record_t *record = &_records[i];
+        if ((worker->thread != SD_TRACE_THREADS) && (worker->thread != record->thread % SD_TRACE_THREADS)) {
+            continue;
+        }
+
+        // Hold the request back until its time comes at the chosen pace
+        if (_speed > 0) {
+            int32_t ahead_us = (int32_t)(record->time_us / _speed) - _timer.read_us();
+            if (ahead_us > 1000) {
+                Thread::wait(ahead_us / 1000);
+            }
+        }
+
+        uint32_t begin = _timer.read_us();
+        int err = _issue(record, worker->buffer);
+        uint32_t latency = _timer.read_us() - begin;
+
+        _mutex.lock();
+        if (record->op < SD_TRACE_OPS) {
+            _stats->ops[record->op]++;
+        }
+        _stats->bytes += (uint64_t)record->count * SD_TRACE_BLOCK_SIZE;
+        _stats->busy_us += latency;
+        _stats->max_latency_us = (latency > _stats->max_latency_us) ? latency : _stats->max_latency_us;
+        if (err) {
+            _stats->errors++;
+        }
+        _mutex.unlock();
+
+        if (err && !worker->err) {
+            worker->err = err;
+        }
+    }
+}
+
+int TraceReplayer::_issue(const sd_trace_record_t *record, uint8_t *buffer)
+{
+    bd_addr_t addr = (bd_addr_t)record->block * SD_TRACE_BLOCK_SIZE;
+    bd_size_t size = (bd_size_t)record->count * SD_TRACE_BLOCK_SIZE;
+
+    if ((SD_TRACE_SYNC != record->op) && (addr + size > _bd->size())) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    switch (record->op) {
+        case SD_TRACE_READ:
+            return _bd->read(buffer, addr, size);
+
+        case SD_TRACE_PROGRAM:
+            for (bd_size_t offset = 0; offset < size; offset += sizeof(uint32_t)) {
+                uint32_t block = record->block + offset / SD_TRACE_BLOCK_SIZE;
+                memcpy(&buffer[offset], &block, sizeof(block));
+            }
+            return _bd->program(buffer, addr, size);
+
+        case SD_TRACE_ERASE:
+            return _bd->erase(addr, size);
+
+        case SD_TRACE_TRIM:
+            return _bd->trim(addr, size);
+
+        case SD_TRACE_SYNC:
+            return _bd->sync();
+
+        default:
+            return BD_ERROR_DEVICE_ERROR;
+    }
+}
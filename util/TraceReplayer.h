@@ -0,0 +1,139 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_TRACE_REPLAYER_H
+#define MBED_TRACE_REPLAYER_H
+
+#include "BlockDevice.h"
+#include "TraceBlockDevice.h"
+#include "mbed.h"
+#include "rtos.h"
+
+/** Results of a replay
+ */
+struct trace_replay_stats_t {
+    uint32_t ops[SD_TRACE_OPS];     /*!< Requests replayed, by sd_trace_op_t */
+    uint64_t bytes;                 /*!< Bytes read, programmed, erased and trimmed */
+    uint32_t errors;                /*!< Requests the block device failed or that fell outside it */
+    uint32_t elapsed_ms;            /*!< Wall time of the replay */
+    uint64_t busy_us;               /*!< Time spent inside the block device */
+    uint32_t max_latency_us;        /*!< Longest single request */
+};
+
+/** Replays a trace recorded by TraceBlockDevice against a block device stack
+ *
+ *  The stack under test can be a card, or a SlowCardBlockDevice simulating
+ *  one, with any caching or scheduling layers on top. Replaying the same
+ *  trace against different stacks compares them on real traffic.
+ *
+ *  Requests are replayed in order, as fast as possible or at the recorded
+ *  pace, optionally from one thread per recorded thread so that layers see
+ *  the original concurrency. Programs write a pattern holding the block
+ *  number, the data of the original requests is not in the trace.
+ *
+ * @code
+ * TraceReplayer replayer;
+ * replayer.load(&trace_region);
+ *
+ * SlowCardBlockDevice card(&scratch);
+ * CoalescingBlockDevice coalesced(&card);
+ * coalesced.init();
+ * replayer.replay(&coalesced, &stats);
+ * printf("%lu ms simulated\n", card.get_delay_ms());
+ * @endcode
+ */
+class TraceReplayer {
+public:
+    /** Lifetime of a replayer of a trace in RAM
+     *
+     *  @param records  Trace, not copied
+     *  @param count    Number of records
+     */
+    TraceReplayer(const sd_trace_record_t *records, size_t count);
+
+    /** Lifetime of a replayer, empty until load()
+     */
+    TraceReplayer();
+    virtual ~TraceReplayer();
+
+    /** Read a trace a TraceBlockDevice stored on a block device
+     *
+     *  @param trace    Initialized block device holding the trace
+     *  @param addr     Start of the trace region
+     *  @param size     Size of the trace region, 0 for the rest of the device
+     *  @return         0 on success or a negative error code on failure
+     */
+    int load(BlockDevice *trace, bd_addr_t addr = 0, bd_size_t size = 0);
+
+    /** Set the pace of the replay
+     *
+     *  @param speed    Multiple of the recorded pace, 0 to replay as fast as possible
+     */
+    void set_speed(float speed);
+
+    /** Replay each recorded thread from a thread of its own
+     *
+     *  @param threaded true to keep the recorded concurrency, false to replay
+     *                  every request from the calling thread
+     */
+    void set_threaded(bool threaded);
+
+    /** Replay the trace
+     *
+     *  @param bd       Initialized block device stack to replay against
+     *  @param stats    Structure receiving the results
+     *  @return         0 on success, or the first error of the block device
+     */
+    int replay(BlockDevice *bd, trace_replay_stats_t *stats);
+
+    /** Get the number of records in the trace
+     *
+     *  @return         Number of records
+     */
+    size_t get_record_count() const;
+
+    /** Get the trace
+     *
+     *  @return         Array of get_record_count() records
+     */
+    const sd_trace_record_t *get_records() const;
+
+private:
+    struct worker_t {
+        TraceReplayer *replayer;
+        uint8_t thread;             /**< Recorded thread replayed, or SD_TRACE_THREADS for all */
+        uint8_t *buffer;
+        int err;
+    };
+
+    static void _worker(worker_t *worker);
+    void _run(worker_t *worker);
+    int _issue(const sd_trace_record_t *record, uint8_t *buffer);
+
+    const sd_trace_record_t *_records;
+    sd_trace_record_t *_loaded;     /**< Records owned by the replayer after load() */
+    size_t _count;
+    float _speed;
+    bool _threaded;
+
+    BlockDevice *_bd;
+    bd_size_t _buffer_size;
+    Timer _timer;
+    Mutex _mutex;
+    trace_replay_stats_t *_stats;
+};
+
+#endif  /* MBED_TRACE_REPLAYER_H */